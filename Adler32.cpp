@@ -52,6 +52,9 @@ computeAdler32SSE( unsigned char* data,
     unsigned int s1 = 1;
     unsigned int s2 = 0;
     unsigned int pre = (0x10 - ((size_t)(data)&0xfu))&0xfu;
+    if( pre > N ) {
+        pre = N;
+    }
     for(unsigned int i=0; i<pre; i++ ) {
         s1 = s1 + data[i];
         s2 = s2 + s1;
@@ -105,12 +108,26 @@ computeAdler32SSE( unsigned char* data,
     _tn = _mm_hadd_epi32( _tn, _mm_setzero_si128() );
     _tn = _mm_hadd_epi32( _tn, _mm_setzero_si128() );
     
-    s2 = s2 + 16*blocks*s1 + _mm_cvtsi128_si32( _tw );
-    s1 = s1 + _mm_cvtsi128_si32( _tn );
+    // 16*blocks*s1 overflows 32 bits for large N, reduce before multiplying.
+    s2 = ( s2 + ((16ull*blocks)%65521)*(s1%65521) + (unsigned int)_mm_cvtsi128_si32( _tw ) ) % 65521;
+    s1 = ( s1 + (unsigned int)_mm_cvtsi128_si32( _tn ) ) % 65521;
 
     for(unsigned int i=pre+16*blocks; i<N; i++ ) {
         s1 = s1 + data[i];
         s2 = s2 + s1;
     }
     return ((s2%65521) << 16) + (s1%65521);
-}
\ No newline at end of file
+}
+unsigned int
+combineAdler32( unsigned int adler_a,
+                unsigned int adler_b,
+                unsigned int N_b )
+{
+    // s1 = s1a + s1b - 1, s2 = s2a + s2b + N_b*(s1a - 1), all mod 65521.
+    const unsigned long long base = 65521;
+    unsigned long long n  = N_b % base;
+    unsigned long long s1 = ( (adler_a&0xffffu) + (adler_b&0xffffu) + base - 1 ) % base;
+    unsigned long long s2 = ( (adler_a>>16) + (adler_b>>16)
+                              + n*((adler_a&0xffffu) + base - 1) ) % base;
+    return (unsigned int)( (s2 << 16) | s1 );
+}
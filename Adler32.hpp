@@ -11,3 +11,9 @@ computeAdler32Blocked( unsigned char* data,
 unsigned int
 computeAdler32SSE( unsigned char* data,
                    unsigned int N );
+
+/** Adler-32 of the concatenation A+B given adler(A), adler(B) and the length of B. */
+unsigned int
+combineAdler32( unsigned int adler_a,
+                unsigned int adler_b,
+                unsigned int N_b );
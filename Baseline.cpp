@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include "Baseline.hpp"
+
+namespace {
+
+const char* baseline_header = "# imgcompbench baseline v1";
+
+void
+writeEntry( std::ostream& out,
+            const BenchmarkResult& r,
+            const std::string& stage,
+            const std::vector<double>& seconds )
+{
+    out << r.m_image << '\t'
+        << r.m_encoder << '\t'
+        << r.m_threads << '\t'
+        << stage << '\t'
+        << r.m_output_bytes << '\t';
+    for( size_t i=0; i<seconds.size(); i++ ) {
+        out << (i ? "," : "") << seconds[i];
+    }
+    out << '\n';
+}
+
+std::vector<std::string>
+splitTabs( const std::string& line )
+{
+    std::vector<std::string> fields;
+    size_t a = 0;
+    for(;;) {
+        size_t b = line.find( '\t', a );
+        fields.push_back( line.substr( a, b == std::string::npos ? std::string::npos : b-a ) );
+        if( b == std::string::npos ) {
+            return fields;
+        }
+        a = b + 1;
+    }
+}
+
+double
+median( std::vector<double> v )
+{
+    if( v.empty() ) {
+        return 0.0;
+    }
+    std::sort( v.begin(), v.end() );
+    size_t n = v.size();
+    return n & 1 ? v[n/2] : 0.5*(v[n/2-1] + v[n/2]);
+}
+
+const BaselineEntry*
+findEntry( const std::vector<BaselineEntry>& baseline,
+           const BenchmarkResult& r,
+           const std::string& stage )
+{
+    for( size_t i=0; i<baseline.size(); i++ ) {
+        const BaselineEntry& e = baseline[i];
+        if( e.m_image == r.m_image && e.m_encoder == r.m_encoder &&
+            e.m_threads == r.m_threads && e.m_stage == stage )
+        {
+            return &e;
+        }
+    }
+    return NULL;
+}
+
+/** Prints one comparison line, returns true if significantly slower. */
+bool
+compareTimes( std::ostream& out,
+              const std::string& what,
+              const std::vector<double>& before,
+              const std::vector<double>& after,
+              const BaselineOptions& options )
+{
+    double m0 = median( before );
+    double m1 = median( after );
+    double delta = m0 > 0.0 ? m1/m0 - 1.0 : 0.0;
+    double p = mannWhitneyP( before, after );
+    bool significant = p < options.m_alpha && std::fabs( delta ) > options.m_threshold;
+
+    const char* verdict = "unchanged";
+    if( significant ) {
+        verdict = delta > 0.0 ? "SLOWER" : "faster";
+    }
+    std::stringstream pct;
+    pct.setf( std::ios::fixed );
+    pct.precision( 1 );
+    pct << (delta >= 0.0 ? "+" : "") << 100.0*delta << '%';
+    out << what << ":\t"
+        << m0 << " -> " << m1 << " s (" << pct.str() << ", p=" << p << ")\t"
+        << verdict << "\n";
+    return significant && delta > 0.0;
+}
+
+} // of anonymous namespace
+
+bool
+writeBaseline( const std::string& path, const std::vector<BenchmarkResult>& results )
+{
+    std::ofstream out( path.c_str() );
+    if( !out ) {
+        std::cerr << "Failed to open baseline file '" << path << "'\n";
+        return false;
+    }
+    out.precision( 9 );
+    out << baseline_header << "\n"
+        << "# image\tencoder\tthreads\tstage\toutput_bytes\tseconds\n";
+    for( size_t i=0; i<results.size(); i++ ) {
+        const BenchmarkResult& r = results[i];
+        writeEntry( out, r, "total", r.m_seconds );
+        for( size_t k=0; k<r.m_stages.size(); k++ ) {
+            writeEntry( out, r, r.m_stages[k].m_name, r.m_stages[k].m_seconds );
+        }
+    }
+    return true;
+}
+
+bool
+readBaseline( std::vector<BaselineEntry>& entries, const std::string& path )
+{
+    std::ifstream in( path.c_str() );
+    if( !in ) {
+        std::cerr << "Failed to open baseline file '" << path << "'\n";
+        return false;
+    }
+    std::string line;
+    if( !std::getline( in, line ) || line != baseline_header ) {
+        std::cerr << "'" << path << "' is not a baseline file.\n";
+        return false;
+    }
+    while( std::getline( in, line ) ) {
+        if( line.empty() || line[0] == '#' ) {
+            continue;
+        }
+        std::vector<std::string> fields = splitTabs( line );
+        if( fields.size() != 6 ) {
+            std::cerr << "Malformed line in baseline '" << path << "': " << line << "\n";
+            return false;
+        }
+        BaselineEntry e;
+        e.m_image = fields[0];
+        e.m_encoder = fields[1];
+        e.m_threads = atoi( fields[2].c_str() );
+        e.m_stage = fields[3];
+        e.m_output_bytes = atoi( fields[4].c_str() );
+        std::stringstream seconds( fields[5] );
+        std::string value;
+        while( std::getline( seconds, value, ',' ) ) {
+            e.m_seconds.push_back( atof( value.c_str() ) );
+        }
+        entries.push_back( e );
+    }
+    return true;
+}
+
+double
+mannWhitneyP( const std::vector<double>& a, const std::vector<double>& b )
+{
+    const size_t n1 = a.size();
+    const size_t n2 = b.size();
+    const size_t n = n1 + n2;
+    if( n1 == 0 || n2 == 0 ) {
+        return 1.0;
+    }
+
+    // Rank the pooled samples, ties get their average rank.
+    std::vector< std::pair<double,int> > pooled;
+    for( size_t i=0; i<n1; i++ ) {
+        pooled.push_back( std::make_pair( a[i], 0 ) );
+    }
+    for( size_t i=0; i<n2; i++ ) {
+        pooled.push_back( std::make_pair( b[i], 1 ) );
+    }
+    std::sort( pooled.begin(), pooled.end() );
+
+    double rank_sum = 0.0;
+    double ties = 0.0;
+    for( size_t i=0; i<n; ) {
+        size_t j = i;
+        while( j < n && pooled[j].first == pooled[i].first ) {
+            j++;
+        }
+        double rank = 0.5*(i + j + 1);     // ranks are 1-based
+        for( size_t k=i; k<j; k++ ) {
+            if( pooled[k].second == 0 ) {
+                rank_sum += rank;
+            }
+        }
+        double t = j - i;
+        ties += t*t*t - t;
+        i = j;
+    }
+
+    double U = rank_sum - 0.5*n1*(n1+1);
+    double mu = 0.5*n1*n2;
+    double sigma2 = (n1*n2/12.0)*((n+1) - ties/(double(n)*(n-1)));
+    if( sigma2 <= 0.0 ) {
+        return 1.0;
+    }
+    double z = std::max( 0.0, std::fabs( U - mu ) - 0.5 )/std::sqrt( sigma2 );
+    return std::erfc( z/std::sqrt( 2.0 ) );
+}
+
+int
+compareWithBaseline( std::ostream& out,
+                     const std::vector<BaselineEntry>& baseline,
+                     const std::vector<BenchmarkResult>& results,
+                     const BaselineOptions& options )
+{
+    int regressions = 0;
+    out << "Comparison with baseline (alpha=" << options.m_alpha
+        << ", threshold=" << 100.0*options.m_threshold << "%)\n";
+
+    for( size_t i=0; i<results.size(); i++ ) {
+        const BenchmarkResult& r = results[i];
+        std::stringstream name;
+        name << r.m_image << " " << r.m_encoder << "@" << r.m_threads << "t";
+
+        const BaselineEntry* total = findEntry( baseline, r, "total" );
+        if( total == NULL ) {
+            out << name.str() << ":\tnot in baseline\n";
+            continue;
+        }
+        if( r.m_seconds.size() < 5 || total->m_seconds.size() < 5 ) {
+            out << name.str() << ":\tfewer than 5 repetitions, timing test has little power\n";
+        }
+
+        bool regressed = compareTimes( out, name.str(), total->m_seconds, r.m_seconds, options );
+        if( r.m_output_bytes > total->m_output_bytes ) {
+            out << name.str() << ":\toutput grew " << total->m_output_bytes << " -> "
+                << r.m_output_bytes << " bytes\tLARGER\n";
+            regressed = true;
+        }
+        else if( r.m_output_bytes < total->m_output_bytes ) {
+            out << name.str() << ":\toutput shrank " << total->m_output_bytes << " -> "
+                << r.m_output_bytes << " bytes\n";
+        }
+
+        for( size_t k=0; k<r.m_stages.size(); k++ ) {
+            const StageResult& stage = r.m_stages[k];
+            const BaselineEntry* e = findEntry( baseline, r, stage.m_name );
+            if( e != NULL ) {
+                compareTimes( out, "    " + stage.m_name, e->m_seconds, stage.m_seconds, options );
+            }
+        }
+        if( regressed ) {
+            regressions++;
+        }
+    }
+    out << regressions << " regression" << (regressions == 1 ? "" : "s") << " found.\n";
+    return regressions;
+}
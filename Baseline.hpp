@@ -0,0 +1,51 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <ostream>
+#include "Benchmark.hpp"
+
+/** Timings of one encoder (stage == "total") or encoder stage on one image. */
+struct BaselineEntry
+{
+    std::string         m_image;
+    std::string         m_encoder;
+    int                 m_threads;
+    std::string         m_stage;
+    int                 m_output_bytes;
+    std::vector<double> m_seconds;      ///< One entry per timed repetition.
+};
+
+struct BaselineOptions
+{
+    BaselineOptions()
+        : m_alpha( 0.01 ),
+          m_threshold( 0.05 )
+    {}
+
+    double  m_alpha;        ///< Significance level of the Mann-Whitney U test.
+    double  m_threshold;    ///< Relative median slowdown below which changes are ignored.
+};
+
+/** Saves per-repetition timings and output sizes of results as a tab-separated file. */
+bool
+writeBaseline( const std::string& path, const std::vector<BenchmarkResult>& results );
+
+bool
+readBaseline( std::vector<BaselineEntry>& entries, const std::string& path );
+
+/** Two-sided p-value of the Mann-Whitney U test (normal approximation, tie corrected). */
+double
+mannWhitneyP( const std::vector<double>& a, const std::vector<double>& b );
+
+/** Prints per-encoder and per-stage deltas against the baseline.
+ *
+ * An encoder regresses if its output grew, or if its total time is both
+ * significantly different (p < alpha) and slower by more than the
+ * threshold. Stages are held to the same test and flagged, but only to
+ * point at the cause. Returns the number of regressed encoder runs.
+ */
+int
+compareWithBaseline( std::ostream& out,
+                     const std::vector<BaselineEntry>& baseline,
+                     const std::vector<BenchmarkResult>& results,
+                     const BaselineOptions& options );
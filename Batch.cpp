@@ -0,0 +1,332 @@
+#include <iostream>
+#include <algorithm>
+#include <deque>
+#include <cassert>
+#include <cstring>
+#include <cerrno>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "timer.hpp"
+#include "Trace.hpp"
+#include "ImageLoader.hpp"
+#include "OutputSink.hpp"
+#include "Batch.hpp"
+
+namespace {
+
+/** Image on its way through the pipeline. */
+struct BatchItem
+{
+    std::string     m_path;
+    int             m_width;
+    int             m_height;
+    ImageBuffer     m_image;        ///< Released once encoded.
+    MemorySink      m_encoded;
+};
+
+/** Fixed capacity FIFO between pipeline stages. */
+class BatchQueue
+{
+public:
+    explicit
+    BatchQueue( size_t capacity )
+        : m_capacity( std::max( (size_t)1, capacity ) ),
+          m_closed( false )
+    {
+        pthread_mutex_init( &m_mutex, NULL );
+        pthread_cond_init( &m_not_empty, NULL );
+        pthread_cond_init( &m_not_full, NULL );
+    }
+
+    ~BatchQueue()
+    {
+        pthread_mutex_destroy( &m_mutex );
+        pthread_cond_destroy( &m_not_empty );
+        pthread_cond_destroy( &m_not_full );
+    }
+
+    /** Blocks while the queue is full. */
+    void
+    push( BatchItem* item )
+    {
+        assert( pthread_mutex_lock( &m_mutex ) == 0 );
+        while( m_items.size() >= m_capacity ) {
+            pthread_cond_wait( &m_not_full, &m_mutex );
+        }
+        m_items.push_back( item );
+        pthread_cond_signal( &m_not_empty );
+        assert( pthread_mutex_unlock( &m_mutex ) == 0 );
+    }
+
+    /** Blocks while the queue is empty, returns NULL once it is closed and drained. */
+    BatchItem*
+    pop()
+    {
+        assert( pthread_mutex_lock( &m_mutex ) == 0 );
+        while( m_items.empty() && !m_closed ) {
+            pthread_cond_wait( &m_not_empty, &m_mutex );
+        }
+        BatchItem* item = NULL;
+        if( !m_items.empty() ) {
+            item = m_items.front();
+            m_items.pop_front();
+            pthread_cond_signal( &m_not_full );
+        }
+        assert( pthread_mutex_unlock( &m_mutex ) == 0 );
+        return item;
+    }
+
+    /** No more pushes will follow, wakes up all waiting consumers. */
+    void
+    close()
+    {
+        assert( pthread_mutex_lock( &m_mutex ) == 0 );
+        m_closed = true;
+        pthread_cond_broadcast( &m_not_empty );
+        assert( pthread_mutex_unlock( &m_mutex ) == 0 );
+    }
+
+protected:
+    size_t                  m_capacity;
+    bool                    m_closed;
+    std::deque<BatchItem*>  m_items;
+    pthread_mutex_t         m_mutex;
+    pthread_cond_t          m_not_empty;
+    pthread_cond_t          m_not_full;
+};
+
+/** State shared by the reader and writer threads. */
+struct BatchState
+{
+    BatchState( const std::vector<std::string>& files,
+                const BatchOptions& options,
+                const std::string& extension )
+        : m_files( files ),
+          m_options( options ),
+          m_extension( extension ),
+          m_read_queue( options.m_read_queue ),
+          m_write_queue( options.m_write_queue ),
+          m_next_file( 0 ),
+          m_readers_left( 0 ),
+          m_images( 0 ),
+          m_failed( 0 ),
+          m_output_bytes( 0 )
+    {
+        pthread_mutex_init( &m_mutex, NULL );
+    }
+
+    ~BatchState()
+    {
+        pthread_mutex_destroy( &m_mutex );
+    }
+
+    const std::vector<std::string>& m_files;
+    const BatchOptions&             m_options;
+    const std::string&              m_extension;
+    BatchQueue                      m_read_queue;
+    BatchQueue                      m_write_queue;
+    pthread_mutex_t                 m_mutex;        ///< Guards the members below.
+    size_t                          m_next_file;
+    int                             m_readers_left;
+    size_t                          m_images;
+    size_t                          m_failed;
+    size_t                          m_output_bytes;
+};
+
+std::string
+outputPath( const BatchState& state, const std::string& input )
+{
+    std::string name = input.substr( input.find_last_of( '/' ) + 1 );
+    size_t dot = name.find_last_of( '.' );
+    if( dot != std::string::npos && dot > 0 ) {
+        name = name.substr( 0, dot );
+    }
+    return state.m_options.m_output_dir + "/" + name + state.m_extension;
+}
+
+void*
+readerMain( void* arg )
+{
+    BatchState* state = (BatchState*)arg;
+    if( Trace::enabled() ) {
+        Trace::setThreadName( "batch reader" );
+    }
+    while( true ) {
+        assert( pthread_mutex_lock( &state->m_mutex ) == 0 );
+        size_t f = state->m_next_file++;
+        assert( pthread_mutex_unlock( &state->m_mutex ) == 0 );
+        if( f >= state->m_files.size() ) {
+            break;
+        }
+
+        BatchItem* item = new BatchItem;
+        item->m_path = state->m_files[f];
+        bool ok;
+        {
+            TraceScope trace( "batch", "read", f );
+            ok = loadImageFile( item->m_image, item->m_width, item->m_height, item->m_path,
+                                state->m_options.m_raw_w, state->m_options.m_raw_h, false );
+        }
+        if( !ok ) {
+            assert( pthread_mutex_lock( &state->m_mutex ) == 0 );
+            state->m_failed++;
+            assert( pthread_mutex_unlock( &state->m_mutex ) == 0 );
+            delete item;
+            continue;
+        }
+        state->m_read_queue.push( item );
+    }
+
+    // The last reader out tells the encoder that no more images follow.
+    assert( pthread_mutex_lock( &state->m_mutex ) == 0 );
+    bool last = --state->m_readers_left == 0;
+    assert( pthread_mutex_unlock( &state->m_mutex ) == 0 );
+    if( last ) {
+        state->m_read_queue.close();
+    }
+    return NULL;
+}
+
+void*
+writerMain( void* arg )
+{
+    BatchState* state = (BatchState*)arg;
+    if( Trace::enabled() ) {
+        Trace::setThreadName( "batch writer" );
+    }
+    while( BatchItem* item = state->m_write_queue.pop() ) {
+        bool ok = true;
+        if( !state->m_options.m_output_dir.empty() ) {
+            TraceScope trace( "batch", "write" );
+            FdSink file( outputPath( *state, item->m_path ) );
+            const std::vector<unsigned char>& data = item->m_encoded.data();
+            ok = file.ok() && file.write( data.data(), data.size() ) && file.flush();
+        }
+        assert( pthread_mutex_lock( &state->m_mutex ) == 0 );
+        if( ok ) {
+            state->m_images++;
+            state->m_output_bytes += item->m_encoded.bytes();
+        }
+        else {
+            state->m_failed++;
+        }
+        assert( pthread_mutex_unlock( &state->m_mutex ) == 0 );
+        delete item;
+    }
+    return NULL;
+}
+
+} // namespace
+
+bool
+listBatchInputs( std::vector<std::string>& files, const std::string& dir )
+{
+    DIR* d = opendir( dir.c_str() );
+    if( d == NULL ) {
+        std::cerr << "Failed to open directory '" << dir << "': " << strerror( errno ) << "\n";
+        return false;
+    }
+    std::vector<std::string> found;
+    while( struct dirent* entry = readdir( d ) ) {
+        if( entry->d_name[0] == '.' ) {
+            continue;
+        }
+        std::string path = dir + "/" + entry->d_name;
+        struct stat st;
+        if( stat( path.c_str(), &st ) == 0 && S_ISREG( st.st_mode ) ) {
+            found.push_back( path );
+        }
+    }
+    closedir( d );
+    std::sort( found.begin(), found.end() );
+    files.insert( files.end(), found.begin(), found.end() );
+    return true;
+}
+
+BatchResult
+runBatch( const EncoderRegistry::Entry& encoder,
+          ThreadPool* thread_pool,
+          const std::vector<std::string>& files,
+          const BatchOptions& options )
+{
+    BatchResult result;
+    BatchState state( files, options, encoder.m_extension );
+    TimeStamp start;
+
+    std::vector<pthread_t> readers( std::max( 1, options.m_readers ) );
+    std::vector<pthread_t> writers( std::max( 1, options.m_writers ) );
+    state.m_readers_left = readers.size();
+    for( size_t i=0; i<readers.size(); i++ ) {
+        assert( pthread_create( &readers[i], NULL, readerMain, &state ) == 0 );
+    }
+    for( size_t i=0; i<writers.size(); i++ ) {
+        assert( pthread_create( &writers[i], NULL, writerMain, &state ) == 0 );
+    }
+
+    while( true ) {
+        TimeStamp wait_start;
+        BatchItem* item = state.m_read_queue.pop();
+        TimeStamp wait_stop;
+        result.m_input_wait += TimeStamp::delta( wait_start, wait_stop );
+        if( item == NULL ) {
+            break;
+        }
+        if( !encoder.supports( item->m_image.format() ) ||
+            !encoder.accepts( item->m_image.format(), item->m_width, item->m_height ) )
+        {
+            std::cerr << "'" << item->m_path << "' is a " << item->m_width << "x" << item->m_height << " "
+                      << pixelFormatName( item->m_image.format() )
+                      << " image, which " << encoder.m_name << " does not take.\n";
+            assert( pthread_mutex_lock( &state.m_mutex ) == 0 );
+            state.m_failed++;
+            assert( pthread_mutex_unlock( &state.m_mutex ) == 0 );
+            delete item;
+            continue;
+        }
+        {
+            TraceScope trace( "batch", "encode" );
+            encoder.m_func( thread_pool, item->m_image, item->m_width, item->m_height, item->m_encoded );
+        }
+        result.m_input_bytes += item->m_image.size();
+        item->m_image.release();   // unmap or free the input before it queues up for writing
+
+        TimeStamp push_start;
+        state.m_write_queue.push( item );
+        TimeStamp push_stop;
+        result.m_output_wait += TimeStamp::delta( push_start, push_stop );
+    }
+    state.m_write_queue.close();
+
+    for( size_t i=0; i<readers.size(); i++ ) {
+        void* foo;
+        assert( pthread_join( readers[i], &foo ) == 0 );
+    }
+    for( size_t i=0; i<writers.size(); i++ ) {
+        void* foo;
+        assert( pthread_join( writers[i], &foo ) == 0 );
+    }
+    TimeStamp stop;
+
+    result.m_seconds = TimeStamp::delta( start, stop );
+    result.m_images = state.m_images;
+    result.m_failed = state.m_failed;
+    result.m_output_bytes = state.m_output_bytes;
+    return result;
+}
+
+void
+printBatchResult( std::ostream& out, const BatchResult& result )
+{
+    double s = result.m_seconds > 0.0 ? result.m_seconds : 1.0;
+    out << "batch:\t" << result.m_images << " images";
+    if( result.m_failed ) {
+        out << " (" << result.m_failed << " failed)";
+    }
+    out << " in " << result.m_seconds << "s, "
+        << (result.m_images/s) << " images/s, "
+        << (result.m_input_bytes/s)*1e-6 << " MB/s in, "
+        << (result.m_output_bytes/s)*1e-6 << " MB/s out\n"
+        << "    encoder waited " << result.m_input_wait << "s for input, "
+        << result.m_output_wait << "s for output\n";
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <ostream>
+#include "EncoderRegistry.hpp"
+
+struct BatchOptions
+{
+    BatchOptions()
+        : m_readers( 2 ),
+          m_writers( 1 ),
+          m_read_queue( 4 ),
+          m_write_queue( 4 ),
+          m_raw_w( 0 ),
+          m_raw_h( 0 )
+    {}
+
+    int         m_readers;      ///< Threads loading and decoding inputs.
+    int         m_writers;      ///< Threads writing encoded outputs.
+    int         m_read_queue;   ///< Decoded images waiting to be encoded.
+    int         m_write_queue;  ///< Encoded images waiting to be written.
+    std::string m_output_dir;   ///< Outputs are discarded if empty.
+    int         m_raw_w;        ///< Size of inputs that are raw RGB.
+    int         m_raw_h;
+};
+
+struct BatchResult
+{
+    BatchResult()
+        : m_images( 0 ),
+          m_failed( 0 ),
+          m_input_bytes( 0 ),
+          m_output_bytes( 0 ),
+          m_seconds( 0.0 ),
+          m_input_wait( 0.0 ),
+          m_output_wait( 0.0 )
+    {}
+
+    size_t  m_images;           ///< Images encoded and written.
+    size_t  m_failed;           ///< Images that failed to load or write.
+    size_t  m_input_bytes;      ///< Raw RGB bytes of encoded images.
+    size_t  m_output_bytes;
+    double  m_seconds;          ///< Wall time of the whole batch.
+    double  m_input_wait;       ///< Time the encoder stalled on an empty read queue.
+    double  m_output_wait;      ///< Time the encoder stalled on a full write queue.
+};
+
+/** Lists the regular, non-hidden files of a directory in sorted order. */
+bool
+listBatchInputs( std::vector<std::string>& files, const std::string& dir );
+
+/** Re-encodes a list of files through a bounded three-stage pipeline.
+ *
+ * Reader threads load and decode upcoming files into a read queue, the
+ * calling thread encodes them one at a time using the thread pool, and
+ * writer threads write the results from a write queue. Full queues block
+ * the stage before them, which bounds the number of images in memory.
+ */
+BatchResult
+runBatch( const EncoderRegistry::Entry& encoder,
+          ThreadPool* thread_pool,
+          const std::vector<std::string>& files,
+          const BatchOptions& options );
+
+void
+printBatchResult( std::ostream& out, const BatchResult& result );
@@ -0,0 +1,402 @@
+#include <algorithm>
+#include <iostream>
+#include <cmath>
+#include "timer.hpp"
+#include "Trace.hpp"
+#include "Benchmark.hpp"
+
+static
+void
+maxMemoryUsage( MemoryUsage& a, const MemoryUsage& b )
+{
+    a.m_allocated_bytes = std::max( a.m_allocated_bytes, b.m_allocated_bytes );
+    a.m_allocations     = std::max( a.m_allocations, b.m_allocations );
+    a.m_peak_heap_bytes = std::max( a.m_peak_heap_bytes, b.m_peak_heap_bytes );
+    a.m_leaked_bytes    = std::max( a.m_leaked_bytes, b.m_leaked_bytes );
+    a.m_peak_rss_bytes  = std::max( a.m_peak_rss_bytes, b.m_peak_rss_bytes );
+}
+
+static
+double
+percentile( const std::vector<double>& sorted, double p )
+{
+    if( sorted.empty() ) {
+        return 0.0;
+    }
+    // nearest-rank percentile
+    size_t rank = (size_t)std::ceil( p*sorted.size() );
+    if( rank < 1 ) {
+        rank = 1;
+    }
+    return sorted[ std::min( rank, sorted.size() ) - 1 ];
+}
+
+static
+std::string
+jsonEscape( const std::string& s )
+{
+    std::string r;
+    for( size_t i=0; i<s.size(); i++ ) {
+        char c = s[i];
+        if( c == '"' || c == '\\' ) {
+            r.push_back( '\\' );
+            r.push_back( c );
+        }
+        else if( (unsigned char)c < 0x20 ) {
+            r.push_back( ' ' );
+        }
+        else {
+            r.push_back( c );
+        }
+    }
+    return r;
+}
+
+static
+void
+summarize( const std::vector<double>& seconds,
+           double& min,
+           double& median,
+           double& p90,
+           double& p99 )
+{
+    std::vector<double> sorted( seconds );
+    std::sort( sorted.begin(), sorted.end() );
+    min    = sorted.empty() ? 0.0 : sorted.front();
+    median = percentile( sorted, 0.50 );
+    p90    = percentile( sorted, 0.90 );
+    p99    = percentile( sorted, 0.99 );
+}
+
+/** Sum stage samples of one repetition by name and append to stage results. */
+static
+void
+accumulateStages( std::vector<StageResult>& stages,
+                  const std::vector<StageSample>& samples,
+                  const int repetition )
+{
+    for( size_t i=0; i<samples.size(); i++ ) {
+        const StageSample& sample = samples[i];
+        size_t k = 0;
+        while( k < stages.size() && stages[k].m_name != sample.m_name ) {
+            k++;
+        }
+        if( k == stages.size() ) {
+            StageResult stage;
+            stage.m_name = sample.m_name;
+            for( int e=0; e<PERF_EVENT_COUNT; e++ ) {
+                stage.m_counters[e] = 0.0;
+            }
+            stages.push_back( stage );
+        }
+        StageResult& stage = stages[k];
+        stage.m_seconds.resize( repetition+1, 0.0 );
+        stage.m_seconds[ repetition ] += sample.m_seconds;
+        for( int e=0; e<PERF_EVENT_COUNT; e++ ) {
+            if( sample.m_counters[e] < 0 || stage.m_counters[e] < 0.0 ) {
+                stage.m_counters[e] = -1.0;
+            }
+            else {
+                stage.m_counters[e] += sample.m_counters[e];
+            }
+        }
+    }
+}
+
+double
+StageResult::ipc() const
+{
+    if( m_counters[ PERF_CYCLES ] <= 0.0 || m_counters[ PERF_INSTRUCTIONS ] < 0.0 ) {
+        return 0.0;
+    }
+    return m_counters[ PERF_INSTRUCTIONS ] / m_counters[ PERF_CYCLES ];
+}
+
+double
+BenchmarkResult::inputMBps() const
+{
+    return m_median > 0.0 ? (m_input_bytes/m_median)*1e-6 : 0.0;
+}
+
+double
+BenchmarkResult::outputMBps() const
+{
+    return m_median > 0.0 ? (m_output_bytes/m_median)*1e-6 : 0.0;
+}
+
+BenchmarkResult
+runBenchmark( const EncoderRegistry::Entry& encoder,
+              ThreadPool* thread_pool,
+              const std::string& image_name,
+              const ImageBuffer& rgb,
+              const int w,
+              const int h,
+              const BenchmarkOptions& options,
+              MemorySink* output )
+{
+    MemorySink local;
+    MemorySink& sink = output != NULL ? *output : local;
+
+    BenchmarkResult result;
+    result.m_encoder = encoder.m_name;
+    result.m_image = image_name;
+    result.m_width = w;
+    result.m_height = h;
+    result.m_threads = thread_pool->workers() + 1;
+    result.m_lossy = encoder.m_lossy;
+    result.m_input_bytes = rgb.size();
+    result.m_output_bytes = 0;
+
+    for( int i=0; i<options.m_warmup; i++ ) {
+        TraceScope trace( "warmup", encoder.m_name.c_str() );
+        sink.reset();
+        encoder.m_func( thread_pool, rgb, w, h, sink );
+    }
+
+    for( int i=0; i<options.m_repetitions; i++ ) {
+        sink.reset();
+        StageProfile profile;
+        StageProfile::setCurrent( &profile );
+        MemoryScope memory;
+        TimeStamp start;
+        int bytes;
+        {
+            TraceScope trace( "encoder", encoder.m_name.c_str(), i );
+            bytes = encoder.m_func( thread_pool, rgb, w, h, sink );
+        }
+        TimeStamp stop;
+        StageProfile::setCurrent( NULL );
+        maxMemoryUsage( result.m_memory, memory.usage() );
+        result.m_seconds.push_back( TimeStamp::delta( start, stop ) );
+        result.m_output_bytes = bytes;
+        accumulateStages( result.m_stages, profile.samples(), i );
+    }
+
+    summarize( result.m_seconds, result.m_min, result.m_median, result.m_p90, result.m_p99 );
+    for( size_t k=0; k<result.m_stages.size(); k++ ) {
+        StageResult& stage = result.m_stages[k];
+        stage.m_seconds.resize( options.m_repetitions, 0.0 );
+        summarize( stage.m_seconds, stage.m_min, stage.m_median, stage.m_p90, stage.m_p99 );
+        for( int e=0; e<PERF_EVENT_COUNT; e++ ) {
+            if( stage.m_counters[e] >= 0.0 ) {
+                stage.m_counters[e] /= options.m_repetitions;
+            }
+        }
+    }
+    return result;
+}
+
+void
+runScalingSweep( std::vector<BenchmarkResult>& results,
+                 std::ostream& out,
+                 const EncoderRegistry::Entry& encoder,
+                 const std::string& image_name,
+                 const ImageBuffer& rgb,
+                 const int w,
+                 const int h,
+                 const BenchmarkOptions& options,
+                 const int max_threads )
+{
+    std::vector<int> counts;
+    for( int n=1; n<max_threads; n*=2 ) {
+        counts.push_back( n );
+    }
+    counts.push_back( max_threads );
+
+    double t1 = 0.0;
+    std::vector<BenchmarkResult> sweep;
+    for( size_t i=0; i<counts.size(); i++ ) {
+        ThreadPool pool( counts[i]-1 );
+        sweep.push_back( runBenchmark( encoder, &pool, image_name, rgb, w, h, options ) );
+        if( i == 0 ) {
+            t1 = sweep.back().m_median;
+        }
+    }
+
+    out << encoder.m_name << " scaling:\n"
+        << "    threads\tmedian\tspeedup\tefficiency\tMB/s in\n";
+    for( size_t i=0; i<sweep.size(); i++ ) {
+        const BenchmarkResult& r = sweep[i];
+        double speedup = r.m_median > 0.0 ? t1/r.m_median : 0.0;
+        out << "    " << r.m_threads
+            << "\t" << r.m_median
+            << "\t" << speedup
+            << "\t" << (speedup/r.m_threads)
+            << "\t" << r.inputMBps() << "\n";
+        results.push_back( r );
+    }
+}
+
+void
+printResult( std::ostream& out, const BenchmarkResult& result )
+{
+    out << result.m_encoder << ":\t"
+        << "median=" << result.m_median
+        << ", min=" << result.m_min
+        << ", p90=" << result.m_p90
+        << ", p99=" << result.m_p99
+        << " (" << result.m_output_bytes << " bytes, "
+        << result.inputMBps() << " MB/s in, "
+        << result.outputMBps() << " MB/s out)\n";
+    const MemoryUsage& m = result.m_memory;
+    out << "    memory:\t" << m.m_allocated_bytes << " bytes in " << m.m_allocations
+        << " allocations, peak heap=" << m.m_peak_heap_bytes
+        << ", leaked=" << m.m_leaked_bytes;
+    if( m.m_peak_rss_bytes >= 0 ) {
+        out << ", peak RSS=+" << m.m_peak_rss_bytes;
+    }
+    out << "\n";
+    for( size_t k=0; k<result.m_stages.size(); k++ ) {
+        const StageResult& stage = result.m_stages[k];
+        out << "    " << stage.m_name << ":\tmedian=" << stage.m_median;
+        for( int e=0; e<PERF_EVENT_COUNT; e++ ) {
+            if( stage.m_counters[e] >= 0.0 ) {
+                out << ", " << perfEventName( (PerfEvent)e ) << "=" << stage.m_counters[e];
+            }
+        }
+        if( stage.ipc() > 0.0 ) {
+            out << ", IPC=" << stage.ipc();
+        }
+        out << "\n";
+    }
+}
+
+static
+void
+writeCSVRow( std::ostream& out,
+             const BenchmarkResult& r,
+             const std::string& stage,
+             const std::vector<double>& seconds,
+             double min,
+             double median,
+             double p90,
+             double p99,
+             const double* counters,
+             double ipc,
+             const MemoryUsage* memory )
+{
+    out << r.m_image << ','
+        << r.m_width << ','
+        << r.m_height << ','
+        << r.m_threads << ','
+        << r.m_encoder << ','
+        << stage << ','
+        << r.m_input_bytes << ','
+        << r.m_output_bytes << ','
+        << seconds.size() << ','
+        << min << ','
+        << median << ','
+        << p90 << ','
+        << p99 << ','
+        << r.inputMBps() << ','
+        << r.outputMBps();
+    for( int e=0; e<PERF_EVENT_COUNT; e++ ) {
+        out << ',';
+        if( counters != NULL && counters[e] >= 0.0 ) {
+            out << counters[e];
+        }
+    }
+    out << ',';
+    if( ipc > 0.0 ) {
+        out << ipc;
+    }
+    if( memory != NULL ) {
+        out << ',' << memory->m_allocated_bytes
+            << ',' << memory->m_allocations
+            << ',' << memory->m_peak_heap_bytes
+            << ',' << memory->m_leaked_bytes
+            << ',';
+        if( memory->m_peak_rss_bytes >= 0 ) {
+            out << memory->m_peak_rss_bytes;
+        }
+    }
+    else {
+        out << ",,,,,";
+    }
+    out << '\n';
+}
+
+void
+writeResultsCSV( std::ostream& out, const std::vector<BenchmarkResult>& results )
+{
+    out << "image,width,height,threads,encoder,stage,input_bytes,output_bytes,repetitions,"
+        << "min_s,median_s,p90_s,p99_s,input_MBps,output_MBps";
+    for( int e=0; e<PERF_EVENT_COUNT; e++ ) {
+        out << ',' << perfEventName( (PerfEvent)e );
+    }
+    out << ",ipc,allocated_bytes,allocations,peak_heap_bytes,leaked_bytes,peak_rss_bytes\n";
+    for( size_t i=0; i<results.size(); i++ ) {
+        const BenchmarkResult& r = results[i];
+        writeCSVRow( out, r, "total", r.m_seconds, r.m_min, r.m_median, r.m_p90, r.m_p99, NULL, 0.0, &r.m_memory );
+        for( size_t k=0; k<r.m_stages.size(); k++ ) {
+            const StageResult& st = r.m_stages[k];
+            writeCSVRow( out, r, st.m_name, st.m_seconds, st.m_min, st.m_median, st.m_p90, st.m_p99,
+                         st.m_counters, st.ipc(), NULL );
+        }
+    }
+}
+
+static
+void
+writeSecondsJSON( std::ostream& out, const std::vector<double>& seconds )
+{
+    out << "[";
+    for( size_t k=0; k<seconds.size(); k++ ) {
+        out << (k ? ", " : "") << seconds[k];
+    }
+    out << "]";
+}
+
+void
+writeResultsJSON( std::ostream& out, const std::vector<BenchmarkResult>& results )
+{
+    out << "[\n";
+    for( size_t i=0; i<results.size(); i++ ) {
+        const BenchmarkResult& r = results[i];
+        out << "  {\n"
+            << "    \"image\": \"" << jsonEscape( r.m_image ) << "\",\n"
+            << "    \"width\": " << r.m_width << ",\n"
+            << "    \"height\": " << r.m_height << ",\n"
+            << "    \"threads\": " << r.m_threads << ",\n"
+            << "    \"encoder\": \"" << jsonEscape( r.m_encoder ) << "\",\n"
+            << "    \"input_bytes\": " << r.m_input_bytes << ",\n"
+            << "    \"output_bytes\": " << r.m_output_bytes << ",\n"
+            << "    \"min_s\": " << r.m_min << ",\n"
+            << "    \"median_s\": " << r.m_median << ",\n"
+            << "    \"p90_s\": " << r.m_p90 << ",\n"
+            << "    \"p99_s\": " << r.m_p99 << ",\n"
+            << "    \"input_MBps\": " << r.inputMBps() << ",\n"
+            << "    \"output_MBps\": " << r.outputMBps() << ",\n"
+            << "    \"allocated_bytes\": " << r.m_memory.m_allocated_bytes << ",\n"
+            << "    \"allocations\": " << r.m_memory.m_allocations << ",\n"
+            << "    \"peak_heap_bytes\": " << r.m_memory.m_peak_heap_bytes << ",\n"
+            << "    \"leaked_bytes\": " << r.m_memory.m_leaked_bytes << ",\n"
+            << "    \"peak_rss_bytes\": " << r.m_memory.m_peak_rss_bytes << ",\n"
+            << "    \"seconds\": ";
+        writeSecondsJSON( out, r.m_seconds );
+        out << ",\n"
+            << "    \"stages\": [";
+        for( size_t k=0; k<r.m_stages.size(); k++ ) {
+            const StageResult& st = r.m_stages[k];
+            out << (k ? "," : "") << "\n"
+                << "      {\n"
+                << "        \"name\": \"" << jsonEscape( st.m_name ) << "\",\n"
+                << "        \"median_s\": " << st.m_median << ",\n";
+            for( int e=0; e<PERF_EVENT_COUNT; e++ ) {
+                if( st.m_counters[e] >= 0.0 ) {
+                    out << "        \"" << perfEventName( (PerfEvent)e ) << "\": " << st.m_counters[e] << ",\n";
+                }
+            }
+            if( st.ipc() > 0.0 ) {
+                out << "        \"ipc\": " << st.ipc() << ",\n";
+            }
+            out << "        \"seconds\": ";
+            writeSecondsJSON( out, st.m_seconds );
+            out << "\n"
+                << "      }";
+        }
+        out << (r.m_stages.empty() ? "" : "\n    ") << "]\n"
+            << "  }" << (i+1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
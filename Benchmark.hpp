@@ -0,0 +1,99 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <ostream>
+#include "EncoderRegistry.hpp"
+#include "PerfCounters.hpp"
+#include "MemoryStats.hpp"
+
+struct BenchmarkOptions
+{
+    BenchmarkOptions()
+        : m_warmup( 1 ),
+          m_repetitions( 10 )
+    {}
+
+    int     m_warmup;       ///< Untimed runs before measuring.
+    int     m_repetitions;  ///< Timed runs.
+};
+
+struct StageResult
+{
+    std::string         m_name;
+    std::vector<double> m_seconds;                      ///< One entry per timed repetition.
+    double              m_min;
+    double              m_median;
+    double              m_p90;
+    double              m_p99;
+    double              m_counters[ PERF_EVENT_COUNT ]; ///< Mean per repetition, -1 if unavailable.
+
+    /** Instructions per cycle, 0 if counters are unavailable. */
+    double
+    ipc() const;
+};
+
+struct BenchmarkResult
+{
+    std::string         m_encoder;
+    std::string         m_image;
+    int                 m_width;
+    int                 m_height;
+    int                 m_threads;          ///< Pool workers plus calling thread.
+    bool                m_lossy;
+    size_t              m_input_bytes;
+    int                 m_output_bytes;
+    std::vector<double> m_seconds;          ///< One entry per timed repetition.
+
+    double              m_min;
+    double              m_median;
+    double              m_p90;
+    double              m_p99;
+    std::vector<StageResult> m_stages;      ///< Stages reported through StageCounters.
+    MemoryUsage         m_memory;           ///< Largest of each field over the repetitions.
+
+    /** Throughput of raw RGB input at median time. */
+    double
+    inputMBps() const;
+
+    /** Throughput of encoded output at median time. */
+    double
+    outputMBps() const;
+};
+
+/** Times the encoder writing into a memory sink that is reset, but keeps its
+ * capacity, between runs. If output is given, it is used as that sink and
+ * holds the encoded image of the last run on return.
+ */
+BenchmarkResult
+runBenchmark( const EncoderRegistry::Entry& encoder,
+              ThreadPool* thread_pool,
+              const std::string& image_name,
+              const ImageBuffer& rgb,
+              const int w,
+              const int h,
+              const BenchmarkOptions& options,
+              MemorySink* output = NULL );
+
+/** Runs the encoder on pools of 1, 2, 4, ... max_threads threads (calling
+ * thread included) and prints speedup and parallel efficiency relative to
+ * the single-threaded run.
+ */
+void
+runScalingSweep( std::vector<BenchmarkResult>& results,
+                 std::ostream& out,
+                 const EncoderRegistry::Entry& encoder,
+                 const std::string& image_name,
+                 const ImageBuffer& rgb,
+                 const int w,
+                 const int h,
+                 const BenchmarkOptions& options,
+                 const int max_threads );
+
+void
+printResult( std::ostream& out, const BenchmarkResult& result );
+
+void
+writeResultsCSV( std::ostream& out, const std::vector<BenchmarkResult>& results );
+
+void
+writeResultsJSON( std::ostream& out, const std::vector<BenchmarkResult>& results );
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 #include <vector>
 
 class BitPusher
@@ -11,6 +12,13 @@ public:
     {}
     
     ~BitPusher()
+    {
+        flush();
+    }
+
+    /** Pushes pending bits to the output, zero-padding the last byte. */
+    void
+    flush()
     {
         while( m_pending_count >= 8u ) {
             m_data.push_back( m_pending_data );
@@ -20,6 +28,8 @@ public:
         if( m_pending_count ) {
             m_data.push_back( m_pending_data );
         }
+        m_pending_data = 0u;
+        m_pending_count = 0u;
     }
     
     void
@@ -34,6 +44,21 @@ public:
         }
     }
 
+    /** Bits pushed to the output so far, including pending ones. */
+    size_t
+    bits() const
+    {
+        return 8*m_data.size() + m_pending_count;
+    }
+
+    /** Zero-pads to a byte boundary and appends n bytes. */
+    void
+    pushBytes( const unsigned char* bytes, size_t n )
+    {
+        flush();
+        m_data.insert( m_data.end(), bytes, bytes + n );
+    }
+
     void
     pushBitsReverse( unsigned long long int bits, unsigned int count )
     {
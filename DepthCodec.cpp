@@ -0,0 +1,409 @@
+#include <zlib.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <tmmintrin.h>
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include "PerfCounters.hpp"
+#include "timer.hpp"
+#include "Adler32.hpp"
+#include "LZEncoder.hpp"
+#include "HuffEncode.hpp"
+#include "EncoderRegistry.hpp"
+#include "DepthCodec.hpp"
+
+void
+shuffleBytePlanes( unsigned char* planes,
+                   const unsigned char* values,
+                   size_t N,
+                   size_t plane_stride )
+{
+    // Gathers byte k of four values into 32-bit lane k.
+    const __m128i gather = _mm_set_epi8( 15, 11, 7, 3, 14, 10, 6, 2,
+                                         13,  9, 5, 1, 12,  8, 4, 0 );
+    unsigned char* p0 = planes;
+    unsigned char* p1 = planes + plane_stride;
+    unsigned char* p2 = planes + 2*plane_stride;
+    unsigned char* p3 = planes + 3*plane_stride;
+    size_t i = 0;
+    for( ; i+16 <= N; i+=16 ) {
+        __m128i t0 = _mm_shuffle_epi8( _mm_lddqu_si128( (__m128i const*)(values + 4*i +  0) ), gather );
+        __m128i t1 = _mm_shuffle_epi8( _mm_lddqu_si128( (__m128i const*)(values + 4*i + 16) ), gather );
+        __m128i t2 = _mm_shuffle_epi8( _mm_lddqu_si128( (__m128i const*)(values + 4*i + 32) ), gather );
+        __m128i t3 = _mm_shuffle_epi8( _mm_lddqu_si128( (__m128i const*)(values + 4*i + 48) ), gather );
+
+        // 4x4 transpose of 32-bit lanes.
+        __m128i u0 = _mm_unpacklo_epi32( t0, t1 );
+        __m128i u1 = _mm_unpacklo_epi32( t2, t3 );
+        __m128i u2 = _mm_unpackhi_epi32( t0, t1 );
+        __m128i u3 = _mm_unpackhi_epi32( t2, t3 );
+        _mm_storeu_si128( (__m128i*)(p0 + i), _mm_unpacklo_epi64( u0, u1 ) );
+        _mm_storeu_si128( (__m128i*)(p1 + i), _mm_unpackhi_epi64( u0, u1 ) );
+        _mm_storeu_si128( (__m128i*)(p2 + i), _mm_unpacklo_epi64( u2, u3 ) );
+        _mm_storeu_si128( (__m128i*)(p3 + i), _mm_unpackhi_epi64( u2, u3 ) );
+    }
+    for( ; i<N; i++ ) {
+        p0[i] = values[4*i+0];
+        p1[i] = values[4*i+1];
+        p2[i] = values[4*i+2];
+        p3[i] = values[4*i+3];
+    }
+}
+
+void
+unshuffleBytePlanes( unsigned char* values,
+                     const unsigned char* planes,
+                     size_t N,
+                     size_t plane_stride )
+{
+    for( size_t i=0; i<N; i++ ) {
+        for( size_t k=0; k<4; k++ ) {
+            values[4*i+k] = planes[k*plane_stride + i];
+        }
+    }
+}
+
+namespace {
+
+// Input bytes per stripe, small enough to spread frames over the pool.
+const size_t depth_stripe_bytes = 256*1024;
+
+const unsigned char depth_magic[4] = { 'D', 'P', 'T', 'H' };
+
+enum DepthFilter
+{
+    DEPTH_FILTER_NONE = 0,
+    DEPTH_FILTER_SHUFFLE_DELTA = 1
+};
+
+void
+putU32( unsigned char* p, unsigned int v )
+{
+    p[0] = (v>>24)&0xffu;
+    p[1] = (v>>16)&0xffu;
+    p[2] = (v>>8)&0xffu;
+    p[3] = (v>>0)&0xffu;
+}
+
+unsigned int
+getU32( const unsigned char* p )
+{
+    return (p[0]<<24u) | (p[1]<<16u) | (p[2]<<8u) | p[3];
+}
+
+/** Differences of a W x rows byte plane to the row above, the first row to
+ * the left neighbour.
+ */
+void
+deltaPlane( unsigned char* out, const unsigned char* in, size_t W, size_t rows )
+{
+    size_t N = W*rows;
+    out[0] = in[0];
+    for( size_t i=1; i<W; i++ ) {
+        out[i] = in[i] - in[i-1];
+    }
+    size_t k = W;
+    for( ; k+16 <= N; k+=16 ) {
+        _mm_storeu_si128( (__m128i*)(out + k),
+                          _mm_sub_epi8( _mm_lddqu_si128( (__m128i const*)(in + k) ),
+                                        _mm_lddqu_si128( (__m128i const*)(in + k - W) ) ) );
+    }
+    for( ; k<N; k++ ) {
+        out[k] = in[k] - in[k-W];
+    }
+}
+
+/** Inverse of deltaPlane, in place. */
+void
+undeltaPlane( unsigned char* data, size_t W, size_t rows )
+{
+    for( size_t i=1; i<W; i++ ) {
+        data[i] += data[i-1];
+    }
+    for( size_t k=W; k<W*rows; k++ ) {
+        data[k] += data[k-W];
+    }
+}
+
+} // namespace
+
+/** Shuffles, delta codes and deflates one stripe of depth rows. */
+class DepthStripeJob : public JobInterface
+{
+public:
+    DepthStripeJob()
+        : m_values( NULL ),
+          m_width( 0 ),
+          m_rows( 0 ),
+          m_stripe( 0 )
+    {}
+
+    void
+    run()
+    {
+        size_t N = (size_t)m_width*m_rows;
+        m_planes.resize( 4*N );
+        m_filtered.resize( 4*N + 16 );      // encodeLZ reads ahead
+        m_codes.resize( 4*N );
+        shuffleBytePlanes( m_planes.data(), m_values, N, N );
+        for( size_t k=0; k<4; k++ ) {
+            deltaPlane( m_filtered.data() + k*N, m_planes.data() + k*N, m_width, m_rows );
+        }
+        unsigned int adler = computeAdler32SSE( m_filtered.data(), 4*N );
+        unsigned int* codes_p[1] = { m_codes.data() };
+        unsigned int codes_n[1] = { encodeLZ( m_codes.data(), m_filtered.data(), 4*N ) };
+
+        m_output.clear();
+        const unsigned char* data_p[1] = { m_filtered.data() };
+        encodeHuffman( m_output, codes_p, codes_n, data_p, 1 );
+        m_output.push_back( ((adler)>>24)&0xffu ); // Adler32
+        m_output.push_back( ((adler)>>16)&0xffu );
+        m_output.push_back( ((adler)>> 8)&0xffu );
+        m_output.push_back( ((adler)>> 0)&0xffu );
+    }
+
+    const char*
+    traceName() const { return "DepthStripeJob"; }
+
+    long
+    traceArg() const { return m_stripe; }
+
+    const unsigned char*        m_values;
+    unsigned int                m_width;
+    unsigned int                m_rows;
+    int                         m_stripe;
+    std::vector<unsigned char>  m_planes;
+    std::vector<unsigned char>  m_filtered;
+    std::vector<unsigned int>   m_codes;
+    std::vector<unsigned char>  m_output;     ///< zlib stream of the stripe.
+};
+
+namespace {
+
+/** Writes the container header into the 20 bytes at header. */
+void
+writeDepthHeader( OutputSink& out, unsigned char* header, int w, int h, DepthFilter filter, unsigned int stripes )
+{
+    memcpy( header, depth_magic, 4 );
+    putU32( header + 4, w );
+    putU32( header + 8, h );
+    header[12] = 1;
+    header[13] = filter;
+    header[14] = 0;
+    header[15] = 0;
+    putU32( header + 16, stripes );
+    out.write( header, 20 );
+}
+
+/** Reference: zlib on the raw floats, or on shuffled and delta coded ones, as one stripe. */
+template<DepthFilter Filter>
+int
+zlibDepthEncoder( ThreadPool* thread_pool,
+                  const ImageBuffer& depth,
+                  const int w,
+                  const int h,
+                  OutputSink& out )
+{
+    size_t start = out.bytes();
+    size_t N = (size_t)w*h;
+    std::vector<unsigned char> filtered;
+    const unsigned char* data = (const unsigned char*)depth.data();
+    if( Filter == DEPTH_FILTER_SHUFFLE_DELTA ) {
+        StageCounters stage( "shuffle+delta" );
+        std::vector<unsigned char> planes( 4*N );
+        filtered.resize( 4*N );
+        shuffleBytePlanes( planes.data(), data, N, N );
+        for( size_t k=0; k<4; k++ ) {
+            deltaPlane( filtered.data() + k*N, planes.data() + k*N, w, h );
+        }
+        data = filtered.data();
+    }
+
+    uLongf bound = compressBound( 4*N );
+    std::vector<unsigned char> compressed( 8 + bound );
+    {
+        StageCounters stage( "zlib" );
+        if( compress( compressed.data() + 8, &bound, data, 4*N ) != Z_OK ) {
+            return 0;
+        }
+    }
+    unsigned char header[20];
+    writeDepthHeader( out, header, w, h, Filter, 1 );
+    putU32( compressed.data(), h );
+    putU32( compressed.data() + 4, bound );
+    out.write( compressed.data(), 8 + bound );
+    {
+        StageCounters stage( "io" );
+        out.flush();
+    }
+    return out.bytes() - start;
+}
+
+} // namespace
+
+// --- depth context ---------------------------------------------------------
+
+DepthContext::DepthContext()
+{}
+
+DepthContext::~DepthContext()
+{
+    for( size_t k=0; k<m_jobs.size(); k++ ) {
+        delete m_jobs[k];
+    }
+}
+
+DepthContext&
+depthContext()
+{
+    static DepthContext context;
+    return context;
+}
+
+int
+encodeDepth( ThreadPool* thread_pool,
+             const ImageBuffer& depth,
+             const int w,
+             const int h,
+             OutputSink& out,
+             DepthContext& context )
+{
+    size_t start = out.bytes();
+    const size_t row_bytes = 4*(size_t)w;
+    size_t rows = std::max( (size_t)1, depth_stripe_bytes/row_bytes );
+    rows = std::min( rows, (size_t)(h + thread_pool->workers())/(thread_pool->workers()+1) );
+    rows = std::max( (size_t)1, rows );
+    const unsigned int S = (h + rows - 1)/rows;
+
+    std::vector<DepthStripeJob*>& jobs = context.m_jobs;
+    std::vector<unsigned char>& stripe_headers = context.m_stripe_headers;
+    for( size_t s=jobs.size(); s<S; s++ ) {
+        jobs.push_back( new DepthStripeJob() );
+    }
+    stripe_headers.resize( 8*S );
+
+    CompletionToken token;
+    {
+        StageCounters stage( "shuffle+LZ+huffenc" );
+        for( unsigned int s=0; s<S; s++ ) {
+            size_t a = s*rows;
+            jobs[s]->m_values = (const unsigned char*)depth.data() + row_bytes*a;
+            jobs[s]->m_width = w;
+            jobs[s]->m_rows = std::min( rows, h - a );
+            jobs[s]->m_stripe = s;
+            thread_pool->addJob( jobs[s], &token );
+        }
+        thread_pool->wait( &token );
+    }
+
+    unsigned char header[20];
+    writeDepthHeader( out, header, w, h, DEPTH_FILTER_SHUFFLE_DELTA, S );
+    for( unsigned int s=0; s<S; s++ ) {
+        putU32( stripe_headers.data() + 8*s, jobs[s]->m_rows );
+        putU32( stripe_headers.data() + 8*s + 4, jobs[s]->m_output.size() );
+        out.write( stripe_headers.data() + 8*s, 8 );
+        out.write( jobs[s]->m_output.data(), jobs[s]->m_output.size() );
+    }
+    {
+        StageCounters stage( "io" );
+        out.flush();
+    }
+    return out.bytes() - start;
+}
+
+int
+encodeDepth( ThreadPool* thread_pool,
+             const ImageBuffer& depth,
+             const int w,
+             const int h,
+             OutputSink& out )
+{
+    return encodeDepth( thread_pool, depth, w, h, out, depthContext() );
+}
+
+bool
+decodeDepth( std::vector<unsigned char>& depth,
+             int& w,
+             int& h,
+             std::string& message,
+             const std::vector<unsigned char>& encoded,
+             double* inflate_seconds,
+             double* unfilter_seconds )
+{
+    if( encoded.size() < 20 || memcmp( encoded.data(), depth_magic, 4 ) != 0 || encoded[12] != 1 ) {
+        message = "not a depth stream";
+        return false;
+    }
+    w = getU32( encoded.data() + 4 );
+    h = getU32( encoded.data() + 8 );
+    unsigned int filter = encoded[13];
+    unsigned int S = getU32( encoded.data() + 16 );
+    if( filter > DEPTH_FILTER_SHUFFLE_DELTA ) {
+        message = "unknown depth filter";
+        return false;
+    }
+
+    const size_t row_bytes = 4*(size_t)w;
+    depth.resize( row_bytes*h );
+    std::vector<unsigned char> stripe;
+    size_t o = 20;
+    size_t y = 0;
+    for( unsigned int s=0; s<S; s++ ) {
+        if( o + 8 > encoded.size() ) {
+            message = "truncated stripe header";
+            return false;
+        }
+        size_t rows = getU32( encoded.data() + o );
+        size_t size = getU32( encoded.data() + o + 4 );
+        o += 8;
+        if( y + rows > (size_t)h || o + size > encoded.size() ) {
+            message = "stripe out of bounds";
+            return false;
+        }
+        size_t N = (size_t)w*rows;
+        stripe.resize( 4*N );
+        uLongf stripe_size = stripe.size();
+        TimeStamp start;
+        int err = uncompress( stripe.data(), &stripe_size, encoded.data() + o, size );
+        TimeStamp stop;
+        if( inflate_seconds != NULL ) {
+            *inflate_seconds += TimeStamp::delta( start, stop );
+        }
+        if( err != Z_OK || stripe_size != 4*N ) {
+            std::stringstream m;
+            m << "zlib: uncompress=" << err << " in stripe " << s;
+            message = m.str();
+            return false;
+        }
+        start = TimeStamp();
+        if( filter == DEPTH_FILTER_SHUFFLE_DELTA ) {
+            for( size_t k=0; k<4; k++ ) {
+                undeltaPlane( stripe.data() + k*N, w, rows );
+            }
+            unshuffleBytePlanes( depth.data() + row_bytes*y, stripe.data(), N, N );
+        }
+        else {
+            memcpy( depth.data() + row_bytes*y, stripe.data(), 4*N );
+        }
+        stop = TimeStamp();
+        if( unfilter_seconds != NULL ) {
+            *unfilter_seconds += TimeStamp::delta( start, stop );
+        }
+        o += size;
+        y += rows;
+    }
+    if( y != (size_t)h ) {
+        message = "stripes do not cover the image";
+        return false;
+    }
+    return true;
+}
+
+static EncoderRegistrar depth_lz_registrar( "depth_lz", encodeDepth, ".dpth", false,
+                                            pixelFormatBit( PIXEL_DEPTH32F ) );
+static EncoderRegistrar zlib_depth_registrar( "zlib_depth", zlibDepthEncoder<DEPTH_FILTER_NONE>, ".dpth", false,
+                                              pixelFormatBit( PIXEL_DEPTH32F ) );
+static EncoderRegistrar zlib_depth_shuffle_registrar( "zlib_depth_shuffle", zlibDepthEncoder<DEPTH_FILTER_SHUFFLE_DELTA>, ".dpth", false,
+                                                      pixelFormatBit( PIXEL_DEPTH32F ) );
@@ -0,0 +1,90 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "ThreadPool.hpp"
+#include "ImageBuffer.hpp"
+#include "OutputSink.hpp"
+
+class DepthStripeJob;
+
+/** Stripe jobs and buffers of encodeDepth, kept across frames. One context
+ * serves one encode at a time.
+ */
+struct DepthContext
+{
+    DepthContext();
+
+    ~DepthContext();
+
+    std::vector<DepthStripeJob*> m_jobs;           ///< One per stripe, with their buffers.
+    std::vector<unsigned char>   m_stripe_headers; ///< Rows and size of each stripe.
+
+private:
+    DepthContext( const DepthContext& );
+
+    DepthContext&
+    operator=( const DepthContext& );
+};
+
+/** Context used by the registered depth_lz encoder. */
+DepthContext&
+depthContext();
+
+/** Transposes N 4-byte values into four planes of N bytes each, so that
+ * plane k holds byte k of every value. Planes are plane_stride bytes apart.
+ */
+void
+shuffleBytePlanes( unsigned char* planes,
+                   const unsigned char* values,
+                   size_t N,
+                   size_t plane_stride );
+
+/** Inverse of shuffleBytePlanes. */
+void
+unshuffleBytePlanes( unsigned char* values,
+                     const unsigned char* planes,
+                     size_t N,
+                     size_t plane_stride );
+
+/** Lossless encoder for 32-bit float depth buffers (PIXEL_DEPTH32F).
+ *
+ * Rows are split into stripes compressed independently on the pool. Each
+ * stripe is shuffled into byte planes, so the slowly varying sign and
+ * exponent bytes end up next to each other, and every plane row is delta
+ * coded against the row above. The result goes through encodeLZ and fixed
+ * Huffman coding into a zlib stream.
+ *
+ * The container is big-endian: "DPTH", width, height (u32), version (1),
+ * filter (0 none, 1 shuffle and delta), two zero bytes, the number of
+ * stripes (u32), then per stripe its rows and size (u32) and the zlib stream.
+ * Returns the number of bytes written.
+ */
+int
+encodeDepth( ThreadPool* thread_pool,
+             const ImageBuffer& depth,
+             const int w,
+             const int h,
+             OutputSink& out );
+
+/** encodeDepth with jobs and buffers taken from the given context. */
+int
+encodeDepth( ThreadPool* thread_pool,
+             const ImageBuffer& depth,
+             const int w,
+             const int h,
+             OutputSink& out,
+             DepthContext& context );
+
+/** Decodes a stream written by encodeDepth or the zlib reference encoders.
+ * Returns false with a reason in message if the stream is malformed. If
+ * given, the time spent in zlib and in undoing the delta and byte shuffle
+ * is added to inflate_seconds and unfilter_seconds.
+ */
+bool
+decodeDepth( std::vector<unsigned char>& depth,
+             int& w,
+             int& h,
+             std::string& message,
+             const std::vector<unsigned char>& encoded,
+             double* inflate_seconds = NULL,
+             double* unfilter_seconds = NULL );
@@ -0,0 +1,429 @@
+#include <algorithm>
+#include <iostream>
+#include <cassert>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "timer.hpp"
+#include "Trace.hpp"
+#include "EncoderRegistry.hpp"
+#include "OutputSink.hpp"
+#include "EncodeServer.hpp"
+
+namespace {
+
+const unsigned char request_magic[4] = { 'E', 'N', 'C', 'Q' };
+const unsigned char response_magic[4] = { 'E', 'N', 'C', 'R' };
+const size_t request_header_bytes = 16;
+const size_t response_header_bytes = 20;
+
+void
+putU32( unsigned char* p, unsigned int v )
+{
+    p[0] = (v>>24)&0xffu;
+    p[1] = (v>>16)&0xffu;
+    p[2] = (v>>8)&0xffu;
+    p[3] = (v>>0)&0xffu;
+}
+
+unsigned int
+getU32( const unsigned char* p )
+{
+    return (p[0]<<24u) | (p[1]<<16u) | (p[2]<<8u) | p[3];
+}
+
+/** Reads until size bytes have arrived, the peer closed or an error occurred.
+ * Returns the number of bytes read.
+ */
+size_t
+readFully( int fd, void* data, size_t size )
+{
+    size_t done = 0;
+    while( done < size ) {
+        ssize_t n = read( fd, (char*)data + done, size - done );
+        if( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( n <= 0 ) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+bool
+openSocket( int& fd, struct sockaddr_un& address, const std::string& path )
+{
+    if( path.size() >= sizeof( address.sun_path ) ) {
+        std::cerr << "Socket path '" << path << "' is too long.\n";
+        return false;
+    }
+    memset( &address, 0, sizeof( address ) );
+    address.sun_family = AF_UNIX;
+    memcpy( address.sun_path, path.c_str(), path.size() );
+    fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( fd < 0 ) {
+        std::cerr << "socket failed: " << strerror( errno ) << "\n";
+        return false;
+    }
+    return true;
+}
+
+struct ServerState
+{
+    ServerState( EncodeServerStats& stats, ThreadPool* thread_pool )
+        : m_stats( stats ),
+          m_thread_pool( thread_pool ),
+          m_listen_fd( -1 ),
+          m_active( 0 ),
+          m_stop( false )
+    {
+        pthread_mutex_init( &m_encode_mutex, NULL );
+        pthread_mutex_init( &m_mutex, NULL );
+        pthread_cond_init( &m_idle, NULL );
+    }
+
+    ~ServerState()
+    {
+        pthread_mutex_destroy( &m_encode_mutex );
+        pthread_mutex_destroy( &m_mutex );
+        pthread_cond_destroy( &m_idle );
+    }
+
+    EncodeServerStats&  m_stats;
+    ThreadPool*         m_thread_pool;
+    int                 m_listen_fd;
+    pthread_mutex_t     m_encode_mutex;     ///< Held while an encoder runs.
+    pthread_mutex_t     m_mutex;            ///< Guards the members below and m_stats.
+    pthread_cond_t      m_idle;             ///< Signalled when m_active drops to zero.
+    int                 m_active;           ///< Connection threads running.
+    bool                m_stop;
+};
+
+struct Connection
+{
+    ServerState*    m_state;
+    int             m_fd;
+};
+
+bool
+sendResponse( int fd, unsigned int status, double seconds, const void* payload, size_t size )
+{
+    unsigned char header[ response_header_bytes ];
+    memcpy( header, response_magic, 4 );
+    putU32( header + 4, status );
+    putU32( header + 8, (unsigned int)std::min( 4e9, 1e6*seconds ) );
+    putU32( header + 12, (unsigned long long)size >> 32 );
+    putU32( header + 16, size );
+    FdSink out( fd );
+    out.write( header, sizeof( header ) );
+    out.write( payload, size );
+    return out.flush();
+}
+
+bool
+sendError( int fd, const std::string& message )
+{
+    return sendResponse( fd, 1, 0.0, message.data(), message.size() );
+}
+
+/** Answers requests from in_fd on out_fd until the peer closes or a
+ * protocol error occurs.
+ */
+void
+serveConnection( ServerState& state, int in_fd, int out_fd )
+{
+    const EncoderRegistry& registry = EncoderRegistry::instance();
+    ImageBuffer image;
+    MemorySink encoded;
+    std::string name;
+
+    while( true ) {
+        unsigned char header[ request_header_bytes ];
+        size_t n = readFully( in_fd, header, sizeof( header ) );
+        if( n == 0 ) {
+            break;
+        }
+        if( n != sizeof( header ) || memcmp( header, request_magic, 4 ) != 0 ) {
+            std::cerr << "Malformed request, closing connection.\n";
+            break;
+        }
+        unsigned int op = header[4];
+        unsigned int format = header[5];
+        size_t name_length = (header[6]<<8u) | header[7];
+        unsigned int w = getU32( header + 8 );
+        unsigned int h = getU32( header + 12 );
+        name.resize( name_length );
+        if( readFully( in_fd, &name[0], name_length ) != name_length ) {
+            break;
+        }
+
+        if( op == ENCODE_SERVER_SHUTDOWN ) {
+            assert( pthread_mutex_lock( &state.m_mutex ) == 0 );
+            state.m_stop = true;
+            if( state.m_listen_fd >= 0 ) {
+                // Wakes up the accept() of the server thread.
+                shutdown( state.m_listen_fd, SHUT_RDWR );
+            }
+            assert( pthread_mutex_unlock( &state.m_mutex ) == 0 );
+            sendResponse( out_fd, 0, 0.0, NULL, 0 );
+            break;
+        }
+        if( op != ENCODE_SERVER_ENCODE || format >= PIXEL_FORMAT_COUNT ) {
+            sendError( out_fd, "unknown request" );
+            break;
+        }
+        // Images an encoder cannot take are refused before any memory is
+        // allocated for them. Their pixels are not read, so the connection
+        // is closed.
+        const EncoderRegistry::Entry* entry = registry.find( name );
+        bool fits = entry != NULL ? entry->accepts( (PixelFormat)format, w, h )
+                                  : fitsEncoder( (PixelFormat)format, w, h );
+        if( !fits ) {
+            sendError( out_fd, "unsupported image size" );
+            break;
+        }
+        size_t size = (size_t)pixelBytes( (PixelFormat)format )*w*h;
+        image.resize( size );
+        if( readFully( in_fd, image.writable(), size ) != size ) {
+            break;
+        }
+        image.setFormat( (PixelFormat)format );
+
+        if( entry == NULL ) {
+            if( !sendError( out_fd, "unknown encoder '" + name + "'" ) ) {
+                break;
+            }
+            continue;
+        }
+        if( !entry->supports( image.format() ) ) {
+            if( !sendError( out_fd, name + " does not take " + pixelFormatName( image.format() ) + " pixels" ) ) {
+                break;
+            }
+            continue;
+        }
+
+        int bytes;
+        double seconds;
+        {
+            TraceScope trace( "server", "encode", -1 );
+            assert( pthread_mutex_lock( &state.m_encode_mutex ) == 0 );
+            encoded.reset();
+            TimeStamp start;
+            bytes = entry->m_func( state.m_thread_pool, image, w, h, encoded );
+            TimeStamp stop;
+            assert( pthread_mutex_unlock( &state.m_encode_mutex ) == 0 );
+            seconds = TimeStamp::delta( start, stop );
+        }
+
+        assert( pthread_mutex_lock( &state.m_mutex ) == 0 );
+        state.m_stats.m_requests++;
+        state.m_stats.m_failed += bytes <= 0 ? 1 : 0;
+        state.m_stats.m_input_bytes += size;
+        state.m_stats.m_output_bytes += bytes > 0 ? bytes : 0;
+        state.m_stats.m_encode_seconds += seconds;
+        assert( pthread_mutex_unlock( &state.m_mutex ) == 0 );
+
+        bool sent = bytes > 0
+                  ? sendResponse( out_fd, 0, seconds, encoded.data().data(), encoded.data().size() )
+                  : sendError( out_fd, name + " failed" );
+        if( !sent ) {
+            break;
+        }
+    }
+}
+
+void*
+connectionMain( void* arg )
+{
+    Connection* connection = (Connection*)arg;
+    ServerState& state = *connection->m_state;
+    if( Trace::enabled() ) {
+        Trace::setThreadName( "connection" );
+    }
+    serveConnection( state, connection->m_fd, connection->m_fd );
+    close( connection->m_fd );
+    delete connection;
+
+    assert( pthread_mutex_lock( &state.m_mutex ) == 0 );
+    if( --state.m_active == 0 ) {
+        pthread_cond_signal( &state.m_idle );
+    }
+    assert( pthread_mutex_unlock( &state.m_mutex ) == 0 );
+    return NULL;
+}
+
+} // of anonymous namespace
+
+bool
+runEncodeServer( EncodeServerStats& stats,
+                 const std::string& socket_path,
+                 ThreadPool* thread_pool )
+{
+    // Clients that go away must not take the server down with them.
+    signal( SIGPIPE, SIG_IGN );
+
+    ServerState state( stats, thread_pool );
+    if( socket_path == "-" ) {
+        stats.m_connections = 1;
+        serveConnection( state, 0, 1 );
+        return true;
+    }
+
+    struct sockaddr_un address;
+    int fd;
+    if( !openSocket( fd, address, socket_path ) ) {
+        return false;
+    }
+    // Replace a socket left behind by an earlier server, but nothing else.
+    struct stat st;
+    if( stat( socket_path.c_str(), &st ) == 0 && S_ISSOCK( st.st_mode ) ) {
+        unlink( socket_path.c_str() );
+    }
+    if( bind( fd, (struct sockaddr*)&address, sizeof( address ) ) != 0 ||
+        listen( fd, 64 ) != 0 )
+    {
+        std::cerr << "Failed to listen on '" << socket_path << "': " << strerror( errno ) << "\n";
+        close( fd );
+        return false;
+    }
+    state.m_listen_fd = fd;
+    std::cerr << "Listening on '" << socket_path << "' with "
+              << thread_pool->workers() << " pool threads.\n";
+
+    while( true ) {
+        int client = accept( fd, NULL, NULL );
+        assert( pthread_mutex_lock( &state.m_mutex ) == 0 );
+        bool stop = state.m_stop;
+        if( client >= 0 && !stop ) {
+            state.m_active++;
+            stats.m_connections++;
+        }
+        assert( pthread_mutex_unlock( &state.m_mutex ) == 0 );
+        if( stop ) {
+            if( client >= 0 ) {
+                close( client );
+            }
+            break;
+        }
+        if( client < 0 ) {
+            if( errno == EINTR || errno == ECONNABORTED ) {
+                continue;
+            }
+            std::cerr << "accept failed: " << strerror( errno ) << "\n";
+            break;
+        }
+
+        Connection* connection = new Connection;
+        connection->m_state = &state;
+        connection->m_fd = client;
+        pthread_t thread;
+        assert( pthread_create( &thread, NULL, connectionMain, connection ) == 0 );
+        assert( pthread_detach( thread ) == 0 );
+    }
+
+    // Let open connections finish before the state goes away.
+    assert( pthread_mutex_lock( &state.m_mutex ) == 0 );
+    while( state.m_active > 0 ) {
+        pthread_cond_wait( &state.m_idle, &state.m_mutex );
+    }
+    assert( pthread_mutex_unlock( &state.m_mutex ) == 0 );
+    close( fd );
+    unlink( socket_path.c_str() );
+    return true;
+}
+
+// --- client ------------------------------------------------------------------
+
+EncodeClient::EncodeClient()
+    : m_fd( -1 )
+{}
+
+EncodeClient::~EncodeClient()
+{
+    if( m_fd >= 0 ) {
+        close( m_fd );
+    }
+}
+
+bool
+EncodeClient::connect( const std::string& socket_path )
+{
+    struct sockaddr_un address;
+    if( !openSocket( m_fd, address, socket_path ) ) {
+        return false;
+    }
+    if( ::connect( m_fd, (struct sockaddr*)&address, sizeof( address ) ) != 0 ) {
+        std::cerr << "Failed to connect to '" << socket_path << "': " << strerror( errno ) << "\n";
+        close( m_fd );
+        m_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool
+EncodeClient::encode( std::vector<unsigned char>& encoded,
+                      double& server_seconds,
+                      std::string& message,
+                      const std::string& encoder,
+                      const ImageBuffer& image,
+                      const int w,
+                      const int h )
+{
+    unsigned char header[ request_header_bytes ];
+    memcpy( header, request_magic, 4 );
+    header[4] = ENCODE_SERVER_ENCODE;
+    header[5] = image.format();
+    header[6] = (encoder.size()>>8)&0xffu;
+    header[7] = encoder.size()&0xffu;
+    putU32( header + 8, w );
+    putU32( header + 12, h );
+    FdSink out( m_fd );
+    out.write( header, sizeof( header ) );
+    out.write( encoder.data(), encoder.size() );
+    out.write( image.data(), pixelBytes( image.format() )*(size_t)w*h );
+    if( !out.flush() ) {
+        message = "failed to send request";
+        return false;
+    }
+
+    unsigned char response[ response_header_bytes ];
+    if( readFully( m_fd, response, sizeof( response ) ) != sizeof( response ) ||
+        memcmp( response, response_magic, 4 ) != 0 )
+    {
+        message = "connection closed by server";
+        return false;
+    }
+    unsigned int status = getU32( response + 4 );
+    server_seconds = 1e-6*getU32( response + 8 );
+    size_t size = ((unsigned long long)getU32( response + 12 ) << 32) | getU32( response + 16 );
+    encoded.resize( size );
+    if( readFully( m_fd, encoded.data(), size ) != size ) {
+        message = "truncated response";
+        return false;
+    }
+    if( status != 0 ) {
+        message.assign( encoded.begin(), encoded.end() );
+        return false;
+    }
+    return true;
+}
+
+bool
+EncodeClient::shutdownServer()
+{
+    unsigned char header[ request_header_bytes ];
+    memset( header, 0, sizeof( header ) );
+    memcpy( header, request_magic, 4 );
+    header[4] = ENCODE_SERVER_SHUTDOWN;
+    unsigned char response[ response_header_bytes ];
+    return write( m_fd, header, sizeof( header ) ) == (ssize_t)sizeof( header ) &&
+           readFully( m_fd, response, sizeof( response ) ) == sizeof( response );
+}
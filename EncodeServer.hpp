@@ -0,0 +1,97 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "ThreadPool.hpp"
+#include "ImageBuffer.hpp"
+
+/* Wire protocol of the encode server, all integers big-endian.
+ *
+ * Request:  "ENCQ", op (u8, 1 encode, 2 shut down the server), pixel format
+ *           (u8), length of the encoder name (u16), width, height (u32), the
+ *           encoder name, then pixelBytes( format )*width*height pixel bytes
+ *           for encode requests.
+ * Response: "ENCR", status (u32, 0 ok), server encode time in microseconds
+ *           (u32), payload length (u64), then the encoded image or, if the
+ *           status is not 0, an error message.
+ *
+ * A connection carries any number of requests, each answered in order.
+ * Images larger than the encoder takes (see EncoderRegistry::Entry::accepts)
+ * are refused before their pixels are read, which closes the connection.
+ */
+
+enum EncodeServerOp
+{
+    ENCODE_SERVER_ENCODE = 1,
+    ENCODE_SERVER_SHUTDOWN = 2
+};
+
+struct EncodeServerStats
+{
+    EncodeServerStats()
+        : m_connections( 0 ),
+          m_requests( 0 ),
+          m_failed( 0 ),
+          m_input_bytes( 0 ),
+          m_output_bytes( 0 ),
+          m_encode_seconds( 0.0 )
+    {}
+
+    size_t  m_connections;
+    size_t  m_requests;         ///< Images handed to encoders, including failed ones.
+    size_t  m_failed;
+    size_t  m_input_bytes;
+    size_t  m_output_bytes;
+    double  m_encode_seconds;   ///< Time spent inside encoders.
+};
+
+/** Serves encode requests on a Unix domain socket until a client asks it to
+ * shut down, or on standard input and output if socket_path is "-".
+ *
+ * The thread pool, CRC tables and encoder scratch buffers stay warm across
+ * requests. Every connection has a thread of its own that reads requests and
+ * writes responses, reusing its image and output buffers. Encoders share the
+ * pool and per-process scratch state, so images are encoded one at a time
+ * while other connections receive and send. Returns false if the socket
+ * could not be set up.
+ */
+bool
+runEncodeServer( EncodeServerStats& stats,
+                 const std::string& socket_path,
+                 ThreadPool* thread_pool );
+
+/** Blocking client of the encode server for one connection. */
+class EncodeClient
+{
+public:
+    EncodeClient();
+
+    ~EncodeClient();
+
+    bool
+    connect( const std::string& socket_path );
+
+    /** Encodes image on the server. On failure message holds the reason,
+     * either from the server or about the connection.
+     */
+    bool
+    encode( std::vector<unsigned char>& encoded,
+            double& server_seconds,
+            std::string& message,
+            const std::string& encoder,
+            const ImageBuffer& image,
+            const int w,
+            const int h );
+
+    /** Asks the server to stop accepting connections and exit. */
+    bool
+    shutdownServer();
+
+protected:
+    int     m_fd;
+
+private:
+    EncodeClient( const EncodeClient& );
+
+    EncodeClient&
+    operator=( const EncodeClient& );
+};
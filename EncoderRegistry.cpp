@@ -0,0 +1,51 @@
+#include <iostream>
+#include <cstdlib>
+#include <climits>
+#include "EncoderRegistry.hpp"
+
+EncoderRegistry&
+EncoderRegistry::instance()
+{
+    // Function-local so that registrars in other translation units may use it
+    // during static initialization.
+    static EncoderRegistry registry;
+    return registry;
+}
+
+bool
+fitsEncoder( PixelFormat format, unsigned int w, unsigned int h, unsigned long long max_bytes )
+{
+    if( w == 0 || h == 0 || w > INT_MAX || h > INT_MAX ) {
+        return false;
+    }
+    // Both factors are below 2^35 and 2^31, so the product cannot wrap.
+    return ((unsigned long long)pixelBytes( format )*w + 1)*h <= max_bytes;
+}
+
+void
+EncoderRegistry::add( const std::string& name, EncoderFunc func, const std::string& extension, bool lossy, unsigned int formats, unsigned long long max_bytes )
+{
+    if( find( name ) != NULL ) {
+        std::cerr << "Encoder '" << name << "' registered twice.\n";
+        abort();
+    }
+    Entry entry;
+    entry.m_name = name;
+    entry.m_func = func;
+    entry.m_extension = extension;
+    entry.m_lossy = lossy;
+    entry.m_formats = formats;
+    entry.m_max_bytes = max_bytes;
+    m_encoders.push_back( entry );
+}
+
+const EncoderRegistry::Entry*
+EncoderRegistry::find( const std::string& name ) const
+{
+    for( size_t i=0; i<m_encoders.size(); i++ ) {
+        if( m_encoders[i].m_name == name ) {
+            return &m_encoders[i];
+        }
+    }
+    return NULL;
+}
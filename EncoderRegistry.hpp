@@ -0,0 +1,87 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "ThreadPool.hpp"
+#include "ImageBuffer.hpp"
+#include "OutputSink.hpp"
+
+/** Signature shared by all benchmarkable encoders. The encoded image is
+ * written to out, which is flushed before returning the size in bytes.
+ * Pixels are in rgb.format(), which the encoder must support.
+ */
+typedef int (*EncoderFunc)( ThreadPool* thread_pool,
+                            const ImageBuffer& rgb,
+                            const int w,
+                            const int h,
+                            OutputSink& out );
+
+/** Largest image, counted as filtered scanlines (pixelBytes*w+1)*h, that
+ * encoders computing sizes in 32-bit ints can take.
+ */
+const unsigned long long ENCODER_MAX_BYTES_32 = (1ull<<31) - 1;
+
+/** True if w and h are positive ints and (pixelBytes*w+1)*h of a w x h
+ * image in format is at most max_bytes.
+ */
+bool
+fitsEncoder( PixelFormat format,
+             unsigned int w,
+             unsigned int h,
+             unsigned long long max_bytes = ENCODER_MAX_BYTES_32 );
+
+class EncoderRegistry
+{
+public:
+    struct Entry
+    {
+        std::string     m_name;
+        EncoderFunc     m_func;
+        std::string     m_extension;    ///< File name extension of the output format.
+        bool            m_lossy;        ///< Output does not reproduce the source exactly.
+        unsigned int    m_formats;      ///< Mask of pixelFormatBit() of accepted formats.
+        unsigned long long m_max_bytes; ///< Largest accepted (pixelBytes*w+1)*h.
+
+        bool
+        supports( PixelFormat format ) const { return (m_formats & pixelFormatBit( format )) != 0; }
+
+        bool
+        accepts( PixelFormat format, unsigned int w, unsigned int h ) const { return fitsEncoder( format, w, h, m_max_bytes ); }
+    };
+
+    static
+    EncoderRegistry&
+    instance();
+
+    void
+    add( const std::string& name,
+         EncoderFunc func,
+         const std::string& extension,
+         bool lossy = false,
+         unsigned int formats = pixelFormatBit( PIXEL_RGB8 ),
+         unsigned long long max_bytes = ENCODER_MAX_BYTES_32 );
+
+    /** Returns NULL if no encoder with the given name is registered. */
+    const Entry*
+    find( const std::string& name ) const;
+
+    const std::vector<Entry>&
+    encoders() const { return m_encoders; }
+
+protected:
+    std::vector<Entry>  m_encoders;
+};
+
+/** Static instances of this class register an encoder at program start-up. */
+class EncoderRegistrar
+{
+public:
+    EncoderRegistrar( const std::string& name,
+                      EncoderFunc func,
+                      const std::string& extension,
+                      bool lossy = false,
+                      unsigned int formats = pixelFormatBit( PIXEL_RGB8 ),
+                      unsigned long long max_bytes = ENCODER_MAX_BYTES_32 )
+    {
+        EncoderRegistry::instance().add( name, func, extension, lossy, formats, max_bytes );
+    }
+};
@@ -1,144 +1,892 @@
+#include <algorithm>
+#include <emmintrin.h>
 #include "HuffEncode.hpp"
 #include "BitPusher.hpp"
 
+void
+huffmanCosts( HuffmanCosts& costs,
+              const unsigned char* litlen_lengths,
+              const unsigned char* distance_lengths )
+{
+    for( unsigned int c=0; c<256; c++ ) {
+        costs.m_literal[c] = litlen_lengths[c] ? litlen_lengths[c] : 15;
+    }
+    costs.m_length[0] = costs.m_length[1] = costs.m_length[2] = 0;
+    for( unsigned int l=3; l<=258; l++ ) {
+        unsigned int extra;
+        unsigned int symbol = deflateLengthSymbol( l, extra );
+        costs.m_length[l] = (litlen_lengths[symbol] ? litlen_lengths[symbol] : 15) + extra;
+    }
+    for( unsigned int d=0; d<30; d++ ) {
+        costs.m_distance[d] = distance_lengths[d] ? distance_lengths[d] : 15;
+    }
+}
+
+static
+HuffmanCosts
+makeFixedHuffmanCosts()
+{
+    unsigned char litlen[288];
+    unsigned char distance[30];
+    for( unsigned int k=0; k<288; k++ ) {
+        litlen[k] = k < 144 ? 8 : k < 256 ? 9 : k < 280 ? 7 : 8;
+    }
+    for( unsigned int k=0; k<30; k++ ) {
+        distance[k] = 5;
+    }
+    HuffmanCosts costs;
+    huffmanCosts( costs, litlen, distance );
+    return costs;
+}
+
+const HuffmanCosts&
+fixedHuffmanCosts()
+{
+    // Initialization of local statics is thread-safe.
+    static const HuffmanCosts costs = makeFixedHuffmanCosts();
+    return costs;
+}
+
+// --- dynamic Huffman codes -------------------------------------------------
+
+namespace {
+
+const unsigned int max_code_bits = 15;
+const unsigned int max_code_length_bits = 7;
+
+/** Order in which the code length code lengths are sent. */
+const unsigned char code_length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+const unsigned short length_base[29] = {   3,    4,    5,    6,    7,    8,    9,   10,   11,   13,
+                                          15,   17,   19,   23,   27,   31,   35,   43,   51,   59,
+                                          67,   83,   99,  115,  131,  163,  195,  227,  258 };
+
+const unsigned short distance_base[30] = {     1,     2,     3,     4,     5,     7,     9,    13,    17,    25,
+                                              33,    49,    65,    97,   129,   193,   257,   385,   513,   769,
+                                            1025,  1537,  2049,  3073,  4097,  6145,  8193, 12289, 16385, 24577 };
+
+const unsigned char length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+const unsigned char distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+struct ByFrequency
+{
+    explicit
+    ByFrequency( const unsigned int* frequencies ) : m_frequencies( frequencies ) {}
+
+    bool
+    operator()( unsigned int a, unsigned int b ) const
+    {
+        return m_frequencies[a] < m_frequencies[b] || (m_frequencies[a] == m_frequencies[b] && a < b);
+    }
+
+    const unsigned int* m_frequencies;
+};
+
+/** Replaces the ascending weights A[0..n) with unrestricted Huffman code
+ * lengths, in place (Moffat and Katajainen). A[0] gets the longest code.
+ */
+void
+minimumRedundancy( unsigned int* A, int n )
+{
+    int root = 0;
+    int leaf = 2;
+    A[0] += A[1];
+    for( int next=1; next<n-1; next++ ) {
+        if( leaf >= n || A[root] < A[leaf] ) {
+            A[next] = A[root];
+            A[root++] = next;
+        }
+        else {
+            A[next] = A[leaf++];
+        }
+        if( leaf >= n || (root < next && A[root] < A[leaf]) ) {
+            A[next] += A[root];
+            A[root++] = next;
+        }
+        else {
+            A[next] += A[leaf++];
+        }
+    }
+    A[n-2] = 0;
+    for( int next=n-3; next>=0; next-- ) {
+        A[next] = A[A[next]] + 1;
+    }
+    int available = 1;
+    int used = 0;
+    unsigned int depth = 0;
+    root = n-2;
+    int next = n-1;
+    while( available > 0 ) {
+        while( root >= 0 && A[root] == depth ) {
+            used++;
+            root--;
+        }
+        while( available > used ) {
+            A[next--] = depth;
+            available--;
+        }
+        available = 2*used;
+        depth++;
+        used = 0;
+    }
+}
+
+/** Bit-reversed canonical codes for the given code lengths. */
+void
+canonicalCodes( unsigned short* codes, const unsigned char* lengths, unsigned int n )
+{
+    unsigned int count[max_code_bits+1] = { 0 };
+    for( unsigned int s=0; s<n; s++ ) {
+        count[ lengths[s] ]++;
+    }
+    count[0] = 0;
+    unsigned int next[max_code_bits+1];
+    unsigned int code = 0;
+    for( unsigned int b=1; b<=max_code_bits; b++ ) {
+        code = (code + count[b-1]) << 1;
+        next[b] = code;
+    }
+    for( unsigned int s=0; s<n; s++ ) {
+        unsigned int length = lengths[s];
+        if( length ) {
+            unsigned int c = next[length]++;
+            unsigned int r = 0;
+            for( unsigned int b=0; b<length; b++ ) {
+                r = (r << 1) | ((c >> b) & 1u);
+            }
+            codes[s] = r;
+        }
+        else {
+            codes[s] = 0;
+        }
+    }
+}
+
+/** Run-length codes the code lengths with symbols 16 (repeat the previous
+ * length 3 to 6 times), 17 (3 to 10 zeros) and 18 (11 to 138 zeros).
+ * Returns the number of symbols; extra holds the value of their extra bits.
+ */
+unsigned int
+runLengthCodeLengths( unsigned char* symbols,
+                      unsigned char* extra,
+                      const unsigned char* lengths,
+                      unsigned int n )
+{
+    unsigned int m = 0;
+    unsigned int i = 0;
+    while( i < n ) {
+        unsigned int value = lengths[i];
+        unsigned int run = 1;
+        while( i+run < n && lengths[i+run] == value ) {
+            run++;
+        }
+        i += run;
+        if( value == 0 ) {
+            while( run >= 11 ) {
+                unsigned int r = run < 138 ? run : 138;
+                symbols[m] = 18;
+                extra[m++] = r - 11;
+                run -= r;
+            }
+            if( run >= 3 ) {
+                symbols[m] = 17;
+                extra[m++] = run - 3;
+                run = 0;
+            }
+        }
+        else {
+            symbols[m] = value;
+            extra[m++] = 0;
+            run--;
+            while( run >= 3 ) {
+                unsigned int r = run < 6 ? run : 6;
+                symbols[m] = 16;
+                extra[m++] = r - 3;
+                run -= r;
+            }
+        }
+        for( ; run > 0; run-- ) {
+            symbols[m] = value;
+            extra[m++] = 0;
+        }
+    }
+    return m;
+}
+
+/** Code length header of a dynamic Huffman block. */
+struct DynamicHeader
+{
+    unsigned int    m_hlit;
+    unsigned int    m_hdist;
+    unsigned int    m_hclen;
+    unsigned int    m_symbols_n;
+    unsigned char   m_symbols[286+30];      ///< Run-length coded code lengths.
+    unsigned char   m_extra[286+30];
+    unsigned char   m_cl_lengths[19];
+    unsigned short  m_cl_codes[19];
+
+    /** Size of the header in bits, including BFINAL and BTYPE. */
+    unsigned int
+    bits() const
+    {
+        unsigned int b = 3 + 5 + 5 + 4 + 3*m_hclen;
+        for( unsigned int k=0; k<m_symbols_n; k++ ) {
+            unsigned int s = m_symbols[k];
+            b += m_cl_lengths[s] + (s == 16 ? 2 : s == 17 ? 3 : s == 18 ? 7 : 0);
+        }
+        return b;
+    }
+};
+
+void
+makeDynamicHeader( DynamicHeader& header, const DynamicHuffmanCodes& huffman );
+
+} // of anonymous namespace
+
+void
+huffmanCodeLengths( unsigned char* lengths,
+                    const unsigned int* frequencies,
+                    unsigned int n,
+                    unsigned int max_bits )
+{
+    unsigned int symbols[288];
+    unsigned int weights[288];
+    unsigned int m = 0;
+    for( unsigned int s=0; s<n; s++ ) {
+        lengths[s] = 0;
+        if( frequencies[s] ) {
+            symbols[m++] = s;
+        }
+    }
+    if( m < 2 ) {
+        unsigned int a = m == 1 ? symbols[0] : 0;
+        lengths[a] = 1;
+        lengths[a == 0 ? 1 : 0] = 1;
+        return;
+    }
+    std::sort( symbols, symbols + m, ByFrequency( frequencies ) );
+    for( unsigned int k=0; k<m; k++ ) {
+        weights[k] = frequencies[ symbols[k] ];
+    }
+    minimumRedundancy( weights, m );
+
+    // Limit the lengths to max_bits. Clamping leaves the code
+    // oversubscribed; moving a leaf from depth max_bits to a shallower leaf's
+    // place, which then splits into two leaves one level down, takes out one
+    // unit of 2^-max_bits at a time until the Kraft sum is 1 again.
+    unsigned int count[max_code_bits+1] = { 0 };
+    for( unsigned int k=0; k<m; k++ ) {
+        count[ weights[k] < max_bits ? weights[k] : max_bits ]++;
+    }
+    unsigned int kraft = 0;
+    for( unsigned int b=1; b<=max_bits; b++ ) {
+        kraft += count[b] << (max_bits - b);
+    }
+    while( kraft > (1u << max_bits) ) {
+        count[max_bits]--;
+        for( unsigned int b=max_bits-1; b>0; b-- ) {
+            if( count[b] ) {
+                count[b]--;
+                count[b+1] += 2;
+                break;
+            }
+        }
+        kraft--;
+    }
+
+    // Least frequent symbols get the longest codes.
+    unsigned int k = 0;
+    for( unsigned int b=max_bits; b>0; b-- ) {
+        for( unsigned int j=0; j<count[b]; j++ ) {
+            lengths[ symbols[k++] ] = b;
+        }
+    }
+}
+
+void
+DeflateHistogram::clear()
+{
+    for( unsigned int s=0; s<286; s++ ) {
+        m_litlen[s] = 0;
+    }
+    for( unsigned int s=0; s<30; s++ ) {
+        m_distance[s] = 0;
+    }
+    m_bytes = 0;
+}
+
+void
+DeflateHistogram::add( const unsigned int* codes, unsigned int N )
+{
+    for( unsigned int j=0; j<N; j++ ) {
+        unsigned int code = codes[j];
+        if( code&0x80000000u ) {
+            m_litlen[ code&0xffu ]++;
+            m_bytes++;
+        }
+        else {
+            unsigned int extra;
+            m_litlen[ deflateLengthSymbol( code >> 16u, extra ) ]++;
+            m_distance[ deflateDistanceSymbol( code & 0xffffu, extra ) ]++;
+            m_bytes += code >> 16u;
+        }
+    }
+}
+
+void
+DeflateHistogram::add( const DeflateHistogram& other )
+{
+    for( unsigned int s=0; s<286; s++ ) {
+        m_litlen[s] += other.m_litlen[s];
+    }
+    for( unsigned int s=0; s<30; s++ ) {
+        m_distance[s] += other.m_distance[s];
+    }
+    m_bytes += other.m_bytes;
+}
+
+void
+buildDynamicHuffman( DynamicHuffmanCodes& huffman,
+                     const DeflateHistogram& histogram )
+{
+    unsigned int litlen[286];
+    for( unsigned int s=0; s<286; s++ ) {
+        litlen[s] = histogram.m_litlen[s];
+    }
+    litlen[256] = 1;    // end of block
+    huffmanCodeLengths( huffman.m_litlen_lengths, litlen, 286, max_code_bits );
+    huffmanCodeLengths( huffman.m_distance_lengths, histogram.m_distance, 30, max_code_bits );
+    canonicalCodes( huffman.m_litlen_codes, huffman.m_litlen_lengths, 286 );
+    canonicalCodes( huffman.m_distance_codes, huffman.m_distance_lengths, 30 );
+}
+
+// --- block splitting -------------------------------------------------------
+
+namespace {
+
+/** Codes per unit of planDeflateBlocks. */
+const unsigned int split_unit = 4096;
+
+const unsigned char fixed_litlen_lengths[286] = {
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+    9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+    9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+    9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 8, 8, 8, 8, 8 };
+
+const unsigned char fixed_distance_lengths[30] = {
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5 };
+
+/** Bits of a stretch of codes under the given code lengths, without the
+ * end-of-block code.
+ */
+size_t
+codedBits( const DeflateHistogram& histogram,
+           const unsigned char* litlen_lengths,
+           const unsigned char* distance_lengths )
+{
+    size_t bits = 0;
+    for( unsigned int s=0; s<256; s++ ) {
+        bits += (size_t)histogram.m_litlen[s]*litlen_lengths[s];
+    }
+    for( unsigned int s=257; s<286; s++ ) {
+        bits += (size_t)histogram.m_litlen[s]*(litlen_lengths[s] + length_extra[s-257]);
+    }
+    for( unsigned int s=0; s<30; s++ ) {
+        bits += (size_t)histogram.m_distance[s]*(distance_lengths[s] + distance_extra[s]);
+    }
+    return bits;
+}
+
+/** Cheapest coding of a block and its size in bits. huffman receives the
+ * dynamic codes.
+ */
+size_t
+blockCost( DeflateBlockType& type,
+           DynamicHuffmanCodes& huffman,
+           const DeflateHistogram& histogram )
+{
+    // Stored blocks hold at most 65535 bytes each, after 3 header bits, up
+    // to 7 bits of padding and 32 bits of LEN and NLEN.
+    size_t stored_blocks = histogram.m_bytes ? (histogram.m_bytes + 65534)/65535 : 1;
+    size_t stored = stored_blocks*(3 + 7 + 32) + 8*(size_t)histogram.m_bytes;
+
+    size_t fixed_bits = 3 + codedBits( histogram, fixed_litlen_lengths, fixed_distance_lengths ) + 7;
+
+    buildDynamicHuffman( huffman, histogram );
+    DynamicHeader header;
+    makeDynamicHeader( header, huffman );
+    size_t dynamic = header.bits()
+                   + codedBits( histogram, huffman.m_litlen_lengths, huffman.m_distance_lengths )
+                   + huffman.m_litlen_lengths[256];
+
+    type = DEFLATE_DYNAMIC;
+    size_t best = dynamic;
+    if( fixed_bits <= best ) {
+        type = DEFLATE_FIXED;
+        best = fixed_bits;
+    }
+    if( stored < best ) {
+        type = DEFLATE_STORED;
+        best = stored;
+    }
+    return best;
+}
+
+} // of anonymous namespace
+
+void
+planDeflateBlocks( std::vector<DeflateBlock>& blocks,
+                   const unsigned int* codes,
+                   unsigned int N )
+{
+    blocks.clear();
+
+    // The current block is the last entry of blocks, with its statistics
+    // and cost alongside. Types and codes are filled in once the blocks are
+    // final.
+    DeflateHistogram block;
+    DeflateHistogram unit;
+    DeflateHistogram merged;
+    DeflateBlockType type;
+    DynamicHuffmanCodes scratch;
+    size_t block_cost = 0;
+    unsigned int a = 0;
+    do {
+        unsigned int n = N-a < split_unit ? N-a : split_unit;
+        unit.clear();
+        unit.add( codes + a, n );
+        a += n;
+
+        if( !blocks.empty() ) {
+            merged = block;
+            merged.add( unit );
+            size_t merged_cost = blockCost( type, scratch, merged );
+            size_t unit_cost = blockCost( type, scratch, unit );
+            if( merged_cost <= block_cost + unit_cost ) {
+                block = merged;
+                block_cost = merged_cost;
+                blocks.back().m_codes += n;
+                continue;
+            }
+        }
+        block = unit;
+        blocks.push_back( DeflateBlock() );
+        blocks.back().m_codes = n;
+        block_cost = blockCost( type, scratch, block );
+    } while( a < N );
+
+    a = 0;
+    for( size_t b=0; b<blocks.size(); b++ ) {
+        block.clear();
+        block.add( codes + a, blocks[b].m_codes );
+        blockCost( blocks[b].m_type, blocks[b].m_huffman, block );
+        blocks[b].m_bytes = block.m_bytes;
+        a += blocks[b].m_codes;
+    }
+}
+
+void
+encodeDeflateBlocks( BitPusher& pusher,
+                     const std::vector<DeflateBlock>& blocks,
+                     const unsigned int* codes,
+                     const unsigned char* data,
+                     bool final )
+{
+    for( size_t b=0; b<blocks.size(); b++ ) {
+        const DeflateBlock& block = blocks[b];
+        bool last = final && b+1 == blocks.size();
+        switch( block.m_type ) {
+        case DEFLATE_STORED:
+        {
+            unsigned int bytes = block.m_bytes;
+            do {
+                unsigned int n = bytes < 65535 ? bytes : 65535;
+                bytes -= n;
+                pusher.pushBits( last && bytes == 0 ? 1 : 0, 1 );  // BFINAL
+                pusher.pushBits( 0, 2 );                            // BTYPE (=00)
+                unsigned char length[4] = { (unsigned char)(n & 0xffu), (unsigned char)(n >> 8),
+                                            (unsigned char)(~n & 0xffu), (unsigned char)((~n >> 8) & 0xffu) };
+                pusher.pushBytes( length, 4 );
+                pusher.pushBytes( data, n );
+                data += n;
+            } while( bytes > 0 );
+            break;
+        }
+        case DEFLATE_FIXED:
+            pusher.pushBits( last ? 1 : 0, 1 );     // BFINAL
+            pusher.pushBits( 1, 2 );                // BTYPE (=01)
+            encodeFixedHuffman( pusher, codes, block.m_codes );
+            endFixedHuffman( pusher );
+            data += block.m_bytes;
+            break;
+        case DEFLATE_DYNAMIC:
+            beginDynamicHuffman( pusher, block.m_huffman, last );
+            encodeDynamicHuffman( pusher, block.m_huffman, codes, block.m_codes );
+            endDynamicHuffman( pusher, block.m_huffman );
+            data += block.m_bytes;
+            break;
+        }
+        codes += block.m_codes;
+    }
+}
+
 void
 encodeHuffman( std::vector<unsigned char>& output,
                unsigned int** code_stream_p,
                unsigned int*  code_stream_N,
-               unsigned int   code_streams )
+               const unsigned char** data_p,
+               unsigned int   code_streams,
+               const std::vector<DeflateBlock>* blocks )
 {
-    
-    output.push_back(  8 + (7<<4) );  // CM=8=deflate, CINFO=7=32K window size = 112
-    output.push_back( 94 /* 28*/ );           // FLG
-
     BitPusher pusher( output );
+    beginZlib( pusher );
+    std::vector<DeflateBlock> own;
+    for( unsigned int k=0; k<code_streams; k++ ) {
+        if( blocks == NULL ) {
+            planDeflateBlocks( own, code_stream_p[k], code_stream_N[k] );
+        }
+        encodeDeflateBlocks( pusher, blocks ? blocks[k] : own, code_stream_p[k], data_p[k],
+                             k+1 == code_streams );
+    }
+}
+
+size_t
+appendBitstream( std::vector<unsigned char>& dst,
+                 size_t dst_bits,
+                 const unsigned char* src,
+                 size_t src_bits )
+{
+    size_t src_bytes = (src_bits + 7)/8;
+    size_t o = dst_bits/8;
+    unsigned int shift = dst_bits & 7u;
+    if( shift == 0 ) {
+        dst.insert( dst.end(), src, src + src_bytes );
+        return dst_bits + src_bits;
+    }
+
+    // Byte i of the output is byte i of src shifted up, with the top bits of
+    // byte i-1 shifted in below; byte 0 keeps the bits already in dst.
+    dst.resize( o + src_bytes + 1 );
+    unsigned char* out = dst.data() + o;
+    unsigned int carry = out[0] & ((1u << shift) - 1u);
+    size_t i = 0;
+    for( ; i<src_bytes && i<8; i++ ) {
+        out[i] = carry | (src[i] << shift);
+        carry = src[i] >> (8-shift);
+    }
+    // The same on 64-bit lanes, where the bits shifted in come from the
+    // eight bytes before the lane.
+    __m128i left = _mm_cvtsi32_si128( shift );
+    __m128i right = _mm_cvtsi32_si128( 64 - shift );
+    for( ; i+16 <= src_bytes; i+=16 ) {
+        __m128i a = _mm_loadu_si128( (const __m128i*)(src + i) );
+        __m128i b = _mm_loadu_si128( (const __m128i*)(src + i - 8) );
+        _mm_storeu_si128( (__m128i*)(out + i),
+                          _mm_or_si128( _mm_sll_epi64( a, left ), _mm_srl_epi64( b, right ) ) );
+    }
+    if( i > 0 ) {
+        carry = src[i-1] >> (8-shift);
+    }
+    for( ; i<src_bytes; i++ ) {
+        out[i] = carry | (src[i] << shift);
+        carry = src[i] >> (8-shift);
+    }
+    out[src_bytes] = carry;
+    dst.resize( (dst_bits + src_bits + 7)/8 );
+    return dst_bits + src_bits;
+}
+
+size_t
+alignBitstream( std::vector<unsigned char>& dst,
+                size_t dst_bits )
+{
+    if( (dst_bits & 7u) == 0 ) {
+        return dst_bits;
+    }
+    // BFINAL=0 and BTYPE=00, padding, then LEN=0 and NLEN=0xffff.
+    const unsigned char header = 0;
+    const unsigned char length[4] = { 0x00, 0x00, 0xff, 0xff };
+    dst_bits = appendBitstream( dst, dst_bits, &header, 3 );
+    dst_bits = (dst_bits + 7) & ~(size_t)7;
+    return appendBitstream( dst, dst_bits, length, 32 );
+}
+
+bool
+hasStoredBlock( const std::vector<DeflateBlock>& blocks )
+{
+    for( size_t b=0; b<blocks.size(); b++ ) {
+        if( blocks[b].m_type == DEFLATE_STORED ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+beginZlib( BitPusher& pusher )
+{
+    pusher.pushBits(  8 + (7<<4), 8 );  // CM=8=deflate, CINFO=7=32K window size = 112
+    pusher.pushBits( 94 /* 28*/, 8 );   // FLG
+}
+
+namespace {
+
+void
+makeDynamicHeader( DynamicHeader& header, const DynamicHuffmanCodes& huffman )
+{
+    header.m_hlit = 286;
+    while( header.m_hlit > 257 && huffman.m_litlen_lengths[header.m_hlit-1] == 0 ) {
+        header.m_hlit--;
+    }
+    header.m_hdist = 30;
+    while( header.m_hdist > 1 && huffman.m_distance_lengths[header.m_hdist-1] == 0 ) {
+        header.m_hdist--;
+    }
+
+    // Literal/length and distance code lengths are run-length coded as one
+    // sequence, which is itself Huffman coded.
+    unsigned char lengths[286+30];
+    for( unsigned int s=0; s<header.m_hlit; s++ ) {
+        lengths[s] = huffman.m_litlen_lengths[s];
+    }
+    for( unsigned int s=0; s<header.m_hdist; s++ ) {
+        lengths[header.m_hlit+s] = huffman.m_distance_lengths[s];
+    }
+    header.m_symbols_n = runLengthCodeLengths( header.m_symbols, header.m_extra, lengths,
+                                               header.m_hlit + header.m_hdist );
+
+    unsigned int frequencies[19] = { 0 };
+    for( unsigned int k=0; k<header.m_symbols_n; k++ ) {
+        frequencies[ header.m_symbols[k] ]++;
+    }
+    huffmanCodeLengths( header.m_cl_lengths, frequencies, 19, max_code_length_bits );
+    canonicalCodes( header.m_cl_codes, header.m_cl_lengths, 19 );
+    header.m_hclen = 19;
+    while( header.m_hclen > 4 && header.m_cl_lengths[ code_length_order[header.m_hclen-1] ] == 0 ) {
+        header.m_hclen--;
+    }
+}
+
+} // of anonymous namespace
+
+void
+beginDynamicHuffman( BitPusher& pusher,
+                     const DynamicHuffmanCodes& huffman,
+                     bool final )
+{
+    DynamicHeader header;
+    makeDynamicHeader( header, huffman );
+
+    pusher.pushBits( final ? 1 : 0, 1 );    // BFINAL
+    pusher.pushBits( 2, 2 );                // BTYPE (=10)
+    pusher.pushBits( header.m_hlit - 257, 5 );
+    pusher.pushBits( header.m_hdist - 1, 5 );
+    pusher.pushBits( header.m_hclen - 4, 4 );
+    for( unsigned int k=0; k<header.m_hclen; k++ ) {
+        pusher.pushBits( header.m_cl_lengths[ code_length_order[k] ], 3 );
+    }
+    for( unsigned int k=0; k<header.m_symbols_n; k++ ) {
+        unsigned int s = header.m_symbols[k];
+        pusher.pushBits( header.m_cl_codes[s], header.m_cl_lengths[s] );
+        if( s == 16 ) {
+            pusher.pushBits( header.m_extra[k], 2 );
+        }
+        else if( s == 17 ) {
+            pusher.pushBits( header.m_extra[k], 3 );
+        }
+        else if( s == 18 ) {
+            pusher.pushBits( header.m_extra[k], 7 );
+        }
+    }
+}
+
+void
+encodeDynamicHuffman( BitPusher& pusher,
+                      const DynamicHuffmanCodes& huffman,
+                      const unsigned int* codes,
+                      unsigned int N )
+{
+    for( unsigned int j=0; j<N; j++ ) {
+        unsigned int code = codes[j];
+        if( code&0x80000000u ) {
+            code = code&0xffu;
+            pusher.pushBits( huffman.m_litlen_codes[code], huffman.m_litlen_lengths[code] );
+        }
+        else {
+            unsigned int length   = code >> 16u;
+            unsigned int distance = code & 0xffffu;
+
+            // Symbol and extra bits of length and distance in one push,
+            // at most 15+5+15+13 bits.
+            unsigned int l_extra_n, d_extra_n;
+            unsigned int l = deflateLengthSymbol( length, l_extra_n );
+            unsigned int d = deflateDistanceSymbol( distance, d_extra_n );
+            unsigned long long int bits = huffman.m_litlen_codes[l];
+            unsigned int count = huffman.m_litlen_lengths[l];
+            bits |= (unsigned long long int)(length - length_base[l-257]) << count;
+            count += l_extra_n;
+            bits |= (unsigned long long int)huffman.m_distance_codes[d] << count;
+            count += huffman.m_distance_lengths[d];
+            bits |= (unsigned long long int)(distance - distance_base[d]) << count;
+            count += d_extra_n;
+            pusher.pushBits( bits, count );
+        }
+    }
+}
+
+void
+endDynamicHuffman( BitPusher& pusher,
+                   const DynamicHuffmanCodes& huffman )
+{
+    pusher.pushBits( huffman.m_litlen_codes[256], huffman.m_litlen_lengths[256] );
+}
+
+// --- fixed Huffman codes ---------------------------------------------------
+
+void
+beginFixedHuffman( BitPusher& pusher )
+{
+    beginZlib( pusher );
     pusher.pushBits( 1, 1 );    // BFINAL
     pusher.pushBits( 1, 2 );    // BTYPE (=01)
+}
 
-    for( unsigned int k=0; k<code_streams; k++ ) {
-        unsigned int* codes = code_stream_p[k];
-        for( unsigned int j=0; j<code_stream_N[k]; j++ ) {
-            unsigned int code = *codes++;
+void
+encodeFixedHuffman( BitPusher& pusher,
+                    const unsigned int* codes,
+                    unsigned int N )
+{
+    for( unsigned int j=0; j<N; j++ ) {
+        unsigned int code = *codes++;
+        
+        // --- Literal value -----------------------------------------------
+        // max 9 bits
+        if( code&0x80000000u ) {
+            code = code&0xffu;
+            if( code < 144 ) {
+                pusher.pushBitsReverse( code + 48, 8 );
+            }
+            else {
+                pusher.pushBitsReverse( code + (400-144), 9 );
+            }
+        }
+        
+        // --- Length-distance pair ----------------------------------------
+        else {
+            unsigned int length   = code >> 16u;
+            unsigned int distance = code & 0xffffu;
             
-            // --- Literal value -----------------------------------------------
-            // max 9 bits
-            if( code&0x80000000u ) {
-                code = code&0xffu;
-                if( code < 144 ) {
-                    pusher.pushBitsReverse( code + 48, 8 );
+            // --- 7-bit length Huffman code -------------------------------
+            if( length < 115 ) {    // 7-bit length Huffman code
+                unsigned int length_code, length_bits, length_bits_n;
+                
+                if( length < 11 ) {
+                    length_code     = length-2;
+                    length_bits     = 0;
+                    length_bits_n   = 0;
                 }
-                else {
-                    pusher.pushBitsReverse( code + (400-144), 9 );
+                else if(length < 19 ) {
+                    length_code     = ((length-11)>>1)+9;
+                    length_bits     = (length-11)&0x1;
+                    length_bits_n   = 1;
+                }
+                else if(length < 35 ) {
+                    length_code     = ((length-19)>>2)+13;
+                    length_bits     = (length-19)&0x3;
+                    length_bits_n   = 2;
                 }
+                else if(length < 67 ) {
+                    length_code     = ((length-35)>>3)+(273-256);
+                    length_bits     = (length-35)&0x7;
+                    length_bits_n   = 3;
+                }
+                else {  // length < 131
+                    length_code     = ((length-67)>>4)+(277-256);
+                    length_bits     = (length-67)&0xf;
+                    length_bits_n   = 4;
+                }
+                length_code = ((length_code&0x55u)<<1u) | ((length_code>>1u)&0x55u);
+                length_code = ((length_code&0x33u)<<2u) | ((length_code>>2u)&0x33u);
+                length_code = ((length_code&0x0fu)<<4u) | ((length_code>>4u)&0x0fu);
+                length_code = (length_code>>1);
+                length_code = length_code | (length_bits<<7);
+                pusher.pushBits( length_code, 7 + length_bits_n );
             }
-            
-            // --- Length-distance pair ----------------------------------------
-            else {
-                unsigned int length   = code >> 16u;
-                unsigned int distance = code & 0xffffu;
+            else if( length < 258 ) {                  // 8-bit length Huffman code
+                unsigned int length_code, length_bits, length_bits_n;
                 
-                // --- 7-bit length Huffman code -------------------------------
-                if( length < 115 ) {    // 7-bit length Huffman code
-                    unsigned int length_code, length_bits, length_bits_n;
-                    
-                    if( length < 11 ) {
-                        length_code     = length-2;
-                        length_bits     = 0;
-                        length_bits_n   = 0;
-                    }
-                    else if(length < 19 ) {
-                        length_code     = ((length-11)>>1)+9;
-                        length_bits     = (length-11)&0x1;
-                        length_bits_n   = 1;
-                    }
-                    else if(length < 35 ) {
-                        length_code     = ((length-19)>>2)+13;
-                        length_bits     = (length-19)&0x3;
-                        length_bits_n   = 2;
-                    }
-                    else if(length < 67 ) {
-                        length_code     = ((length-35)>>3)+(273-256);
-                        length_bits     = (length-35)&0x7;
-                        length_bits_n   = 3;
-                    }
-                    else {  // length < 131
-                        length_code     = ((length-67)>>4)+(277-256);
-                        length_bits     = (length-67)&0xf;
-                        length_bits_n   = 4;
-                    }
-                    length_code = ((length_code&0x55u)<<1u) | ((length_code>>1u)&0x55u);
-                    length_code = ((length_code&0x33u)<<2u) | ((length_code>>2u)&0x33u);
-                    length_code = ((length_code&0x0fu)<<4u) | ((length_code>>4u)&0x0fu);
-                    length_code = (length_code>>1);
-                    length_code = length_code | (length_bits<<7);
-                    pusher.pushBits( length_code, 7 + length_bits_n );
+                if( length < 131 ) {
+                    length_code     = 192;
+                    length_bits     = (length-115)&0xf;
+                    length_bits_n   = 4;
                 }
-                else if( length < 258 ) {                  // 8-bit length Huffman code
-                    unsigned int length_code, length_bits, length_bits_n;
-                    
-                    if( length < 131 ) {
-                        length_code     = 192;
-                        length_bits     = (length-115)&0xf;
-                        length_bits_n   = 4;
-                    }
-                    else if( length < 258 ) {
-                        length_code     = ((length-131)>>5)+(281-280+192);
-                        length_bits     = (length-131)&0x1f;
-                        length_bits_n   = 5;
-                    }
-                    else {
-                        length_code     = (285-280+192);
-                        length_bits     = 0;
-                        length_bits_n   = 0;
-                    }
-                    
-                    length_code = ((length_code&0x55u)<<1u) | ((length_code>>1u)&0x55u);
-                    length_code = ((length_code&0x33u)<<2u) | ((length_code>>2u)&0x33u);
-                    length_code = ((length_code&0x0fu)<<4u) | ((length_code>>4u)&0x0fu);
-                    length_code = length_code | (length_bits<<8);
-                    pusher.pushBits( length_code, 8 + length_bits_n );
-                    
+                else if( length < 258 ) {
+                    length_code     = ((length-131)>>5)+(281-280+192);
+                    length_bits     = (length-131)&0x1f;
+                    length_bits_n   = 5;
                 }
                 else {
-                    
-                    pusher.pushBits( 163, 8 );  // = 197 reversed.
+                    length_code     = (285-280+192);
+                    length_bits     = 0;
+                    length_bits_n   = 0;
                 }
                 
-                // --- Encode distance Huffman codes ---------------------------
+                length_code = ((length_code&0x55u)<<1u) | ((length_code>>1u)&0x55u);
+                length_code = ((length_code&0x33u)<<2u) | ((length_code>>2u)&0x33u);
+                length_code = ((length_code&0x0fu)<<4u) | ((length_code>>4u)&0x0fu);
+                length_code = length_code | (length_bits<<8);
+                pusher.pushBits( length_code, 8 + length_bits_n );
                 
-                if( distance < 5 ) {
-                    unsigned int distance_code;
-                    distance_code   = distance-1;   // 
-                    
-                    distance_code = ((distance_code&0x55u)<<1u) | ((distance_code>>1u)&0x55u);
-                    distance_code = ((distance_code&0x33u)<<2u) | ((distance_code>>2u)&0x33u);
-                    distance_code = ((distance_code&0x0Fu)<<1u) | ((distance_code>>7u)&0x01u);
-                    pusher.pushBits( distance_code, 5u );
-                }
-                else {
-                    unsigned int distance_code = 0;
-                    unsigned int distance_bits = 0;
-                    unsigned int distance_bits_n = 0;
-                    
-                    for(unsigned int i=1; i<14u; i++ ) {
-                        if( distance < ((4u<<i)+1u) ) {
-                            distance_code   = ((distance - ((4<<(i-1))+1))>>i) + (2+2*i);
-                            distance_bits   = (distance - ((4<<(i-1))+1)) & ((1<<i)-1);
-                            distance_bits_n = i;
-                            break;
-                        }
+            }
+            else {
+                
+                pusher.pushBits( 163, 8 );  // = 197 reversed.
+            }
+            
+            // --- Encode distance Huffman codes ---------------------------
+            
+            if( distance < 5 ) {
+                unsigned int distance_code;
+                distance_code   = distance-1;   // 
+                
+                distance_code = ((distance_code&0x55u)<<1u) | ((distance_code>>1u)&0x55u);
+                distance_code = ((distance_code&0x33u)<<2u) | ((distance_code>>2u)&0x33u);
+                distance_code = ((distance_code&0x0Fu)<<1u) | ((distance_code>>7u)&0x01u);
+                pusher.pushBits( distance_code, 5u );
+            }
+            else {
+                unsigned int distance_code = 0;
+                unsigned int distance_bits = 0;
+                unsigned int distance_bits_n = 0;
+                
+                for(unsigned int i=1; i<14u; i++ ) {
+                    if( distance < ((4u<<i)+1u) ) {
+                        distance_code   = ((distance - ((4<<(i-1))+1))>>i) + (2+2*i);
+                        distance_bits   = (distance - ((4<<(i-1))+1)) & ((1<<i)-1);
+                        distance_bits_n = i;
+                        break;
                     }
-                    
-                    distance_code = ((distance_code&0x55u)<<1u) | ((distance_code>>1u)&0x55u);
-                    distance_code = ((distance_code&0x33u)<<2u) | ((distance_code>>2u)&0x33u);
-                    distance_code = ((distance_code&0x0Fu)<<1u) | ((distance_code>>7u)&0x01u);
-                    
-                    distance_code = distance_code | (distance_bits<<5u);
-                    pusher.pushBits( distance_code, 5u + distance_bits_n );
                 }
                 
+                distance_code = ((distance_code&0x55u)<<1u) | ((distance_code>>1u)&0x55u);
+                distance_code = ((distance_code&0x33u)<<2u) | ((distance_code>>2u)&0x33u);
+                distance_code = ((distance_code&0x0Fu)<<1u) | ((distance_code>>7u)&0x01u);
+                
+                distance_code = distance_code | (distance_bits<<5u);
+                pusher.pushBits( distance_code, 5u + distance_bits_n );
             }
         }
     }
+}
+
+void
+endFixedHuffman( BitPusher& pusher )
+{
     pusher.pushBits( 0, 7 );    // EOB
 }
\ No newline at end of file
@@ -1,8 +1,234 @@
 #pragma once
+#include <cstddef>
 #include <vector>
+#include "BitPusher.hpp"
 
+/** Deflate symbol (257 to 285) of a match length of 3 to 258, with the
+ * number of extra bits that follow it.
+ */
+inline
+unsigned int
+deflateLengthSymbol( unsigned int length, unsigned int& extra_bits )
+{
+    if( length < 11 ) {
+        extra_bits = 0;
+        return 254 + length;
+    }
+    if( length == 258 ) {
+        extra_bits = 0;
+        return 285;
+    }
+    unsigned int x = length - 3;
+    unsigned int n = 31 - __builtin_clz( x );
+    extra_bits = n - 2;
+    return 257 + 4*(n-1) + ((x >> (n-2)) & 3u);
+}
+
+/** Deflate distance symbol (0 to 29) of a distance of 1 to 32768, with the
+ * number of extra bits that follow it.
+ */
+inline
+unsigned int
+deflateDistanceSymbol( unsigned int distance, unsigned int& extra_bits )
+{
+    unsigned int x = distance - 1;
+    if( x < 4 ) {
+        extra_bits = 0;
+        return x;
+    }
+    unsigned int n = 31 - __builtin_clz( x );
+    extra_bits = n - 1;
+    return 2*n + ((x >> (n-1)) & 1u);
+}
+
+/** Bits spent on every literal and match under a pair of Huffman codes, for
+ * parsers that weigh literals against matches.
+ */
+struct HuffmanCosts
+{
+    unsigned short  m_literal[256];
+    unsigned short  m_length[259];      ///< Symbol and extra bits of lengths 3 to 258.
+    unsigned short  m_distance[30];     ///< Symbol bits of distance codes, without extra bits.
+
+    unsigned int
+    literal( unsigned char c ) const { return m_literal[c]; }
+
+    unsigned int
+    match( unsigned int length, unsigned int distance ) const
+    {
+        unsigned int extra;
+        unsigned int symbol = deflateDistanceSymbol( distance, extra );
+        return m_length[length] + m_distance[symbol] + extra;
+    }
+};
+
+/** Fills costs from code lengths of the 286 literal/length and 30 distance
+ * symbols. Symbols without a code are priced as if they had 15 bits.
+ */
+void
+huffmanCosts( HuffmanCosts& costs,
+              const unsigned char* litlen_lengths,
+              const unsigned char* distance_lengths );
+
+/** Costs of the fixed Huffman codes written by encodeHuffman. */
+const HuffmanCosts&
+fixedHuffmanCosts();
+
+/** Code lengths and canonical codes of a dynamic Huffman block. Codes are
+ * bit-reversed, ready for BitPusher::pushBits.
+ */
+struct DynamicHuffmanCodes
+{
+    unsigned char   m_litlen_lengths[286];
+    unsigned char   m_distance_lengths[30];
+    unsigned short  m_litlen_codes[286];
+    unsigned short  m_distance_codes[30];
+};
+
+/** Length-limited Huffman code lengths of n symbols with the given
+ * frequencies, at most max_bits long. Symbols with frequency 0 get no code.
+ * If fewer than two symbols occur, a second one is given a code as well,
+ * since some decoders reject codes with a single symbol.
+ */
+void
+huffmanCodeLengths( unsigned char* lengths,
+                    const unsigned int* frequencies,
+                    unsigned int n,
+                    unsigned int max_bits );
+
+/** Symbol statistics of a stretch of an LZ code stream (see encodeLZ). */
+struct DeflateHistogram
+{
+    unsigned int    m_litlen[286];
+    unsigned int    m_distance[30];
+    unsigned int    m_bytes;            ///< Input bytes covered by the codes.
+
+    void
+    clear();
+
+    void
+    add( const unsigned int* codes, unsigned int N );
+
+    void
+    add( const DeflateHistogram& other );
+};
+
+/** Builds dynamic Huffman codes for the given statistics. */
+void
+buildDynamicHuffman( DynamicHuffmanCodes& huffman,
+                     const DeflateHistogram& histogram );
+
+enum DeflateBlockType
+{
+    DEFLATE_STORED,
+    DEFLATE_FIXED,
+    DEFLATE_DYNAMIC
+};
+
+/** One deflate block of a code stream, as chosen by planDeflateBlocks. */
+struct DeflateBlock
+{
+    DeflateBlockType    m_type;
+    unsigned int        m_codes;        ///< Codes in the block.
+    unsigned int        m_bytes;        ///< Input bytes they cover.
+    DynamicHuffmanCodes m_huffman;      ///< Codes of a dynamic block.
+};
+
+/** Splits a code stream into deflate blocks and picks the cheapest coding
+ * for each.
+ *
+ * The stream is cut into units of a few thousand codes. Going left to
+ * right, a unit joins the current block if coding them together is no more
+ * expensive than coding them apart, else it starts a new block. Costs are
+ * the exact sizes of stored, fixed and dynamic coding, including the
+ * headers. Blocks never span code streams, so every stripe is planned by
+ * the worker that produced it.
+ */
+void
+planDeflateBlocks( std::vector<DeflateBlock>& blocks,
+                   const unsigned int* codes,
+                   unsigned int N );
+
+/** Pushes the blocks planned for codes, which encode data. The last one is
+ * marked final if final is set.
+ */
+void
+encodeDeflateBlocks( BitPusher& pusher,
+                     const std::vector<DeflateBlock>& blocks,
+                     const unsigned int* codes,
+                     const unsigned char* data,
+                     bool final );
+
+/** Pushes the zlib header and the code streams, which encode the bytes at
+ * data_p, as the deflate blocks planned for each, or as planned here if
+ * blocks is NULL. The caller appends the Adler-32.
+ */
 void
 encodeHuffman( std::vector<unsigned char>& output,
                unsigned int** code_stream_p,
                unsigned int*  code_stream_N,
-               unsigned int   code_streams );
+               const unsigned char** data_p,
+               unsigned int   code_streams,
+               const std::vector<DeflateBlock>* blocks = NULL );
+
+/** Appends the first src_bits bits of src to the dst_bits bits held in dst,
+ * in deflate bit order, and returns the new number of bits. dst must be
+ * (dst_bits+7)/8 bytes long and src zero-padded to a whole byte. Unless
+ * dst_bits is a multiple of 8 the bytes of src are shifted into place, 16
+ * at a time with SSE.
+ */
+size_t
+appendBitstream( std::vector<unsigned char>& dst,
+                 size_t dst_bits,
+                 const unsigned char* src,
+                 size_t src_bits );
+
+/** Pads the dst_bits bits held in dst to a byte boundary with an empty,
+ * non-final stored block, if they do not end on one, and returns the new
+ * number of bits. Stored blocks are byte aligned where they are pushed, so
+ * a bitstream holding any must start on a byte boundary to be appended with
+ * appendBitstream.
+ */
+size_t
+alignBitstream( std::vector<unsigned char>& dst,
+                size_t dst_bits );
+
+/** True if any of blocks is stored. */
+bool
+hasStoredBlock( const std::vector<DeflateBlock>& blocks );
+
+/** Pushes the zlib stream header. */
+void
+beginZlib( BitPusher& pusher );
+
+/** Opens a dynamic Huffman block and pushes its code length header. */
+void
+beginDynamicHuffman( BitPusher& pusher,
+                     const DynamicHuffmanCodes& huffman,
+                     bool final );
+
+/** Pushes an LZ code stream as codes of an open dynamic Huffman block. */
+void
+encodeDynamicHuffman( BitPusher& pusher,
+                      const DynamicHuffmanCodes& huffman,
+                      const unsigned int* codes,
+                      unsigned int N );
+
+/** Pushes the end-of-block code of a dynamic Huffman block. */
+void
+endDynamicHuffman( BitPusher& pusher,
+                   const DynamicHuffmanCodes& huffman );
+
+/** Pushes the zlib header and opens a final fixed Huffman block. */
+void
+beginFixedHuffman( BitPusher& pusher );
+
+/** Pushes an LZ code stream (see encodeLZ) as fixed Huffman codes. */
+void
+encodeFixedHuffman( BitPusher& pusher,
+                    const unsigned int* codes,
+                    unsigned int N );
+
+/** Pushes the end-of-block code closing the block opened by beginFixedHuffman. */
+void
+endFixedHuffman( BitPusher& pusher );
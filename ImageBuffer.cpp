@@ -0,0 +1,102 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ImageBuffer.hpp"
+
+static const size_t tail_padding = 16;
+
+ImageBuffer::ImageBuffer()
+    : m_map( NULL ),
+      m_map_size( 0 ),
+      m_data( NULL ),
+      m_size( 0 ),
+      m_format( PIXEL_RGB8 )
+{}
+
+ImageBuffer::~ImageBuffer()
+{
+    release();
+}
+
+void
+ImageBuffer::release()
+{
+    if( m_map != NULL ) {
+        munmap( m_map, m_map_size );
+        m_map = NULL;
+        m_map_size = 0;
+    }
+    std::vector<char>().swap( m_storage );
+    m_data = NULL;
+    m_size = 0;
+    m_format = PIXEL_RGB8;
+}
+
+void
+ImageBuffer::resize( size_t size )
+{
+    if( m_map != NULL ) {
+        release();
+    }
+    // resize() keeps the capacity, so reused buffers do not reallocate.
+    m_storage.resize( size + tail_padding );
+    memset( m_storage.data() + size, 0, tail_padding );
+    m_data = m_storage.data();
+    m_size = size;
+    m_format = PIXEL_RGB8;
+}
+
+char*
+ImageBuffer::writable()
+{
+    return m_map == NULL ? m_storage.data() : NULL;
+}
+
+bool
+ImageBuffer::map( const std::string& path, size_t offset, size_t size )
+{
+    release();
+
+    int fd = open( path.c_str(), O_RDONLY );
+    if( fd < 0 ) {
+        std::cerr << "Failed to open '" << path << "': " << strerror( errno ) << "\n";
+        return false;
+    }
+    struct stat st;
+    if( fstat( fd, &st ) != 0 || (size_t)st.st_size < offset + size ) {
+        std::cerr << "'" << path << "' is shorter than " << (offset + size) << " bytes.\n";
+        close( fd );
+        return false;
+    }
+
+    // Reserve room for the file plus a zero page, then map the file over the
+    // start of it. Reading past the end of a file mapping faults, reading into
+    // the anonymous tail does not.
+    size_t page = sysconf( _SC_PAGESIZE );
+    size_t file_size = st.st_size;
+    size_t map_size = ((file_size + tail_padding + page - 1)/page)*page + page;
+    void* base = mmap( NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( base == MAP_FAILED ) {
+        std::cerr << "Failed to reserve " << map_size << " bytes for '" << path << "'.\n";
+        close( fd );
+        return false;
+    }
+    void* file = mmap( base, file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, fd, 0 );
+    close( fd );
+    if( file == MAP_FAILED ) {
+        std::cerr << "Failed to map '" << path << "': " << strerror( errno ) << "\n";
+        munmap( base, map_size );
+        return false;
+    }
+    madvise( base, file_size, MADV_SEQUENTIAL );
+
+    m_map = base;
+    m_map_size = map_size;
+    m_data = (const char*)base + offset;
+    m_size = size;
+    return true;
+}
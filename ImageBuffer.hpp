@@ -0,0 +1,71 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "PixelFormat.hpp"
+
+/** Read-only pixel bytes handed to the encoders, either owned or a view of a
+ * memory-mapped file.
+ *
+ * Mapped files are followed by at least 16 readable bytes so that SIMD
+ * kernels may read past the end of the image, as they do for owned buffers
+ * allocated with padding.
+ */
+class ImageBuffer
+{
+public:
+    ImageBuffer();
+
+    ~ImageBuffer();
+
+    /** Replaces contents with size owned bytes of format PIXEL_RGB8, for the
+     * caller to fill through writable(). Owned storage keeps its capacity,
+     * so the bytes are left over from earlier contents; only the padding
+     * past the end is zeroed.
+     */
+    void
+    resize( size_t size );
+
+    /** Unmaps or frees the contents, giving back the capacity as well. */
+    void
+    release();
+
+    /** Maps size bytes of a file starting at offset without copying, of format PIXEL_RGB8. */
+    bool
+    map( const std::string& path, size_t offset, size_t size );
+
+    /** Writable pointer to owned storage, NULL when mapped. */
+    char*
+    writable();
+
+    const char*
+    data() const { return m_data; }
+
+    size_t
+    size() const { return m_size; }
+
+    bool
+    mapped() const { return m_map != NULL; }
+
+    PixelFormat
+    format() const { return m_format; }
+
+    void
+    setFormat( PixelFormat format ) { m_format = format; }
+
+    const char&
+    operator[]( size_t i ) const { return m_data[i]; }
+
+protected:
+    std::vector<char>   m_storage;
+    void*               m_map;
+    size_t              m_map_size;
+    const char*         m_data;
+    size_t              m_size;
+    PixelFormat         m_format;
+
+private:
+    ImageBuffer( const ImageBuffer& );
+
+    ImageBuffer&
+    operator=( const ImageBuffer& );
+};
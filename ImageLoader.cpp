@@ -0,0 +1,325 @@
+#include <png.h>
+#include <cstdio>
+#include <cctype>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "timer.hpp"
+#include "ImageLoader.hpp"
+
+static
+bool
+loadPNG( ImageBuffer& image, int& w, int& h, const std::string& path )
+{
+    FILE* fp = fopen( path.c_str(), "rb" );
+    if( fp == NULL ) {
+        std::cerr << "Failed to open '" << path << "'\n";
+        return false;
+    }
+
+    png_structp png_ptr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+    png_infop info_ptr = png_ptr != NULL ? png_create_info_struct( png_ptr ) : NULL;
+    if( info_ptr == NULL ) {
+        std::cerr << "Failed to create libpng read structs.\n";
+        png_destroy_read_struct( &png_ptr, NULL, NULL );
+        fclose( fp );
+        return false;
+    }
+
+    std::vector<png_bytep> rows;
+    if( setjmp( png_jmpbuf(png_ptr) ) ) {
+        std::cerr << "Failed to decode '" << path << "'.\n";
+        png_destroy_read_struct( &png_ptr, &info_ptr, NULL );
+        fclose( fp );
+        return false;
+    }
+
+    png_init_io( png_ptr, fp );
+    png_read_info( png_ptr, info_ptr );
+    png_set_expand( png_ptr );
+    // Grey with alpha, also from a tRNS chunk, has no format of its own.
+    png_byte color_type = png_get_color_type( png_ptr, info_ptr );
+    if( color_type == PNG_COLOR_TYPE_GRAY_ALPHA ||
+        (color_type == PNG_COLOR_TYPE_GRAY && png_get_valid( png_ptr, info_ptr, PNG_INFO_tRNS )) )
+    {
+        png_set_gray_to_rgb( png_ptr );
+    }
+    png_read_update_info( png_ptr, info_ptr );
+
+    bool ok = true;
+    PixelFormat format;
+    if( !pixelFormatFromPNG( format,
+                             png_get_color_type( png_ptr, info_ptr ),
+                             png_get_bit_depth( png_ptr, info_ptr ) ) )
+    {
+        std::cerr << "Unsupported PNG colour type or bit depth.\n";
+        ok = false;
+    }
+    else {
+        // Decode directly into the image, one row pointer per scanline.
+        // 16-bit samples are kept big-endian as libpng delivers them.
+        w = png_get_image_width( png_ptr, info_ptr );
+        h = png_get_image_height( png_ptr, info_ptr );
+        size_t stride = pixelBytes( format )*(size_t)w;
+        image.resize( stride*h );
+        image.setFormat( format );
+        rows.resize( h );
+        for( int j=0; j<h; j++ ) {
+            rows[j] = (png_bytep)image.writable() + stride*j;
+        }
+        png_read_image( png_ptr, rows.data() );
+        png_read_end( png_ptr, NULL );
+    }
+    png_destroy_read_struct( &png_ptr, &info_ptr, NULL );
+    fclose( fp );
+    return ok;
+}
+
+/** Parses the next whitespace separated number of a PPM header, skipping comments. */
+static
+bool
+ppmNumber( int& value, const std::vector<char>& header, size_t& p )
+{
+    for(;;) {
+        while( p < header.size() && isspace( (unsigned char)header[p] ) ) {
+            p++;
+        }
+        if( p < header.size() && header[p] == '#' ) {
+            while( p < header.size() && header[p] != '\n' ) {
+                p++;
+            }
+            continue;
+        }
+        break;
+    }
+    if( p >= header.size() || !isdigit( (unsigned char)header[p] ) ) {
+        return false;
+    }
+    value = 0;
+    while( p < header.size() && isdigit( (unsigned char)header[p] ) ) {
+        value = 10*value + (header[p++] - '0');
+        if( value > (1<<30) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Finds size, format and pixel offset of a binary PPM (P6) or PGM (P5)
+ * from the start of the file.
+ */
+static
+bool
+parsePPMHeader( int& w, int& h, PixelFormat& format, size_t& offset, const std::string& path, const std::vector<char>& header )
+{
+    size_t p = 2;
+    int maxval = 0;
+    if( !ppmNumber( w, header, p ) || !ppmNumber( h, header, p ) || !ppmNumber( maxval, header, p ) ||
+        p >= header.size() || !isspace( (unsigned char)header[p] ) )
+    {
+        std::cerr << "Malformed PPM header in '" << path << "'.\n";
+        return false;
+    }
+    bool gray = header[1] == '5';
+    if( maxval == 255 ) {
+        format = gray ? PIXEL_GRAY8 : PIXEL_RGB8;
+    }
+    else if( maxval == 65535 ) {
+        format = gray ? PIXEL_GRAY16 : PIXEL_RGB16;
+    }
+    else {
+        std::cerr << "PPM '" << path << "' is not 8 or 16 bits per channel.\n";
+        return false;
+    }
+    // Exactly one whitespace character separates header and pixels.
+    offset = p + 1;
+    return true;
+}
+
+static
+bool
+loadPPM( ImageBuffer& image, int& w, int& h, const std::string& path, const std::vector<char>& header )
+{
+    size_t offset;
+    PixelFormat format;
+    if( !parsePPMHeader( w, h, format, offset, path, header ) ||
+        !image.map( path, offset, pixelBytes( format )*(size_t)w*h ) )
+    {
+        return false;
+    }
+    image.setFormat( format );
+    return true;
+}
+
+/** Loads a greyscale PFM ("Pf") as PIXEL_DEPTH32F. Rows stay in file
+ * order, bottom to top. Little-endian files are mapped, big-endian ones
+ * byte swapped into owned storage.
+ */
+static
+bool
+loadPFM( ImageBuffer& image, int& w, int& h, const std::string& path, const std::vector<char>& header )
+{
+    size_t p = 2;
+    if( !ppmNumber( w, header, p ) || !ppmNumber( h, header, p ) ) {
+        std::cerr << "Malformed PFM header in '" << path << "'.\n";
+        return false;
+    }
+    while( p < header.size() && isspace( (unsigned char)header[p] ) ) {
+        p++;
+    }
+    std::string token;
+    while( p < header.size() && !isspace( (unsigned char)header[p] ) ) {
+        token.push_back( header[p++] );
+    }
+    char* end;
+    double scale = strtod( token.c_str(), &end );
+    if( token.empty() || *end != '\0' || scale == 0.0 || p >= header.size() ) {
+        std::cerr << "Malformed PFM scale in '" << path << "'.\n";
+        return false;
+    }
+    const size_t offset = p + 1;
+    const size_t size = 4*(size_t)w*h;
+    if( scale < 0.0 ) {
+        if( !image.map( path, offset, size ) ) {
+            return false;
+        }
+    }
+    else {
+        ImageBuffer mapped;
+        if( !mapped.map( path, offset, size ) ) {
+            return false;
+        }
+        image.resize( size );
+        char* d = image.writable();
+        for( size_t i=0; i<size; i+=4 ) {
+            d[i+0] = mapped[i+3];
+            d[i+1] = mapped[i+2];
+            d[i+2] = mapped[i+1];
+            d[i+3] = mapped[i+0];
+        }
+    }
+    image.setFormat( PIXEL_DEPTH32F );
+    return true;
+}
+
+static
+bool
+isPFM( const std::vector<char>& header )
+{
+    return header.size() >= 2 && header[0] == 'P' && header[1] == 'f';
+}
+
+static
+bool
+isPPM( const std::vector<char>& header )
+{
+    return header.size() >= 2 && header[0] == 'P' && (header[1] == '5' || header[1] == '6');
+}
+
+/** Reads the first bytes of a file for format detection. */
+static
+bool
+readHeader( std::vector<char>& header, const std::string& path )
+{
+    FILE* fp = fopen( path.c_str(), "rb" );
+    if( fp == NULL ) {
+        std::cerr << "Failed to open '" << path << "'\n";
+        return false;
+    }
+    header.resize( 512 );
+    header.resize( fread( header.data(), 1, header.size(), fp ) );
+    fclose( fp );
+    return true;
+}
+
+bool
+probeRGBFile( int& w,
+              int& h,
+              size_t& offset,
+              const std::string& path,
+              const int raw_w,
+              const int raw_h )
+{
+    std::vector<char> header;
+    if( !readHeader( header, path ) ) {
+        return false;
+    }
+    if( isPPM( header ) ) {
+        PixelFormat format;
+        if( !parsePPMHeader( w, h, format, offset, path, header ) ) {
+            return false;
+        }
+        if( format != PIXEL_RGB8 ) {
+            std::cerr << "'" << path << "' is " << pixelFormatName( format ) << ", rows can only be streamed as rgb8.\n";
+            return false;
+        }
+        return true;
+    }
+    if( header.size() >= 8 && png_sig_cmp( (png_const_bytep)header.data(), 0, 8 ) == 0 ) {
+        std::cerr << "'" << path << "' is a PNG, rows can only be streamed from PPM or raw RGB.\n";
+        return false;
+    }
+    if( raw_w > 0 && raw_h > 0 ) {
+        w = raw_w;
+        h = raw_h;
+        offset = 0;
+        return true;
+    }
+    std::cerr << "'" << path << "' is not PPM, use --raw=WxH for raw RGB.\n";
+    return false;
+}
+
+bool
+loadImageFile( ImageBuffer& image,
+               int& w,
+               int& h,
+               const std::string& path,
+               const int raw_w,
+               const int raw_h,
+               const bool verbose )
+{
+    TimeStamp start;
+
+    std::vector<char> header;
+    if( !readHeader( header, path ) ) {
+        return false;
+    }
+
+    bool ok;
+    const char* format;
+    if( header.size() >= 8 && png_sig_cmp( (png_const_bytep)header.data(), 0, 8 ) == 0 ) {
+        format = "PNG";
+        ok = loadPNG( image, w, h, path );
+    }
+    else if( isPPM( header ) ) {
+        format = "PPM";
+        ok = loadPPM( image, w, h, path, header );
+    }
+    else if( isPFM( header ) ) {
+        format = "PFM";
+        ok = loadPFM( image, w, h, path, header );
+    }
+    else if( raw_w > 0 && raw_h > 0 ) {
+        format = "raw";
+        w = raw_w;
+        h = raw_h;
+        ok = image.map( path, 0, 3*(size_t)w*h );
+    }
+    else {
+        std::cerr << "'" << path << "' is neither PNG, PPM nor PFM, use --raw=WxH for raw RGB.\n";
+        return false;
+    }
+    if( !ok ) {
+        return false;
+    }
+
+    TimeStamp stop;
+    if( !verbose ) {
+        return true;
+    }
+    std::cerr << "Read [" << w << 'x' << h << "] " << pixelFormatName( image.format() )
+              << " pixels (" << image.size() << " bytes) from "
+              << format << (image.mapped() ? " (mapped)" : "") << ", "
+              << TimeStamp::delta( start, stop ) << "\n";
+    return true;
+}
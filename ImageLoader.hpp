@@ -0,0 +1,35 @@
+#pragma once
+#include <string>
+#include "ImageBuffer.hpp"
+
+/** Loads an image, detecting the file format from the file contents.
+ *
+ * Binary PPM (P6) and PGM (P5) files of 8 or 16 bits are memory-mapped and
+ * used in place. PNG files are decoded by libpng straight into one
+ * contiguous buffer, keeping grey, RGB or RGBA and the bit depth, with
+ * palettes and low bit depths expanded to 8 bits. Greyscale PFM files are
+ * loaded as 32-bit float depth buffers. Anything else is taken as
+ * raw, tightly packed 8-bit RGB of raw_w x raw_h pixels and mapped as well;
+ * raw_w and raw_h must then be positive. The pixel format is set on image. Errors are always reported,
+ * a summary of the loaded image only if verbose.
+ */
+bool
+loadImageFile( ImageBuffer& image,
+               int& w,
+               int& h,
+               const std::string& path,
+               const int raw_w,
+               const int raw_h,
+               const bool verbose = true );
+
+/** Finds size and pixel data offset of an 8-bit PPM (P6) or raw RGB file
+ * without reading the pixels, for readers that stream rows from the file.
+ * PNG files and other pixel formats are rejected.
+ */
+bool
+probeRGBFile( int& w,
+              int& h,
+              size_t& offset,
+              const std::string& path,
+              const int raw_w,
+              const int raw_h );
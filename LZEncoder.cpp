@@ -1,4 +1,5 @@
 #include <vector>
+#include <algorithm>
 #include <xmmintrin.h>
 #include <emmintrin.h>
 #include <smmintrin.h>
@@ -6,14 +7,11 @@
 #include "LZEncoder.hpp"
 
 
-static
 int
 lengthOfMatch( const unsigned char* a,
                const unsigned char* b,
                const int N )
 {
-
-#if 1
     for(int i=0; i<N; i+=16 ) {
         __m128i _a = _mm_lddqu_si128( (__m128i const*)(a+i) );
         __m128i _b = _mm_lddqu_si128( (__m128i const*)(b+i) );
@@ -23,69 +21,348 @@ lengthOfMatch( const unsigned char* a,
             return std::min( N, l );
         }
     }
-#else
+    return N;
+}
+
+int
+lengthOfMatchScalar( const unsigned char* a,
+                     const unsigned char* b,
+                     const int N )
+{
     for( int i=0; i<N; i++ ) {
         if( *a++ != *b++ ) {
             return i;
         }
     }
-#endif
     return N;
 }
 
 
+namespace {
+
+const int window_mask = 0x7fff;
+const int hash_bits = 15;
+const int max_match = 258;
+
+// Three byte matches further away than this cost more than three literals.
+const int too_far = 4096;
+
+// Positions per shortest path search of the optimal parse.
+const int optimal_chunk = 1<<15;
+
+// Levels 1 and 2 do not hash the positions inside longer matches, which
+// makes them fast on repetitive content but misses later matches there.
+//                                                              chain  good  lazy  nice insert
+const LZParams lz_levels[ LZ_MAX_LEVEL ] = { { LZ_PARSE_GREEDY,      4,   16,    0,   64,   16 },
+                                             { LZ_PARSE_GREEDY,      8,   16,    0,  128,   32 },
+                                             { LZ_PARSE_GREEDY,      8,  258,    0,  258,  258 },
+                                             { LZ_PARSE_LAZY,       16,   32,   64,  258,  258 },
+                                             { LZ_PARSE_LAZY,       32,   32,   64,  258,  258 },
+                                             { LZ_PARSE_LAZY,       64,   32,  128,  258,  258 },
+                                             { LZ_PARSE_LAZY,      128,   64,  258,  258,  258 },
+                                             { LZ_PARSE_LAZY,      512,  128,  258,  258,  258 },
+                                             { LZ_PARSE_OPTIMAL,   128,  258,    0,  128,  258 } };
+
+inline
 unsigned int
-encodeLZ( unsigned int* code_stream,
-          unsigned char* data,
-          unsigned int N )
+hashPrefix( const unsigned char* p )
+{
+    unsigned int v = (p[0]<<16u) | (p[1]<<8u) | p[2];
+    return (v*0x9e3779b1u) >> (32-hash_bits);
+}
+
+/** Hash chains over the 3-byte prefixes of data.
+ *
+ * Chains link every inserted position to the previous one with the same
+ * hash. Entries of m_prev are only followed while within the window, so
+ * they never need clearing.
+ */
+class MatchFinder
 {
-    int head[256];
-    for(int i=0; i<256; i++) {
-        head[i] = -0xfffff;
+public:
+    explicit
+    MatchFinder( const unsigned char* data )
+        : m_data( data )
+    {
+        for( int i=0; i<(1<<hash_bits); i++ ) {
+            m_head[i] = -0xfffff;
+        }
     }
-    
-    int next[0x10000];
-//    for(int i=0; i<0x10000; i++) {
-//        next[i] = -0xfffff;
-//    }
-    
-
-    //std::vector<int> head(256, -0xfffff);
-    //std::vector<int> next( 0x10000, -0xfffff );
-    
-    unsigned int* p = code_stream;
-    int i=0;
-    while( i < N ) {
-        unsigned int h = (13*(13*data[i] + data[i+1])+data[i+2])&0xffu;
-        int j = head[h];
-        next[ i & 0x7fff ] = j;
-        head[h] = i;
-        int b_l = 0;
-        int b_j = 0;
-        for( int k=0; k<10 && (i-j <= 0x7fff); k++ ) {
-            int l = lengthOfMatch( data + j,
-                                   data + i,
-                                   std::min( std::min( 258, (int)N-i), i-j ) );
-
-            if( l > b_l ) {
-                b_l = l;
-                b_j = j;
-                if( b_l == 258 ) {
-                    break;// we can't get a longer match.
+
+    void
+    insert( int i )
+    {
+        unsigned int h = hashPrefix( m_data + i );
+        m_prev[ i & window_mask ] = m_head[h];
+        m_head[h] = i;
+    }
+
+    /** Longest match at the inserted position i of more than best bytes and
+     * at most limit, returns its length, or best if there is none.
+     */
+    int
+    longest( int& distance, int i, int limit, int best, int chain, const LZParams& params ) const
+    {
+        int j = m_prev[ i & window_mask ];
+        while( chain-- > 0 && i-j <= window_mask && best < limit ) {
+            // A longer match must agree at the byte past the current best.
+            if( m_data[j+best] == m_data[i+best] ) {
+                int l = lengthOfMatch( m_data + j, m_data + i, limit );
+                if( l > best ) {
+                    best = l;
+                    distance = i - j;
+                    if( l >= params.m_nice_length ) {
+                        break;
+                    }
+                    if( l >= params.m_good_length ) {
+                        chain >>= 2;
+                    }
                 }
             }
-            j = next[ j & 0x7fff ];
+            j = m_prev[ j & window_mask ];
+        }
+        return best;
+    }
+
+    /** Nearest distance of a match of every length from 3 to the longest
+     * one at the inserted position i, which is returned.
+     */
+    int
+    all( unsigned short* distances, int i, int limit, int chain, int nice ) const
+    {
+        int best = 2;
+        int j = m_prev[ i & window_mask ];
+        while( chain-- > 0 && i-j <= window_mask && best < limit ) {
+            if( m_data[j+best] == m_data[i+best] ) {
+                int l = lengthOfMatch( m_data + j, m_data + i, limit );
+                for( int k=best+1; k<=l; k++ ) {
+                    distances[k] = i - j;
+                }
+                best = std::max( best, l );
+                if( best >= nice ) {
+                    break;
+                }
+            }
+            j = m_prev[ j & window_mask ];
+        }
+        return best;
+    }
+
+protected:
+    const unsigned char*    m_data;
+    int                     m_head[ 1<<hash_bits ];
+    int                     m_prev[ window_mask+1 ];
+};
+
+inline
+unsigned int
+literalCode( unsigned char c )
+{
+    return 0x80000000u | c;
+}
+
+inline
+unsigned int
+matchCode( int length, int distance )
+{
+    return ((unsigned int)length << 16u) | distance;
+}
+
+unsigned int*
+parseGreedy( unsigned int* p, MatchFinder& finder, const unsigned char* data, int i, int end, const LZParams& params )
+{
+    while( i < end ) {
+        finder.insert( i );
+        int b_d = 0;
+        int b_l = finder.longest( b_d, i, std::min( max_match, end-i ), 0, params.m_max_chain, params );
+        if( b_l == 3 && b_d > too_far ) {
+            b_l = 0;
         }
         if( b_l < 3 ) {
-             // No matches found, emit literal
-            *p++ = 0x80000000u | data[i];
+            *p++ = literalCode( data[i] );
             i++;
         }
         else {
-            // emit length-distance pair
-            *p++ = ((unsigned int)b_l << 16u) | (i - b_j);
+            *p++ = matchCode( b_l, b_d );
+            if( b_l <= params.m_max_insert ) {
+                for( int k=i+1; k<i+b_l; k++ ) {
+                    finder.insert( k );
+                }
+            }
             i = i + b_l;
         }
     }
+    return p;
+}
+
+/** Emits the match found at i-1 only if the one at i is not longer, as zlib
+ * does from level 4 on.
+ */
+unsigned int*
+parseLazy( unsigned int* p, MatchFinder& finder, const unsigned char* data, int i, int end, const LZParams& params )
+{
+    bool pending = false;       // Position i-1 is not emitted yet.
+    int prev_l = 0;
+    int prev_d = 0;
+    while( i < end ) {
+        finder.insert( i );
+        int l = 0;
+        int d = 0;
+        if( prev_l < params.m_max_lazy ) {
+            int chain = prev_l >= params.m_good_length ? params.m_max_chain >> 2 : params.m_max_chain;
+            l = finder.longest( d, i, std::min( max_match, end-i ), std::max( prev_l, 2 ), chain, params );
+            if( l <= std::max( prev_l, 2 ) || (l == 3 && d > too_far) ) {
+                l = 0;
+            }
+        }
+        if( pending && prev_l >= 3 && l == 0 ) {
+            *p++ = matchCode( prev_l, prev_d );
+            for( int k=i+1; k<i-1+prev_l; k++ ) {
+                finder.insert( k );
+            }
+            i = i - 1 + prev_l;
+            pending = false;
+            prev_l = 0;
+        }
+        else {
+            if( pending ) {
+                *p++ = literalCode( data[i-1] );
+            }
+            pending = true;
+            prev_l = l;
+            prev_d = d;
+            i++;
+        }
+    }
+    if( pending ) {
+        *p++ = literalCode( data[end-1] );
+    }
+    return p;
+}
+
+/** Shortest path through the graph of literals and all matches, weighted by
+ * the bits each takes under costs. Matches of nice length or more are taken
+ * as they are found, which keeps long runs cheap to search.
+ */
+unsigned int*
+parseOptimal( unsigned int* p, MatchFinder& finder, const unsigned char* data, int i, int end,
+              const LZParams& params, const HuffmanCosts& costs )
+{
+    std::vector<unsigned int> cost( optimal_chunk+1 );
+    std::vector<unsigned int> step( optimal_chunk+1 );     // length << 16 | distance into the node
+    std::vector<unsigned int> path;
+    unsigned short distances[ max_match+1 ];
+
+    while( i < end ) {
+        const int n = std::min( optimal_chunk, end-i );
+        cost[0] = 0;
+        for( int k=1; k<=n; k++ ) {
+            cost[k] = ~0u;
+        }
+        int stop = n;
+        int long_l = 0;
+        for( int k=0; k<n; k++ ) {
+            const int pos = i + k;
+            finder.insert( pos );
+            const unsigned int c = cost[k];
+            if( c + costs.literal( data[pos] ) < cost[k+1] ) {
+                cost[k+1] = c + costs.literal( data[pos] );
+                step[k+1] = matchCode( 1, 0 );
+            }
+            const int limit = std::min( max_match, n-k );
+            if( limit < 3 ) {
+                continue;
+            }
+            int longest = finder.all( distances, pos, limit, params.m_max_chain, params.m_nice_length );
+            if( longest >= params.m_nice_length ) {
+                stop = k;
+                long_l = longest;
+                break;
+            }
+            unsigned int distance_cost = 0;
+            for( int l=3, last_d=0; l<=longest; l++ ) {
+                if( distances[l] != last_d ) {
+                    last_d = distances[l];
+                    distance_cost = costs.match( 3, last_d ) - costs.m_length[3];
+                }
+                unsigned int c_l = c + costs.m_length[l] + distance_cost;
+                if( c_l < cost[k+l] ) {
+                    cost[k+l] = c_l;
+                    step[k+l] = matchCode( l, last_d );
+                }
+            }
+        }
+
+        path.clear();
+        for( int k=stop; k>0; ) {
+            path.push_back( step[k] );
+            k -= step[k] >> 16u;
+        }
+        for( int k=path.size()-1, pos=i; k>=0; k-- ) {
+            unsigned int l = path[k] >> 16u;
+            *p++ = l == 1 ? literalCode( data[pos] ) : path[k];
+            pos += l;
+        }
+        i += stop;
+        if( long_l > 0 ) {
+            *p++ = matchCode( long_l, distances[long_l] );
+            for( int k=i+1; k<i+long_l; k++ ) {
+                finder.insert( k );
+            }
+            i += long_l;
+        }
+    }
+    return p;
+}
+
+} // of anonymous namespace
+
+const LZParams&
+lzParams( int level )
+{
+    return lz_levels[ std::max( LZ_MIN_LEVEL, std::min( LZ_MAX_LEVEL, level ) ) - 1 ];
+}
+
+unsigned int
+encodeLZ( unsigned int* code_stream,
+          unsigned char* data,
+          unsigned int N,
+          int level,
+          const HuffmanCosts* costs )
+{
+    return encodeLZWindow( code_stream, data, 0, N, level, costs );
+}
+
+unsigned int
+encodeLZWindow( unsigned int* code_stream,
+                unsigned char* data,
+                unsigned int history,
+                unsigned int N,
+                int level,
+                const HuffmanCosts* costs )
+{
+    const LZParams& params = lzParams( level );
+
+    // Positions are relative to the start of the history.
+    data = data - history;
+    const int end = history + N;
+    MatchFinder finder( data );
+    for( int i=(int)history-std::min( history, (unsigned int)window_mask+1 ); i<(int)history; i++ ) {
+        finder.insert( i );
+    }
+
+    unsigned int* p = code_stream;
+    switch( params.m_parse ) {
+    case LZ_PARSE_GREEDY:
+        p = parseGreedy( p, finder, data, history, end, params );
+        break;
+    case LZ_PARSE_LAZY:
+        p = parseLazy( p, finder, data, history, end, params );
+        break;
+    case LZ_PARSE_OPTIMAL:
+        p = parseOptimal( p, finder, data, history, end, params,
+                          costs != NULL ? *costs : fixedHuffmanCosts() );
+        break;
+    }
     return p-code_stream;
-}
\ No newline at end of file
+}
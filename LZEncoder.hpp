@@ -1,6 +1,72 @@
 #pragma once
+#include <cstddef>
+#include "HuffEncode.hpp"
 
+/** Number of equal leading bytes of a and b, at most N. Compares 16 bytes at
+ * a time and may read up to 15 bytes past N.
+ */
+int
+lengthOfMatch( const unsigned char* a,
+               const unsigned char* b,
+               const int N );
+
+int
+lengthOfMatchScalar( const unsigned char* a,
+                     const unsigned char* b,
+                     const int N );
+
+/** How encodeLZ chooses among the matches it finds. */
+enum LZParse
+{
+    LZ_PARSE_GREEDY,        ///< Longest match at every position.
+    LZ_PARSE_LAZY,          ///< Defers a match if the next position has a longer one.
+    LZ_PARSE_OPTIMAL        ///< Cheapest sequence of literals and matches under a Huffman cost model.
+};
+
+/** Match finder settings of one effort level, as in zlib's configuration table. */
+struct LZParams
+{
+    LZParse m_parse;
+    int     m_max_chain;        ///< Hash chain entries probed per position.
+    int     m_good_length;      ///< Probe only a quarter of the chain once a match is this long.
+    int     m_max_lazy;         ///< Lazy parse: do not look for a better match after one this long.
+    int     m_nice_length;      ///< Stop searching once a match is this long.
+    int     m_max_insert;       ///< Positions inside longer matches are not hashed.
+};
+
+const int LZ_MIN_LEVEL = 1;
+const int LZ_MAX_LEVEL = 9;
+const int LZ_DEFAULT_LEVEL = 3;
+
+/** Settings of an effort level, clamped to [LZ_MIN_LEVEL, LZ_MAX_LEVEL].
+ * Levels 1 to 3 parse greedily, 4 to 8 lazily and 9 optimally.
+ */
+const LZParams&
+lzParams( int level );
+
+/** LZ77 parse of data into a code stream of literals (0x80000000 | byte)
+ * and matches (length << 16 | distance) for deflate.
+ *
+ * Match candidates come from hash chains over 3-byte prefixes with a 15-bit
+ * hash and a 32K window. Higher effort levels walk longer chains and parse
+ * more carefully. The optimal parse prices codes with costs, or with the
+ * fixed Huffman codes if costs is NULL. Reads up to 15 bytes past the end
+ * of data. Returns the number of codes.
+ */
 unsigned int
 encodeLZ( unsigned int* code_stream,
           unsigned char* data,
-          unsigned int N );
+          unsigned int N,
+          int level = LZ_DEFAULT_LEVEL,
+          const HuffmanCosts* costs = NULL );
+
+/** Like encodeLZ, but matches may also refer to the history bytes preceding
+ * data, at most 32K of which are useful. Only data itself is encoded.
+ */
+unsigned int
+encodeLZWindow( unsigned int* code_stream,
+                unsigned char* data,
+                unsigned int history,
+                unsigned int N,
+                int level = LZ_DEFAULT_LEVEL,
+                const HuffmanCosts* costs = NULL );
@@ -0,0 +1,185 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <malloc.h>
+#include "MemoryStats.hpp"
+
+// --- malloc interposition ----------------------------------------------------
+
+extern "C" {
+void* __libc_malloc( size_t size );
+void* __libc_calloc( size_t n, size_t size );
+void* __libc_realloc( void* ptr, size_t size );
+void* __libc_memalign( size_t alignment, size_t size );
+void* __libc_valloc( size_t size );
+void* __libc_pvalloc( size_t size );
+void  __libc_free( void* ptr );
+}
+
+static long long    heap_allocated = 0;
+static long long    heap_allocations = 0;
+static long long    heap_live = 0;
+static long long    heap_peak = 0;
+
+static
+void*
+countAllocation( void* ptr )
+{
+    if( ptr != NULL ) {
+        long long size = malloc_usable_size( ptr );
+        __atomic_add_fetch( &heap_allocated, size, __ATOMIC_RELAXED );
+        __atomic_add_fetch( &heap_allocations, 1, __ATOMIC_RELAXED );
+        long long live = __atomic_add_fetch( &heap_live, size, __ATOMIC_RELAXED );
+        long long peak = __atomic_load_n( &heap_peak, __ATOMIC_RELAXED );
+        while( live > peak &&
+               !__atomic_compare_exchange_n( &heap_peak, &peak, live, true,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+        {}
+    }
+    return ptr;
+}
+
+static
+void
+countFree( void* ptr )
+{
+    if( ptr != NULL ) {
+        __atomic_sub_fetch( &heap_live, (long long)malloc_usable_size( ptr ), __ATOMIC_RELAXED );
+    }
+}
+
+extern "C" {
+
+void*
+malloc( size_t size )
+{
+    return countAllocation( __libc_malloc( size ) );
+}
+
+void*
+calloc( size_t n, size_t size )
+{
+    return countAllocation( __libc_calloc( n, size ) );
+}
+
+void*
+realloc( void* ptr, size_t size )
+{
+    // Count the old block as freed only once realloc succeeded.
+    long long old_size = ptr != NULL ? malloc_usable_size( ptr ) : 0;
+    void* p = __libc_realloc( ptr, size );
+    if( p != NULL || size == 0 ) {
+        __atomic_sub_fetch( &heap_live, old_size, __ATOMIC_RELAXED );
+    }
+    return countAllocation( p );
+}
+
+void*
+memalign( size_t alignment, size_t size )
+{
+    return countAllocation( __libc_memalign( alignment, size ) );
+}
+
+void*
+aligned_alloc( size_t alignment, size_t size )
+{
+    return countAllocation( __libc_memalign( alignment, size ) );
+}
+
+int
+posix_memalign( void** ptr, size_t alignment, size_t size )
+{
+    if( alignment < sizeof(void*) || (alignment & (alignment-1)) != 0 ) {
+        return EINVAL;
+    }
+    void* p = countAllocation( __libc_memalign( alignment, size ) );
+    if( p == NULL ) {
+        return ENOMEM;
+    }
+    *ptr = p;
+    return 0;
+}
+
+void*
+valloc( size_t size )
+{
+    return countAllocation( __libc_valloc( size ) );
+}
+
+void*
+pvalloc( size_t size )
+{
+    return countAllocation( __libc_pvalloc( size ) );
+}
+
+void
+free( void* ptr )
+{
+    countFree( ptr );
+    __libc_free( ptr );
+}
+
+} // extern "C"
+
+// --- resident set ------------------------------------------------------------
+
+/** Reads a "Vm...:  N kB" field of /proc/self/status in bytes, -1 on failure. */
+static
+long long
+procStatus( const char* field )
+{
+    FILE* fp = fopen( "/proc/self/status", "r" );
+    if( fp == NULL ) {
+        return -1;
+    }
+    long long value = -1;
+    char line[256];
+    size_t n = strlen( field );
+    while( fgets( line, sizeof(line), fp ) != NULL ) {
+        if( strncmp( line, field, n ) == 0 && line[n] == ':' ) {
+            value = 1024*strtoll( line + n + 1, NULL, 10 );
+            break;
+        }
+    }
+    fclose( fp );
+    return value;
+}
+
+/** Resets VmHWM to the current RSS, returns false if the kernel refuses. */
+static
+bool
+resetPeakRSS()
+{
+    FILE* fp = fopen( "/proc/self/clear_refs", "w" );
+    if( fp == NULL ) {
+        return false;
+    }
+    bool ok = fputs( "5", fp ) >= 0;
+    ok = (fclose( fp ) == 0) && ok;
+    return ok;
+}
+
+MemoryScope::MemoryScope()
+{
+    m_rss_bytes = resetPeakRSS() ? procStatus( "VmRSS" ) : -1;
+    m_live_bytes = __atomic_load_n( &heap_live, __ATOMIC_RELAXED );
+    __atomic_store_n( &heap_peak, m_live_bytes, __ATOMIC_RELAXED );
+    m_allocated_bytes = __atomic_load_n( &heap_allocated, __ATOMIC_RELAXED );
+    m_allocations = __atomic_load_n( &heap_allocations, __ATOMIC_RELAXED );
+}
+
+MemoryUsage
+MemoryScope::usage() const
+{
+    MemoryUsage u;
+    u.m_allocated_bytes = __atomic_load_n( &heap_allocated, __ATOMIC_RELAXED ) - m_allocated_bytes;
+    u.m_allocations = __atomic_load_n( &heap_allocations, __ATOMIC_RELAXED ) - m_allocations;
+    u.m_peak_heap_bytes = __atomic_load_n( &heap_peak, __ATOMIC_RELAXED ) - m_live_bytes;
+    u.m_leaked_bytes = __atomic_load_n( &heap_live, __ATOMIC_RELAXED ) - m_live_bytes;
+    if( m_rss_bytes >= 0 ) {
+        long long hwm = procStatus( "VmHWM" );
+        u.m_peak_rss_bytes = hwm >= 0 ? hwm - m_rss_bytes : -1;
+    }
+    return u;
+}
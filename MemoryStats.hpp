@@ -0,0 +1,44 @@
+#pragma once
+
+/** Heap and resident memory used between construction of a MemoryScope and
+ * a call to its usage() method.
+ */
+struct MemoryUsage
+{
+    MemoryUsage()
+        : m_allocated_bytes( 0 ),
+          m_allocations( 0 ),
+          m_peak_heap_bytes( 0 ),
+          m_leaked_bytes( 0 ),
+          m_peak_rss_bytes( -1 )
+    {}
+
+    long long   m_allocated_bytes;  ///< Sum of all allocation sizes.
+    long long   m_allocations;      ///< Number of malloc, calloc, realloc, ... calls.
+    long long   m_peak_heap_bytes;  ///< Peak of live heap bytes above the start.
+    long long   m_leaked_bytes;     ///< Heap bytes allocated and not freed.
+    long long   m_peak_rss_bytes;   ///< Peak resident set above the start, -1 if unavailable.
+};
+
+/** Measures memory used by the code run during its lifetime.
+ *
+ * Heap numbers come from malloc, free and friends being interposed in this
+ * executable, so they cover C++ new as well as zlib, libpng and libjpeg, on
+ * all threads. Sizes are usable sizes as reported by malloc_usable_size.
+ * The resident peak uses /proc/self/clear_refs to reset the kernel's
+ * high-water mark. Only one scope should be active at a time.
+ */
+class MemoryScope
+{
+public:
+    MemoryScope();
+
+    MemoryUsage
+    usage() const;
+
+protected:
+    long long   m_allocated_bytes;
+    long long   m_allocations;
+    long long   m_live_bytes;
+    long long   m_rss_bytes;        ///< -1 if the high-water mark could not be reset.
+};
@@ -0,0 +1,104 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include "OutputSink.hpp"
+
+OutputSink::OutputSink()
+    : m_bytes( 0 )
+{}
+
+OutputSink::~OutputSink()
+{}
+
+bool
+MemorySink::write( const void* data, size_t size )
+{
+    const unsigned char* p = (const unsigned char*)data;
+    m_data.insert( m_data.end(), p, p + size );
+    m_bytes += size;
+    return true;
+}
+
+void
+MemorySink::reset()
+{
+    m_data.clear();
+    m_bytes = 0;
+}
+
+bool
+GatherSink::write( const void* data, size_t size )
+{
+    if( size == 0 ) {
+        return true;
+    }
+    struct iovec v;
+    v.iov_base = const_cast<void*>( data );
+    v.iov_len = size;
+    m_iovecs.push_back( v );
+    m_bytes += size;
+    return true;
+}
+
+void
+GatherSink::reset()
+{
+    m_iovecs.clear();
+    m_bytes = 0;
+}
+
+FdSink::FdSink( int fd )
+    : m_fd( fd ),
+      m_owns_fd( false )
+{}
+
+FdSink::FdSink( const std::string& path )
+    : m_fd( open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 ) ),
+      m_owns_fd( true )
+{
+    if( m_fd < 0 ) {
+        std::cerr << "Failed to open '" << path << "': " << strerror( errno ) << "\n";
+    }
+}
+
+FdSink::~FdSink()
+{
+    if( m_owns_fd && m_fd >= 0 ) {
+        close( m_fd );
+    }
+}
+
+bool
+FdSink::flush()
+{
+    if( m_fd < 0 ) {
+        return false;
+    }
+    // One writev for everything gathered, continue where a short write stopped.
+    size_t i = 0;
+    while( i < m_iovecs.size() ) {
+        int n = std::min( m_iovecs.size() - i, (size_t)IOV_MAX );
+        ssize_t written = writev( m_fd, &m_iovecs[i], n );
+        if( written < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            std::cerr << "writev failed: " << strerror( errno ) << "\n";
+            return false;
+        }
+        while( i < m_iovecs.size() && (size_t)written >= m_iovecs[i].iov_len ) {
+            written -= m_iovecs[i].iov_len;
+            i++;
+        }
+        if( written > 0 ) {
+            m_iovecs[i].iov_base = (char*)m_iovecs[i].iov_base + written;
+            m_iovecs[i].iov_len -= written;
+        }
+    }
+    m_iovecs.clear();
+    return true;
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+
+/** Destination of encoded bytes.
+ *
+ * Encoders hand over their buffers with write() and finish with flush().
+ * Sinks may keep pointers to the written data instead of copying it, so
+ * buffers must stay alive and unchanged until flush() has returned.
+ */
+class OutputSink
+{
+public:
+    OutputSink();
+
+    virtual
+    ~OutputSink();
+
+    virtual
+    bool
+    write( const void* data, size_t size ) = 0;
+
+    /** Makes all data written so far reach its destination. */
+    virtual
+    bool
+    flush() = 0;
+
+    /** Bytes written since construction or the last reset. */
+    size_t
+    bytes() const { return m_bytes; }
+
+protected:
+    size_t  m_bytes;
+};
+
+/** Copies output into a growing memory buffer that keeps its capacity across reset(). */
+class MemorySink : public OutputSink
+{
+public:
+    bool
+    write( const void* data, size_t size );
+
+    bool
+    flush() { return true; }
+
+    void
+    reset();
+
+    const std::vector<unsigned char>&
+    data() const { return m_data; }
+
+protected:
+    std::vector<unsigned char>  m_data;
+};
+
+/** Collects references to the written buffers without copying. */
+class GatherSink : public OutputSink
+{
+public:
+    bool
+    write( const void* data, size_t size );
+
+    bool
+    flush() { return true; }
+
+    /** Buffers written since the last reset, valid until the writer releases them. */
+    const std::vector<struct iovec>&
+    iovecs() const { return m_iovecs; }
+
+    void
+    reset();
+
+protected:
+    std::vector<struct iovec>   m_iovecs;
+};
+
+/** Sends gathered buffers to a file descriptor, usually with a single writev. */
+class FdSink : public GatherSink
+{
+public:
+    explicit
+    FdSink( int fd );
+
+    /** Writes to a newly created file, closed on destruction. */
+    explicit
+    FdSink( const std::string& path );
+
+    ~FdSink();
+
+    bool
+    ok() const { return m_fd >= 0; }
+
+    bool
+    flush();
+
+protected:
+    int     m_fd;
+    bool    m_owns_fd;
+};
@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include "Pareto.hpp"
+
+namespace {
+
+struct ParetoPoint
+{
+    std::string m_label;
+    bool        m_lossy;
+    double      m_seconds;      ///< Median encode time.
+    double      m_bytes;
+    double      m_input_bytes;
+};
+
+bool
+fasterThan( const ParetoPoint& a, const ParetoPoint& b )
+{
+    return a.m_seconds < b.m_seconds;
+}
+
+/** Encoder name, qualified by thread count when a sweep ran it several times. */
+std::string
+label( const std::vector<BenchmarkResult>& results, const BenchmarkResult& r )
+{
+    for( size_t i=0; i<results.size(); i++ ) {
+        if( results[i].m_encoder == r.m_encoder && results[i].m_threads != r.m_threads ) {
+            std::stringstream s;
+            s << r.m_encoder << '@' << r.m_threads << 't';
+            return s.str();
+        }
+    }
+    return r.m_encoder;
+}
+
+bool
+dominated( const ParetoPoint& p, const std::vector<ParetoPoint>& points )
+{
+    for( size_t i=0; i<points.size(); i++ ) {
+        const ParetoPoint& q = points[i];
+        if( q.m_lossy == p.m_lossy &&
+            q.m_seconds <= p.m_seconds && q.m_bytes <= p.m_bytes &&
+            (q.m_seconds < p.m_seconds || q.m_bytes < p.m_bytes) )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Index of the lossless point with lowest encode plus transfer time, -1 if none. */
+int
+fastestEndToEnd( const std::vector<ParetoPoint>& points, const double bytes_per_second )
+{
+    int best = -1;
+    double best_total = 0.0;
+    for( size_t i=0; i<points.size(); i++ ) {
+        double total = points[i].m_seconds + points[i].m_bytes/bytes_per_second;
+        if( !points[i].m_lossy && (best < 0 || total < best_total) ) {
+            best = i;
+            best_total = total;
+        }
+    }
+    return best;
+}
+
+void
+printTable( std::ostream& out,
+            const std::string& title,
+            std::vector<ParetoPoint> points,
+            const double link_mbits )
+{
+    if( points.empty() ) {
+        return;
+    }
+    std::sort( points.begin(), points.end(), fasterThan );
+    const double link = 1e6*link_mbits/8.0;
+    int best = fastestEndToEnd( points, link );
+
+    size_t width = 8;
+    for( size_t i=0; i<points.size(); i++ ) {
+        width = std::max( width, points[i].m_label.size() + 1 );
+    }
+
+    out << title << " (" << (size_t)points[0].m_input_bytes << " bytes raw, link "
+        << link_mbits << " Mbit/s)\n";
+    out << "    " << std::left << std::setw( width ) << "encoder" << std::right
+        << std::setw( 12 ) << "encode_ms"
+        << std::setw( 12 ) << "bytes"
+        << std::setw( 8 ) << "ratio"
+        << std::setw( 12 ) << "transfer_ms"
+        << std::setw( 12 ) << "total_ms"
+        << "  notes\n";
+    for( size_t i=0; i<points.size(); i++ ) {
+        const ParetoPoint& p = points[i];
+        double transfer = p.m_bytes/link;
+        std::string notes;
+        if( p.m_lossy ) {
+            notes += " lossy";
+        }
+        if( !dominated( p, points ) ) {
+            notes += " frontier";
+        }
+        if( (int)i == best ) {
+            notes += " fastest-end-to-end";
+        }
+        out << "    " << std::left << std::setw( width ) << p.m_label << std::right
+            << std::fixed << std::setprecision( 3 )
+            << std::setw( 12 ) << 1e3*p.m_seconds
+            << std::setw( 12 ) << (size_t)p.m_bytes
+            << std::setprecision( 2 )
+            << std::setw( 8 ) << (p.m_bytes > 0.0 ? p.m_input_bytes/p.m_bytes : 0.0)
+            << std::setprecision( 3 )
+            << std::setw( 12 ) << 1e3*transfer
+            << std::setw( 12 ) << 1e3*(p.m_seconds + transfer)
+            << " " << notes << "\n";
+        out.unsetf( std::ios::fixed );
+        out << std::setprecision( 6 );
+    }
+
+    // Which lossless encoder wins end-to-end as the link gets faster.
+    out << "    fastest end-to-end by link speed:";
+    for( double mbits=1.0; mbits<=100000.0; mbits*=10.0 ) {
+        int k = fastestEndToEnd( points, 1e6*mbits/8.0 );
+        if( k >= 0 ) {
+            out << "  " << mbits << " Mbit/s: " << points[k].m_label;
+        }
+    }
+    out << "\n\n";
+}
+
+} // of anonymous namespace
+
+void
+printParetoReport( std::ostream& out,
+                   const std::vector<BenchmarkResult>& results,
+                   const double link_mbits )
+{
+    std::vector<std::string> images;
+    std::vector<std::string> labels;
+    for( size_t i=0; i<results.size(); i++ ) {
+        if( std::find( images.begin(), images.end(), results[i].m_image ) == images.end() ) {
+            images.push_back( results[i].m_image );
+        }
+        std::string l = label( results, results[i] );
+        if( std::find( labels.begin(), labels.end(), l ) == labels.end() ) {
+            labels.push_back( l );
+        }
+    }
+
+    std::vector<ParetoPoint> corpus( labels.size() );
+    std::vector<int> corpus_images( labels.size(), 0 );
+    for( size_t l=0; l<labels.size(); l++ ) {
+        corpus[l].m_label = labels[l];
+        corpus[l].m_lossy = false;
+        corpus[l].m_seconds = 0.0;
+        corpus[l].m_bytes = 0.0;
+        corpus[l].m_input_bytes = 0.0;
+    }
+
+    for( size_t m=0; m<images.size(); m++ ) {
+        std::vector<ParetoPoint> points;
+        for( size_t i=0; i<results.size(); i++ ) {
+            const BenchmarkResult& r = results[i];
+            if( r.m_image != images[m] ) {
+                continue;
+            }
+            ParetoPoint p;
+            p.m_label = label( results, r );
+            p.m_lossy = r.m_lossy;
+            p.m_seconds = r.m_median;
+            p.m_bytes = r.m_output_bytes;
+            p.m_input_bytes = r.m_input_bytes;
+            points.push_back( p );
+
+            size_t l = std::find( labels.begin(), labels.end(), p.m_label ) - labels.begin();
+            corpus[l].m_lossy = p.m_lossy;
+            corpus[l].m_seconds += p.m_seconds;
+            corpus[l].m_bytes += p.m_bytes;
+            corpus[l].m_input_bytes += p.m_input_bytes;
+            corpus_images[l]++;
+        }
+        printTable( out, "Pareto report for " + images[m], points, link_mbits );
+    }
+
+    if( images.size() > 1 ) {
+        // Only encoders that saw every image are comparable on corpus totals.
+        std::vector<ParetoPoint> points;
+        for( size_t l=0; l<labels.size(); l++ ) {
+            if( corpus_images[l] == (int)images.size() ) {
+                points.push_back( corpus[l] );
+            }
+        }
+        std::stringstream title;
+        title << "Pareto report for corpus of " << images.size() << " images";
+        printTable( out, title.str(), points, link_mbits );
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <ostream>
+#include <vector>
+#include "Benchmark.hpp"
+
+/** Prints size-versus-time trade-offs of the benchmarked encoders.
+ *
+ * For every image, and for the corpus as a whole (sums over the images that
+ * all encoders ran on), lists median encode time, compressed size and the
+ * time to push the result over a link of link_mbits Mbit/s. Encoders on the
+ * time/size Pareto frontier are marked, as is the one with the lowest
+ * encode-plus-transfer latency. A sweep over link bandwidths shows which
+ * encoder wins end-to-end at each speed. Lossy encoders are listed but kept
+ * out of the frontier of lossless ones.
+ */
+void
+printParetoReport( std::ostream& out,
+                   const std::vector<BenchmarkResult>& results,
+                   const double link_mbits );
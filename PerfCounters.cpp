@@ -0,0 +1,145 @@
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "PerfCounters.hpp"
+
+static bool             perf_enabled = false;
+static __thread bool    perf_opened = false;
+static __thread int     perf_fds[ PERF_EVENT_COUNT ];
+
+static StageProfile*    current_profile = NULL;
+
+const char*
+perfEventName( PerfEvent event )
+{
+    switch( event ) {
+    case PERF_CYCLES:           return "cycles";
+    case PERF_INSTRUCTIONS:     return "instructions";
+    case PERF_BRANCH_MISSES:    return "branch_misses";
+    case PERF_L1D_MISSES:       return "l1d_misses";
+    case PERF_LLC_MISSES:       return "llc_misses";
+    default:                    return "unknown";
+    }
+}
+
+static
+int
+openCounter( unsigned int type, unsigned long long config )
+{
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof(attr) );
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // pid=0, cpu=-1: calling thread on any cpu.
+    return syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+static
+void
+openCounters()
+{
+    perf_opened = true;
+    perf_fds[ PERF_CYCLES ]         = openCounter( PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES );
+    perf_fds[ PERF_INSTRUCTIONS ]   = openCounter( PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS );
+    perf_fds[ PERF_BRANCH_MISSES ]  = openCounter( PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES );
+    perf_fds[ PERF_L1D_MISSES ]     = openCounter( PERF_TYPE_HW_CACHE,
+                                                   PERF_COUNT_HW_CACHE_L1D |
+                                                   (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) );
+    perf_fds[ PERF_LLC_MISSES ]     = openCounter( PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES );
+}
+
+void
+PerfCounters::setEnabled( bool enabled )
+{
+    perf_enabled = enabled;
+}
+
+bool
+PerfCounters::enabled()
+{
+    return perf_enabled;
+}
+
+void
+PerfCounters::read( long long* values )
+{
+    if( perf_enabled && !perf_opened ) {
+        openCounters();
+    }
+    for( int i=0; i<PERF_EVENT_COUNT; i++ ) {
+        values[i] = -1;
+        if( perf_enabled && perf_fds[i] >= 0 ) {
+            long long v;
+            if( ::read( perf_fds[i], &v, sizeof(v) ) == sizeof(v) ) {
+                values[i] = v;
+            }
+        }
+    }
+}
+
+StageProfile::StageProfile()
+{
+    pthread_mutex_init( &m_mutex, NULL );
+}
+
+StageProfile::~StageProfile()
+{
+    pthread_mutex_destroy( &m_mutex );
+}
+
+StageProfile*
+StageProfile::current()
+{
+    return current_profile;
+}
+
+void
+StageProfile::setCurrent( StageProfile* profile )
+{
+    current_profile = profile;
+}
+
+void
+StageProfile::add( const StageSample& sample )
+{
+    pthread_mutex_lock( &m_mutex );
+    m_samples.push_back( sample );
+    pthread_mutex_unlock( &m_mutex );
+}
+
+StageCounters::StageCounters( const char* name )
+    : m_name( name ),
+      m_trace( "stage", name )
+{
+    PerfCounters::read( m_start_counters );
+    m_start = TimeStamp();
+}
+
+StageCounters::~StageCounters()
+{
+    TimeStamp stop;
+    StageProfile* profile = StageProfile::current();
+    if( profile == NULL ) {
+        return;
+    }
+
+    StageSample sample;
+    PerfCounters::read( sample.m_counters );
+    sample.m_name = m_name;
+    sample.m_seconds = TimeStamp::delta( m_start, stop );
+    for( int i=0; i<PERF_EVENT_COUNT; i++ ) {
+        if( sample.m_counters[i] < 0 || m_start_counters[i] < 0 ) {
+            sample.m_counters[i] = -1;
+        }
+        else {
+            sample.m_counters[i] -= m_start_counters[i];
+        }
+    }
+    profile->add( sample );
+}
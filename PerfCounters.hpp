@@ -0,0 +1,97 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "timer.hpp"
+#include "Trace.hpp"
+
+enum PerfEvent
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_EVENT_COUNT
+};
+
+const char*
+perfEventName( PerfEvent event );
+
+/** Per-thread hardware counters read through perf_event_open.
+ *
+ * Counters are opened lazily for the calling thread the first time they are
+ * read after being enabled. Events the kernel refuses (no PMU, restrictive
+ * perf_event_paranoid, ...) read as -1, so callers fall back to wall time.
+ */
+class PerfCounters
+{
+public:
+    static
+    void
+    setEnabled( bool enabled );
+
+    static
+    bool
+    enabled();
+
+    /** Reads counters of calling thread, unavailable events are set to -1. */
+    static
+    void
+    read( long long* values );
+};
+
+struct StageSample
+{
+    std::string m_name;
+    double      m_seconds;
+    long long   m_counters[ PERF_EVENT_COUNT ];     ///< -1 if unavailable.
+};
+
+/** Collects stage samples of one encoder run. */
+class StageProfile
+{
+public:
+    StageProfile();
+
+    ~StageProfile();
+
+    /** Profile that StageCounters record into, NULL if none. */
+    static
+    StageProfile*
+    current();
+
+    static
+    void
+    setCurrent( StageProfile* profile );
+
+    void
+    add( const StageSample& sample );
+
+    const std::vector<StageSample>&
+    samples() const { return m_samples; }
+
+protected:
+    pthread_mutex_t             m_mutex;
+    std::vector<StageSample>    m_samples;
+};
+
+/** Scoped wall time and hardware counter measurement of a pipeline stage.
+ *
+ * Counters only cover the thread that creates the object, stages that fan
+ * out to the thread pool report the calling thread's share.
+ */
+class StageCounters
+{
+public:
+    explicit
+    StageCounters( const char* name );
+
+    ~StageCounters();
+
+protected:
+    const char* m_name;
+    TraceScope  m_trace;
+    long long   m_start_counters[ PERF_EVENT_COUNT ];
+    TimeStamp   m_start;
+};
@@ -0,0 +1,78 @@
+#include "PixelFormat.hpp"
+
+const char*
+pixelFormatName( PixelFormat format )
+{
+    switch( format ) {
+    case PIXEL_RGB8:     return "rgb8";
+    case PIXEL_RGBA8:    return "rgba8";
+    case PIXEL_GRAY8:    return "gray8";
+    case PIXEL_GRAY16:   return "gray16";
+    case PIXEL_RGB16:    return "rgb16";
+    case PIXEL_RGBA16:   return "rgba16";
+    case PIXEL_DEPTH32F: return "depth32f";
+    default:             return "unknown";
+    }
+}
+
+unsigned int
+pixelBytes( PixelFormat format )
+{
+    return pixelChannels( format )*pixelBitDepth( format )/8;
+}
+
+unsigned int
+pixelChannels( PixelFormat format )
+{
+    switch( format ) {
+    case PIXEL_RGB8:     return 3;
+    case PIXEL_RGBA8:    return 4;
+    case PIXEL_GRAY8:    return 1;
+    case PIXEL_GRAY16:   return 1;
+    case PIXEL_RGB16:    return 3;
+    case PIXEL_RGBA16:   return 4;
+    case PIXEL_DEPTH32F: return 1;
+    default:             return 0;
+    }
+}
+
+unsigned int
+pixelBitDepth( PixelFormat format )
+{
+    switch( format ) {
+    case PIXEL_RGB8:
+    case PIXEL_RGBA8:
+    case PIXEL_GRAY8:    return 8;
+    case PIXEL_GRAY16:
+    case PIXEL_RGB16:
+    case PIXEL_RGBA16:   return 16;
+    case PIXEL_DEPTH32F: return 32;
+    default:             return 0;
+    }
+}
+
+unsigned int
+pngColorType( PixelFormat format )
+{
+    switch( pixelChannels( format ) ) {
+    case 1:              return 0;   // greyscale
+    case 3:              return 2;   // truecolour
+    case 4:              return 6;   // truecolour with alpha
+    default:             return 0;
+    }
+}
+
+bool
+pixelFormatFromPNG( PixelFormat& format, unsigned int color_type, unsigned int bit_depth )
+{
+    for( int f=0; f<PIXEL_FORMAT_COUNT; f++ ) {
+        if( (PIXEL_FORMATS_PNG & pixelFormatBit( (PixelFormat)f )) &&
+            pngColorType( (PixelFormat)f ) == color_type &&
+            pixelBitDepth( (PixelFormat)f ) == bit_depth )
+        {
+            format = (PixelFormat)f;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+/** Layout of the pixels handed to an encoder. Samples of 16-bit formats are
+ * stored big-endian, as in PNG and PPM files.
+ */
+enum PixelFormat
+{
+    PIXEL_RGB8,             ///< Three 8-bit channels, the only format all encoders take.
+    PIXEL_RGBA8,
+    PIXEL_GRAY8,
+    PIXEL_GRAY16,
+    PIXEL_RGB16,
+    PIXEL_RGBA16,
+    PIXEL_DEPTH32F,         ///< One 32-bit float, a depth buffer; not representable as PNG.
+    PIXEL_FORMAT_COUNT
+};
+
+/** Mask of the formats that PNG can store. */
+const unsigned int PIXEL_FORMATS_PNG = (1u<<PIXEL_DEPTH32F)-1u;
+
+/** Bit of format in masks of supported formats. */
+inline
+unsigned int
+pixelFormatBit( PixelFormat format ) { return 1u<<format; }
+
+const char*
+pixelFormatName( PixelFormat format );
+
+/** Bytes per pixel of the given format. */
+unsigned int
+pixelBytes( PixelFormat format );
+
+unsigned int
+pixelChannels( PixelFormat format );
+
+/** Bits per channel. */
+unsigned int
+pixelBitDepth( PixelFormat format );
+
+/** Colour type field of a PNG IHDR chunk. */
+unsigned int
+pngColorType( PixelFormat format );
+
+/** Maps a PNG colour type and bit depth to a format, false if there is none. */
+bool
+pixelFormatFromPNG( PixelFormat& format, unsigned int color_type, unsigned int bit_depth );
+
+/** Compile-time description of a pixel format, for kernels specialised per format. */
+template<unsigned int Channels, unsigned int Depth>
+struct PixelLayout
+{
+    static const unsigned int channels = Channels;
+    static const unsigned int depth = Depth;
+    static const unsigned int bytes = Channels*Depth/8;
+};
+
+/** Calls visitor.template run< PixelLayout<...> >() with the layout of format,
+ * so that a kernel template is instantiated once for every format and picked
+ * at run time. Returns false for an invalid format.
+ */
+template<typename Visitor>
+bool
+visitPixelFormat( PixelFormat format, Visitor& visitor )
+{
+    switch( format ) {
+    case PIXEL_RGB8:    visitor.template run< PixelLayout<3,8> >(); return true;
+    case PIXEL_RGBA8:   visitor.template run< PixelLayout<4,8> >(); return true;
+    case PIXEL_GRAY8:   visitor.template run< PixelLayout<1,8> >(); return true;
+    case PIXEL_GRAY16:  visitor.template run< PixelLayout<1,16> >(); return true;
+    case PIXEL_RGB16:   visitor.template run< PixelLayout<3,16> >(); return true;
+    case PIXEL_RGBA16:  visitor.template run< PixelLayout<4,16> >(); return true;
+    default:            return false;
+    }
+}
@@ -2,20 +2,26 @@
 #include <emmintrin.h>
 #include <smmintrin.h>
 #include <tmmintrin.h>
+#include <cstddef>
 #include "ScanlineFilter.hpp"
 
+namespace {
+
+/** Filter type 2 with the pixel size known at compile time. */
+template<typename Layout>
 void
-filterScanlinesSSE( unsigned char* filtered,
-                    unsigned char* image,
-                    unsigned int WIDTH,
-                    unsigned int HEIGHT )
+filterUpSSE( unsigned char* filtered,
+             const unsigned char* image,
+             unsigned int WIDTH,
+             unsigned int HEIGHT )
 {
-    int blocks = 3*WIDTH/16;
+    const unsigned int stride = Layout::bytes*WIDTH;
+    int blocks = stride/16;
 
     // Create move-mask for last block of each scanline
     __m128i mask = _mm_cmplt_epi8( _mm_set_epi8( 15, 14, 13, 12, 11, 10, 9, 8,
                                                   7,  6,  5,  4,  3,  2, 1, 0 ),
-                                   _mm_set1_epi8( 3*WIDTH-16*blocks ) );
+                                   _mm_set1_epi8( stride-16*blocks ) );
     {
         const unsigned char* in = image;
         unsigned char* out = filtered;
@@ -29,25 +35,63 @@ filterScanlinesSSE( unsigned char* filtered,
     }
 
     for( unsigned int j=1; j<HEIGHT; j++ ) {
-        const unsigned char* in = image + 3*WIDTH*(j-1);
-        unsigned char* out = filtered + (3*WIDTH+1)*j;
+        const unsigned char* in = image + (size_t)stride*(j-1);
+        unsigned char* out = filtered + (size_t)(stride+1)*j;
         *out++ = 2;
         for(int b=0; b<blocks; b++ ) {
             __m128i _t0 = _mm_lddqu_si128( (__m128i const*)in );
-            __m128i _t1 = _mm_lddqu_si128( (__m128i const*)(in + 3*WIDTH ) );
+            __m128i _t1 = _mm_lddqu_si128( (__m128i const*)(in + stride ) );
 
             _mm_storeu_si128( (__m128i*)out,
                               _mm_sub_epi8( _t1, _t0 ) );
             in += 16;
             out += 16;
         }
-        _mm_maskmoveu_si128( _mm_lddqu_si128( (__m128i const*)in ),
+        _mm_maskmoveu_si128( _mm_sub_epi8( _mm_lddqu_si128( (__m128i const*)(in + stride ) ),
+                                           _mm_lddqu_si128( (__m128i const*)in ) ),
                              mask,
                              (char*)out );
 
     }
 }
 
+struct UpFilterVisitor
+{
+    unsigned char*  m_filtered;
+    unsigned char*  m_image;
+    unsigned int    m_width;
+    unsigned int    m_height;
+
+    template<typename Layout>
+    void
+    run()
+    {
+        filterUpSSE<Layout>( m_filtered, m_image, m_width, m_height );
+    }
+};
+
+} // namespace
+
+void
+filterScanlinesSSE( unsigned char* filtered,
+                    unsigned char* image,
+                    unsigned int WIDTH,
+                    unsigned int HEIGHT )
+{
+    filterUpSSE< PixelLayout<3,8> >( filtered, image, WIDTH, HEIGHT );
+}
+
+void
+filterScanlinesSSE( unsigned char* filtered,
+                    unsigned char* image,
+                    unsigned int WIDTH,
+                    unsigned int HEIGHT,
+                    PixelFormat format )
+{
+    UpFilterVisitor visitor = { filtered, image, WIDTH, HEIGHT };
+    visitPixelFormat( format, visitor );
+}
+
 void
 filterScanlines( unsigned char* filtered,
                  unsigned char* image,
@@ -77,4 +121,60 @@ filterScanlines( unsigned char* filtered,
             *out++ = v2;
         }
     }
-}
\ No newline at end of file
+}
+namespace {
+
+/** Filter type 1 with the pixel size known at compile time. */
+template<typename Layout>
+void
+filterSub( unsigned char* filtered,
+           const unsigned char* image,
+           unsigned int WIDTH,
+           unsigned int HEIGHT )
+{
+    const size_t bpp = Layout::bytes;
+    const size_t stride = bpp*WIDTH;
+    for( unsigned int j=0; j<HEIGHT; j++) {
+        const unsigned char* in = image + stride*j;
+        unsigned char* out = filtered + (stride+1)*j;
+        *out++ = 1;
+        for( size_t i=0; i<bpp; i++ ) {
+            out[i] = in[i];
+        }
+        for( size_t i=bpp; i<stride; i++ ) {
+            out[i] = in[i] - in[i-bpp];
+        }
+    }
+}
+
+struct FilterVisitor
+{
+    unsigned char*  m_filtered;
+    unsigned char*  m_image;
+    unsigned int    m_width;
+    unsigned int    m_height;
+
+    template<typename Layout>
+    void
+    run()
+    {
+        filterSub<Layout>( m_filtered, m_image, m_width, m_height );
+    }
+};
+
+} // namespace
+
+void
+filterScanlines( unsigned char* filtered,
+                 unsigned char* image,
+                 unsigned int WIDTH,
+                 unsigned int HEIGHT,
+                 PixelFormat format )
+{
+    if( format == PIXEL_RGB8 ) {
+        filterScanlines( filtered, image, WIDTH, HEIGHT );
+        return;
+    }
+    FilterVisitor visitor = { filtered, image, WIDTH, HEIGHT };
+    visitPixelFormat( format, visitor );
+}
@@ -1,12 +1,39 @@
 #pragma once
+#include "PixelFormat.hpp"
 
+/** Filter type 2 (diff with previous scanline), first scanline unfiltered.
+ * Reads up to 15 bytes past the end of the image.
+ */
 void
 filterScanlinesSSE( unsigned char* filtered,
                     unsigned char* image,
                     unsigned int WIDTH,
                     unsigned int HEIGHT );
+
+/** Filter type 2 of an image in the given format. Rows of filtered are
+ * pixelBytes( format )*WIDTH+1 bytes long.
+ */
+void
+filterScanlinesSSE( unsigned char* filtered,
+                    unsigned char* image,
+                    unsigned int WIDTH,
+                    unsigned int HEIGHT,
+                    PixelFormat format );
+
+/** Filter type 1 (diff with left pixel). */
 void
 filterScanlines( unsigned char* filtered,
                  unsigned char* image,
                  unsigned int WIDTH,
                  unsigned int HEIGHT );
+
+/** Filter type 1 (diff with left pixel) of an image in the given format,
+ * running a kernel specialised for its channel count and bit depth. Rows
+ * of filtered are pixelBytes( format )*WIDTH+1 bytes long.
+ */
+void
+filterScanlines( unsigned char* filtered,
+                 unsigned char* image,
+                 unsigned int WIDTH,
+                 unsigned int HEIGHT,
+                 PixelFormat format );
@@ -0,0 +1,61 @@
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+#include "ScratchArena.hpp"
+
+namespace {
+
+// Smallest size class, avoids a string of tiny reallocations.
+const size_t min_block_bytes = 64*1024;
+
+// Transparent huge page size on x86-64.
+const size_t huge_page_bytes = 2*1024*1024;
+
+} // namespace
+
+ScratchArena::ScratchArena( bool huge_pages )
+    : m_huge_pages( huge_pages ),
+      m_reserved( 0 ),
+      m_grows( 0 )
+{}
+
+ScratchArena::~ScratchArena()
+{
+    for( size_t k=0; k<m_blocks.size(); k++ ) {
+        free( m_blocks[k].m_ptr );
+    }
+}
+
+void*
+ScratchArena::get( unsigned int slot, size_t bytes )
+{
+    if( m_blocks.size() <= slot ) {
+        Block empty = { NULL, 0 };
+        m_blocks.resize( slot+1, empty );
+    }
+    Block& block = m_blocks[slot];
+    if( bytes <= block.m_size ) {
+        return block.m_ptr;
+    }
+
+    size_t size = min_block_bytes;
+    while( size < bytes ) {
+        size *= 2;
+    }
+    bool huge = m_huge_pages && size >= huge_page_bytes;
+    void* ptr = NULL;
+    if( posix_memalign( &ptr, huge ? huge_page_bytes : 64, size ) != 0 ) {
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if( huge ) {
+        madvise( ptr, size, MADV_HUGEPAGE );   // only a hint, ignore failure
+    }
+#endif
+    free( block.m_ptr );
+    m_reserved += size - block.m_size;
+    block.m_ptr = ptr;
+    block.m_size = size;
+    m_grows++;
+    return ptr;
+}
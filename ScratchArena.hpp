@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+/** Numbered scratch buffers that are kept between uses.
+ *
+ * Each buffer grows to the next power of two, and never shrinks, so
+ * encoding frames of the same or smaller size does not touch the heap.
+ * With huge pages enabled, buffers of 2 MB and up are 2 MB aligned and
+ * advised with MADV_HUGEPAGE, which cuts TLB misses when streaming
+ * through large frames.
+ */
+class ScratchArena
+{
+public:
+    explicit
+    ScratchArena( bool huge_pages = false );
+
+    ~ScratchArena();
+
+    /** Returns buffer number slot with room for at least bytes, with undefined contents. */
+    void*
+    get( unsigned int slot, size_t bytes );
+
+    /** Applies to buffers allocated from now on. */
+    void
+    setHugePages( bool huge_pages ) { m_huge_pages = huge_pages; }
+
+    /** Bytes currently held by all buffers. */
+    size_t
+    reserved() const { return m_reserved; }
+
+    /** Number of times a buffer had to be (re)allocated. */
+    unsigned int
+    grows() const { return m_grows; }
+
+protected:
+    struct Block
+    {
+        void*   m_ptr;
+        size_t  m_size;
+    };
+    std::vector<Block>  m_blocks;
+    bool                m_huge_pages;
+    size_t              m_reserved;
+    unsigned int        m_grows;
+
+private:
+    ScratchArena( const ScratchArena& );
+
+    ScratchArena&
+    operator=( const ScratchArena& );
+};
@@ -0,0 +1,489 @@
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "PerfCounters.hpp"
+#include "BitPusher.hpp"
+#include "Adler32.hpp"
+#include "LZEncoder.hpp"
+#include "HuffEncode.hpp"
+#include "ScanlineFilter.hpp"
+#include "ImageLoader.hpp"
+#include "EncoderRegistry.hpp"
+#include "homebrew_png.hpp"
+#include "StreamEncoder.hpp"
+
+RowSource::~RowSource()
+{}
+
+MemoryRowSource::MemoryRowSource( const ImageBuffer& rgb, unsigned int w, unsigned int h )
+    : m_rgb( rgb ),
+      m_width( w ),
+      m_height( h ),
+      m_offset( 0 )
+{}
+
+bool
+MemoryRowSource::read( unsigned char* rgb, unsigned int rows )
+{
+    size_t bytes = pixelBytes( m_rgb.format() )*(size_t)m_width*rows;
+    if( m_offset + bytes > m_rgb.size() ) {
+        return false;
+    }
+    memcpy( rgb, m_rgb.data() + m_offset, bytes );
+    m_offset += bytes;
+    return true;
+}
+
+// Page cache behind the read position is released in steps of this size.
+static const size_t drop_cache_bytes = 8<<20;
+
+FileRowSource::FileRowSource( const std::string& path, int raw_w, int raw_h )
+    : m_fd( -1 ),
+      m_width( 0 ),
+      m_height( 0 ),
+      m_offset( 0 ),
+      m_dropped( 0 )
+{
+    int w, h;
+    if( !probeRGBFile( w, h, m_offset, path, raw_w, raw_h ) ) {
+        return;
+    }
+    int fd = open( path.c_str(), O_RDONLY );
+    struct stat st;
+    if( fd < 0 || fstat( fd, &st ) != 0 ) {
+        std::cerr << "Failed to open '" << path << "': " << strerror( errno ) << "\n";
+        if( fd >= 0 ) {
+            close( fd );
+        }
+        return;
+    }
+    if( (size_t)st.st_size < m_offset + 3*(size_t)w*h ) {
+        std::cerr << "'" << path << "' is too short for " << w << 'x' << h << " RGB pixels.\n";
+        close( fd );
+        return;
+    }
+    posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+    m_fd = fd;
+    m_width = w;
+    m_height = h;
+}
+
+FileRowSource::~FileRowSource()
+{
+    if( m_fd >= 0 ) {
+        close( m_fd );
+    }
+}
+
+bool
+FileRowSource::read( unsigned char* rgb, unsigned int rows )
+{
+    if( m_fd < 0 ) {
+        return false;
+    }
+    size_t left = 3*(size_t)m_width*rows;
+    while( left > 0 ) {
+        ssize_t n = pread( m_fd, rgb, left, m_offset );
+        if( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( n <= 0 ) {
+            std::cerr << "Failed to read rows: " << (n < 0 ? strerror( errno ) : "unexpected end of file") << "\n";
+            return false;
+        }
+        rgb += n;
+        left -= n;
+        m_offset += n;
+    }
+    if( m_offset - m_dropped >= drop_cache_bytes ) {
+        posix_fadvise( m_fd, m_dropped, m_offset - m_dropped, POSIX_FADV_DONTNEED );
+        m_dropped = m_offset;
+    }
+    return true;
+}
+
+namespace {
+
+// Deflate can refer back at most this far.
+const unsigned int window_bytes = 32768;
+
+/** Filters history rows and stripe rows, then LZ matches the stripe. */
+class SessionLZJob : public JobInterface
+{
+public:
+    SessionLZJob()
+        : m_raw( NULL ),
+          m_filtered( NULL ),
+          m_codes( NULL ),
+          m_format( PIXEL_RGB8 ),
+          m_width( 0 ),
+          m_history_rows( 0 ),
+          m_rows( 0 ),
+          m_size( 0 ),
+          m_codes_n( 0 ),
+          m_adler( 1 ),
+          m_stripe( 0 )
+    {}
+
+    void
+    run()
+    {
+        size_t row_size = pixelBytes( m_format )*(size_t)m_width+1;
+        filterScanlines( m_filtered, m_raw, m_width, m_history_rows + m_rows, m_format );
+        unsigned char* data = m_filtered + row_size*m_history_rows;
+        unsigned int history = std::min( (size_t)window_bytes, row_size*m_history_rows );
+        m_size = row_size*m_rows;
+        m_adler = computeAdler32SSE( data, m_size );
+        m_codes_n = encodeLZWindow( m_codes, data, history, m_size );
+    }
+
+    const char*
+    traceName() const { return "SessionLZJob"; }
+
+    long
+    traceArg() const { return m_stripe; }
+
+    unsigned char*  m_raw;          ///< History rows followed by the stripe's rows.
+    unsigned char*  m_filtered;
+    unsigned int*   m_codes;
+    PixelFormat     m_format;
+    unsigned int    m_width;
+    unsigned int    m_history_rows;
+    unsigned int    m_rows;
+    unsigned int    m_size;         ///< Result: filtered bytes of the stripe.
+    unsigned int    m_codes_n;      ///< Result: number of codes.
+    unsigned int    m_adler;        ///< Result: Adler-32 of the filtered stripe.
+    long            m_stripe;
+};
+
+} // namespace
+
+/** Buffers of one stripe in flight. The job is reused, not handed over to the pool. */
+struct SessionSlot
+{
+    SessionSlot()
+        : m_busy( false )
+    {}
+
+    std::vector<unsigned char>  m_raw;
+    std::vector<unsigned char>  m_filtered;
+    std::vector<unsigned int>   m_codes;
+    SessionLZJob                m_job;
+    CompletionToken             m_token;
+    bool                        m_busy;         ///< Dispatched and not yet written.
+};
+
+EncoderSession::EncoderSession( OutputSink& out,
+                                ThreadPool* thread_pool,
+                                const StreamEncoderOptions& options )
+    : m_out( out ),
+      m_thread_pool( thread_pool ),
+      m_options( options ),
+      m_slot_count( 0 ),
+      m_active( false ),
+      m_ok( false ),
+      m_pusher( NULL )
+{}
+
+EncoderSession::~EncoderSession()
+{
+    if( m_active ) {
+        abort();
+    }
+    for( size_t k=0; k<m_slots.size(); k++ ) {
+        delete m_slots[k];
+    }
+}
+
+bool
+EncoderSession::begin( unsigned int w, unsigned int h, PixelFormat format )
+{
+    if( m_active ) {
+        std::cerr << "EncoderSession::begin() called before finishing the previous image.\n";
+        return false;
+    }
+    if( pixelBytes( format ) == 0 ) {
+        std::cerr << "EncoderSession got an invalid pixel format.\n";
+        return false;
+    }
+    if( w == 0 || h == 0 || w > 0x7fffffff || h > 0x7fffffff ) {
+        std::cerr << "Cannot encode a " << w << 'x' << h << " image.\n";
+        return false;
+    }
+    m_format = format;
+    m_width = w;
+    m_height = h;
+    m_row_bytes = pixelBytes( format )*m_width;
+    m_row_size = m_row_bytes+1;
+    m_stripe_rows = std::min( m_height, std::max( (size_t)1, m_options.m_stripe_bytes/m_row_size ) );
+    m_history_rows = std::min( m_height, (window_bytes + m_row_size - 1)/m_row_size );
+    if( (m_history_rows + m_stripe_rows)*m_row_size > 0x7fffffff ) {
+        std::cerr << "Rows of " << w << " pixels are too wide to encode.\n";
+        return false;
+    }
+    m_stripes = (m_height + m_stripe_rows - 1)/m_stripe_rows;
+
+    size_t K = m_options.m_stripes_in_flight > 0 ? m_options.m_stripes_in_flight : m_thread_pool->workers() + 2;
+    m_slot_count = std::max( (size_t)1, std::min( K, m_stripes ) );
+    while( m_slots.size() < m_slot_count ) {
+        m_slots.push_back( new SessionSlot );
+    }
+    m_recent.resize( m_row_bytes*m_history_rows );
+    m_recent_rows = 0;
+    m_rows_pushed = 0;
+    m_fill_rows = 0;
+    m_dispatched = 0;
+    m_emitted = 0;
+
+    m_start_bytes = m_out.bytes();
+    writePNGHeader( m_out, m_IHDR, m_width, m_height, m_format );
+    m_ok = m_out.flush();
+
+    openIDAT( m_IDAT );
+    m_pusher = new BitPusher( m_IDAT );
+    beginFixedHuffman( *m_pusher );
+    m_adler = 1;
+    m_active = true;
+    return m_ok;
+}
+
+bool
+EncoderSession::pushRows( const unsigned char* rows, unsigned int n, long stride )
+{
+    if( !m_active || !m_ok ) {
+        return false;
+    }
+    if( n > m_height - m_rows_pushed ) {
+        std::cerr << "EncoderSession got more rows than the image has.\n";
+        abort();
+        return false;
+    }
+    const size_t row_bytes = m_row_bytes;
+    if( stride == 0 ) {
+        stride = row_bytes;
+    }
+
+    while( n > 0 ) {
+        SessionSlot* slot = m_slots[ m_dispatched % m_slot_count ];
+        if( m_fill_rows == 0 ) {
+            // Starting a stripe: free the slot and put the history rows in front.
+            while( slot->m_busy ) {
+                emit( true );
+            }
+            size_t rows_max = m_history_rows + m_stripe_rows;
+            if( slot->m_raw.size() < row_bytes*rows_max + 16 ) {
+                slot->m_raw.resize( row_bytes*rows_max + 16 );
+            }
+            if( slot->m_filtered.size() < m_row_size*rows_max + 16 ) {
+                slot->m_filtered.resize( m_row_size*rows_max + 16 );
+            }
+            if( slot->m_codes.size() < m_row_size*m_stripe_rows ) {
+                slot->m_codes.resize( m_row_size*m_stripe_rows );
+            }
+            memcpy( slot->m_raw.data(), m_recent.data(), row_bytes*m_recent_rows );
+            slot->m_job.m_history_rows = m_recent_rows;
+        }
+
+        size_t stripe_rows = std::min( m_stripe_rows, m_height - m_dispatched*m_stripe_rows );
+        size_t take = std::min( (size_t)n, stripe_rows - m_fill_rows );
+        unsigned char* dst = slot->m_raw.data() + row_bytes*(slot->m_job.m_history_rows + m_fill_rows);
+        if( stride == (long)row_bytes ) {
+            memcpy( dst, rows, row_bytes*take );
+        }
+        else {
+            for( size_t k=0; k<take; k++ ) {
+                memcpy( dst + row_bytes*k, rows + stride*(long)k, row_bytes );
+            }
+        }
+        rows += stride*(long)take;
+        n -= take;
+        m_fill_rows += take;
+        m_rows_pushed += take;
+        if( m_fill_rows == stripe_rows ) {
+            dispatch();
+        }
+    }
+
+    // Send whatever the pool has finished without waiting for the rest.
+    while( m_ok && m_emitted < m_dispatched && emit( false ) ) {}
+    return m_ok;
+}
+
+void
+EncoderSession::dispatch()
+{
+    SessionSlot* slot = m_slots[ m_dispatched % m_slot_count ];
+    const size_t row_bytes = m_row_bytes;
+    size_t total = slot->m_job.m_history_rows + m_fill_rows;
+
+    // Raw rows are contiguous, so the next history is the tail of this slot.
+    m_recent_rows = std::min( m_history_rows, total );
+    memcpy( m_recent.data(), slot->m_raw.data() + row_bytes*(total - m_recent_rows), row_bytes*m_recent_rows );
+
+    slot->m_job.m_raw = slot->m_raw.data();
+    slot->m_job.m_filtered = slot->m_filtered.data();
+    slot->m_job.m_codes = slot->m_codes.data();
+    slot->m_job.m_format = m_format;
+    slot->m_job.m_width = m_width;
+    slot->m_job.m_rows = m_fill_rows;
+    slot->m_job.m_stripe = m_dispatched;
+    slot->m_busy = true;
+    m_thread_pool->addJob( &slot->m_job, &slot->m_token );
+
+    m_dispatched++;
+    m_fill_rows = 0;
+}
+
+bool
+EncoderSession::emit( bool wait )
+{
+    SessionSlot* slot = m_slots[ m_emitted % m_slot_count ];
+    if( !wait && !m_thread_pool->finished( &slot->m_token ) ) {
+        return false;
+    }
+    {
+        StageCounters stage( "filter+LZenc" );
+        m_thread_pool->wait( &slot->m_token );
+    }
+    {
+        StageCounters stage( "huffenc" );
+        encodeFixedHuffman( *m_pusher, slot->m_job.m_codes, slot->m_job.m_codes_n );
+        m_adler = combineAdler32( m_adler, slot->m_job.m_adler, slot->m_job.m_size );
+        if( m_emitted+1 == m_stripes ) {
+            endFixedHuffman( *m_pusher );
+            m_pusher->flush();
+            m_IDAT.push_back( ((m_adler)>>24)&0xffu ); // Adler32
+            m_IDAT.push_back( ((m_adler)>>16)&0xffu );
+            m_IDAT.push_back( ((m_adler)>> 8)&0xffu );
+            m_IDAT.push_back( ((m_adler)>> 0)&0xffu );
+        }
+    }
+    {
+        StageCounters stage( "crc32" );
+        closeIDAT( m_IDAT );
+    }
+    {
+        StageCounters stage( "io" );
+        m_ok = m_ok && m_out.write( m_IDAT.data(), m_IDAT.size() ) && m_out.flush();
+    }
+    openIDAT( m_IDAT );
+    slot->m_busy = false;
+    m_emitted++;
+    return true;
+}
+
+void
+EncoderSession::abort()
+{
+    // Jobs refer to the slots, let them finish first.
+    for( size_t k=0; k<m_slots.size(); k++ ) {
+        m_thread_pool->wait( &m_slots[k]->m_token );
+        m_slots[k]->m_busy = false;
+    }
+    delete m_pusher;
+    m_pusher = NULL;
+    m_active = false;
+    m_ok = false;
+}
+
+size_t
+EncoderSession::finish()
+{
+    if( !m_active ) {
+        return 0;
+    }
+    if( m_rows_pushed != m_height ) {
+        std::cerr << "EncoderSession finished after " << m_rows_pushed << " of " << m_height << " rows.\n";
+        abort();
+        return 0;
+    }
+    while( m_ok && m_emitted < m_dispatched ) {
+        emit( true );
+    }
+    if( !m_ok ) {
+        abort();
+        return 0;
+    }
+    delete m_pusher;
+    m_pusher = NULL;
+    m_IDAT.clear();
+    writePNGTrailer( m_out );
+    {
+        StageCounters stage( "io" );
+        m_ok = m_out.flush();
+    }
+    m_active = false;
+    return m_ok ? m_out.bytes() - m_start_bytes : 0;
+}
+
+size_t
+encodeStreamingPNG( OutputSink& out,
+                    RowSource& source,
+                    ThreadPool* thread_pool,
+                    const StreamEncoderOptions& options )
+{
+    EncoderSession session( out, thread_pool, options );
+    if( !session.begin( source.width(), source.height(), source.format() ) ) {
+        return 0;
+    }
+    const size_t row_bytes = pixelBytes( source.format() )*(size_t)source.width();
+    const size_t H = source.height();
+    const size_t band = std::min( H, std::max( (size_t)1, options.m_stripe_bytes/(row_bytes+1) ) );
+    std::vector<unsigned char> rgb( row_bytes*band );
+    for( size_t y=0; y<H; y+=band ) {
+        size_t rows = std::min( band, H-y );
+        {
+            StageCounters stage( "read" );
+            if( !source.read( rgb.data(), rows ) ) {
+                return 0;
+            }
+        }
+        if( !session.pushRows( rgb.data(), rows ) ) {
+            return 0;
+        }
+    }
+    return session.finish();
+}
+
+static
+int
+homebrew_stream_encoder( ThreadPool* thread_pool,
+                         const ImageBuffer& rgb,
+                         const int w,
+                         const int h,
+                         OutputSink& out )
+{
+    MemoryRowSource source( rgb, w, h );
+    return encodeStreamingPNG( out, source, thread_pool );
+}
+
+/** Pushes the image in small bands, like a renderer reading back its framebuffer. */
+static
+int
+homebrew_session_encoder( ThreadPool* thread_pool,
+                          const ImageBuffer& rgb,
+                          const int w,
+                          const int h,
+                          OutputSink& out )
+{
+    const int band = 16;
+    EncoderSession session( out, thread_pool );
+    if( !session.begin( w, h, rgb.format() ) ) {
+        return 0;
+    }
+    for( int y=0; y<h; y+=band ) {
+        const unsigned char* rows = (const unsigned char*)rgb.data() + pixelBytes( rgb.format() )*(size_t)w*y;
+        if( !session.pushRows( rows, std::min( band, h-y ) ) ) {
+            return 0;
+        }
+    }
+    return session.finish();
+}
+
+static EncoderRegistrar homebrew_stream_registrar( "homebrew_stream", homebrew_stream_encoder, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar homebrew_session_registrar( "homebrew_session", homebrew_session_encoder, ".png", false, PIXEL_FORMATS_PNG );
@@ -0,0 +1,200 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "ThreadPool.hpp"
+#include "ImageBuffer.hpp"
+#include "OutputSink.hpp"
+#include "PixelFormat.hpp"
+
+/** Supplies the scanlines of an image top to bottom. */
+class RowSource
+{
+public:
+    virtual
+    ~RowSource();
+
+    virtual
+    unsigned int
+    width() const = 0;
+
+    virtual
+    unsigned int
+    height() const = 0;
+
+    virtual
+    PixelFormat
+    format() const = 0;
+
+    /** Fills rgb with the next rows of pixelBytes( format() )*width() bytes each. */
+    virtual
+    bool
+    read( unsigned char* rgb, unsigned int rows ) = 0;
+};
+
+/** Rows of an image already in memory. */
+class MemoryRowSource : public RowSource
+{
+public:
+    MemoryRowSource( const ImageBuffer& rgb, unsigned int w, unsigned int h );
+
+    unsigned int
+    width() const { return m_width; }
+
+    unsigned int
+    height() const { return m_height; }
+
+    PixelFormat
+    format() const { return m_rgb.format(); }
+
+    bool
+    read( unsigned char* rgb, unsigned int rows );
+
+protected:
+    const ImageBuffer&  m_rgb;
+    unsigned int        m_width;
+    unsigned int        m_height;
+    size_t              m_offset;
+};
+
+/** Rows read sequentially from a PPM (P6) or raw RGB file.
+ *
+ * Rows that have been consumed are dropped from the page cache, so files
+ * larger than physical memory can be streamed.
+ */
+class FileRowSource : public RowSource
+{
+public:
+    /** raw_w and raw_h give the size of raw RGB files. */
+    FileRowSource( const std::string& path, int raw_w, int raw_h );
+
+    ~FileRowSource();
+
+    bool
+    ok() const { return m_fd >= 0; }
+
+    unsigned int
+    width() const { return m_width; }
+
+    unsigned int
+    height() const { return m_height; }
+
+    PixelFormat
+    format() const { return PIXEL_RGB8; }
+
+    bool
+    read( unsigned char* rgb, unsigned int rows );
+
+protected:
+    int             m_fd;
+    unsigned int    m_width;
+    unsigned int    m_height;
+    size_t          m_offset;       ///< File position of the next row.
+    size_t          m_dropped;      ///< Page cache released up to here.
+};
+
+struct StreamEncoderOptions
+{
+    StreamEncoderOptions()
+        : m_stripe_bytes( 1<<20 ),
+          m_stripes_in_flight( 0 )
+    {}
+
+    size_t  m_stripe_bytes;         ///< Approximate filtered bytes per stripe, at least one row.
+    int     m_stripes_in_flight;    ///< Stripes buffered at once, 0 for pool threads + 2.
+};
+
+struct SessionSlot;
+class BitPusher;
+
+/** Push-style PNG encoder for images that arrive in bands of rows.
+ *
+ * pushRows() copies rows into stripe buffers. Each full stripe is filtered
+ * and LZ matched as a job on the pool, with the preceding 32 KB of filtered
+ * data as history so stripe boundaries do not restart the deflate window.
+ * Finished stripes are Huffman coded in order on the pushing thread and
+ * flushed to the sink as their own IDAT chunks during later pushRows()
+ * calls, so encoding overlaps with producing the remaining rows. When all
+ * stripe buffers are in use, pushRows() waits for the oldest stripe.
+ *
+ * Working memory is a few stripes regardless of image size, and sizes are
+ * 64-bit throughout. A session may encode several images in sequence,
+ * reusing its buffers.
+ */
+class EncoderSession
+{
+public:
+    EncoderSession( OutputSink& out,
+                    ThreadPool* thread_pool,
+                    const StreamEncoderOptions& options = StreamEncoderOptions() );
+
+    ~EncoderSession();
+
+    /** Writes the PNG header, returns false if the size is unsupported. */
+    bool
+    begin( unsigned int w, unsigned int h, PixelFormat format );
+
+    /** Adds the next n rows, top to bottom. Row k starts at rows + k*stride,
+     * where a stride of 0 means tightly packed rows. A negative stride takes
+     * bottom-up framebuffers with rows pointing at the top row.
+     */
+    bool
+    pushRows( const unsigned char* rows, unsigned int n, long stride = 0 );
+
+    /** Completes the image once all rows are pushed, returns bytes written or 0 on failure. */
+    size_t
+    finish();
+
+protected:
+    OutputSink&                 m_out;
+    ThreadPool*                 m_thread_pool;
+    StreamEncoderOptions        m_options;
+    std::vector<SessionSlot*>   m_slots;            ///< Grows to the largest m_slot_count used.
+    size_t                      m_slot_count;       ///< Slots used by the current image.
+    bool                        m_active;
+    bool                        m_ok;
+    PixelFormat                 m_format;
+    size_t                      m_width;
+    size_t                      m_height;
+    size_t                      m_row_bytes;        ///< Source bytes per row.
+    size_t                      m_row_size;         ///< Filtered bytes per row.
+    size_t                      m_stripe_rows;
+    size_t                      m_stripes;
+    size_t                      m_history_rows;     ///< Rows needed to cover the deflate window.
+    size_t                      m_rows_pushed;
+    size_t                      m_fill_rows;        ///< Rows in the stripe being filled.
+    size_t                      m_dispatched;       ///< Stripes handed to the pool.
+    size_t                      m_emitted;          ///< Stripes written to the sink.
+    size_t                      m_start_bytes;
+    std::vector<unsigned char>  m_recent;           ///< Last m_history_rows raw rows.
+    size_t                      m_recent_rows;
+    unsigned char               m_IHDR[25];
+    std::vector<unsigned char>  m_IDAT;
+    BitPusher*                  m_pusher;
+    unsigned int                m_adler;
+
+    /** Hands the current stripe to the pool once it is full or holds the last row. */
+    void
+    dispatch();
+
+    /** Writes the oldest dispatched stripe, returns false if wait is false and it is not done yet. */
+    bool
+    emit( bool wait );
+
+    void
+    abort();
+
+private:
+    EncoderSession( const EncoderSession& );
+
+    EncoderSession&
+    operator=( const EncoderSession& );
+};
+
+/** Encodes a PNG from rows pulled out of a source through an EncoderSession.
+ * Returns the number of bytes written, 0 on failure.
+ */
+size_t
+encodeStreamingPNG( OutputSink& out,
+                    RowSource& source,
+                    ThreadPool* thread_pool,
+                    const StreamEncoderOptions& options = StreamEncoderOptions() );
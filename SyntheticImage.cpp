@@ -0,0 +1,466 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include "timer.hpp"
+#include "SyntheticImage.hpp"
+
+namespace {
+
+struct SyntheticParams
+{
+    int             m_w;
+    int             m_h;
+    unsigned int    m_seed;
+};
+
+typedef void (*RowFunc)( unsigned char* row, const int y, const SyntheticParams& p );
+
+inline
+unsigned int
+hash3( unsigned int x, unsigned int y, unsigned int z )
+{
+    unsigned int h = x*0x85ebca6bu ^ y*0xc2b2ae35u ^ z*0x9e3779b9u;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+inline
+void
+putPixel( unsigned char* row, const int x, const unsigned int rgb )
+{
+    row[3*x+0] = rgb >> 16;
+    row[3*x+1] = rgb >> 8;
+    row[3*x+2] = rgb;
+}
+
+inline
+unsigned char
+clampByte( int v )
+{
+    return std::min( 255, std::max( 0, v ) );
+}
+
+// --- flat and gradient -------------------------------------------------------
+
+void
+flatRow( unsigned char* row, const int y, const SyntheticParams& p )
+{
+    unsigned int c = hash3( 0, 0, p.m_seed );
+    for( int x=0; x<p.m_w; x++ ) {
+        putPixel( row, x, c );
+    }
+}
+
+void
+gradientRow( unsigned char* row, const int y, const SyntheticParams& p )
+{
+    unsigned int phase = hash3( 1, 0, p.m_seed );
+    unsigned long long dx = std::max( 1, p.m_w - 1 );
+    unsigned long long dy = std::max( 1, p.m_h - 1 );
+    unsigned char g = ((255ull*y)/dy + (phase>>8)) & 0xffu;
+    for( int x=0; x<p.m_w; x++ ) {
+        row[3*x+0] = (255ull*x)/dx + phase;
+        row[3*x+1] = g;
+        row[3*x+2] = (255ull*x*dy + 255ull*y*dx)/(2*dx*dy) + (phase>>16);
+    }
+}
+
+// --- text and UI -------------------------------------------------------------
+
+const int glyph_w = 8;      // Cell size, the glyph itself is 5x9 pixels.
+const int glyph_h = 16;
+const int glyph_count = 96;
+
+/** Whether pixel (gx,gy) of glyph cell is ink. Glyph 0 is a space. */
+inline
+bool
+glyphPixel( const unsigned int glyph, const int gx, const int gy, const unsigned int seed )
+{
+    int bx = gx - 1;
+    int by = gy - 4;
+    if( glyph == 0 || bx < 0 || bx >= 5 || by < 0 || by >= 9 ) {
+        return false;
+    }
+    // Only a fixed alphabet of glyph shapes, as real text repeats letters.
+    unsigned int bits = hash3( glyph, by, seed ^ 0x7e47u );
+    return (bits >> bx) & (bits >> (bx+8)) & 1u;
+}
+
+/** Glyph at column and line of a text block; words separated by spaces, ragged lines. */
+inline
+unsigned int
+glyphAt( const int column, const int line, const unsigned int seed )
+{
+    int line_length = 40 + hash3( line, 0x11u, seed ) % 60;
+    if( column >= line_length ) {
+        return 0;
+    }
+    unsigned int h = hash3( column, line, seed );
+    return (h % 6) == 0 ? 0 : 1 + (h>>8) % (glyph_count-1);
+}
+
+void
+textRow( unsigned char* row, const int y, const SyntheticParams& p )
+{
+    const unsigned int paper = 0xf5f4efu;
+    const unsigned int ink = 0x14161eu;
+    const int margin = 16;
+    int line = (y - margin) / glyph_h;
+    int gy = (y - margin) % glyph_h;
+    for( int x=0; x<p.m_w; x++ ) {
+        bool set = false;
+        if( y >= margin && x >= margin ) {
+            int column = (x - margin) / glyph_w;
+            set = glyphPixel( glyphAt( column, line, p.m_seed ),
+                              (x - margin) % glyph_w, gy, p.m_seed );
+        }
+        putPixel( row, x, set ? ink : paper );
+    }
+}
+
+void
+uiRow( unsigned char* row, const int y, const SyntheticParams& p )
+{
+    const int cell_w = 480;
+    const int cell_h = 320;
+    const int title_h = 22;
+    const unsigned int desktop = 0x3a6ea5u;
+    const unsigned int accents[4] = { 0x1f4e79u, 0x2e7d32u, 0x6a1b9au, 0x37474fu };
+
+    int cy = y / cell_h;
+    for( int x0=0; x0<p.m_w; x0+=cell_w ) {
+        int cx = x0 / cell_w;
+        int x1 = std::min( p.m_w, x0 + cell_w );
+        unsigned int h = hash3( cx, cy, p.m_seed );
+
+        // Window rectangle inside the cell.
+        int left = x0 + 8 + (h & 31);
+        int right = x1 - 8 - ((h>>5) & 31);
+        int top = cy*cell_h + 8 + ((h>>10) & 31);
+        int bottom = (cy+1)*cell_h - 8 - ((h>>15) & 31);
+        unsigned int accent = accents[ (h>>20) & 3 ];
+
+        for( int x=x0; x<x1; x++ ) {
+            unsigned int c = desktop;
+            if( x >= left && x < right && y >= top && y < bottom ) {
+                int wx = x - left;
+                int wy = y - top;
+                if( x == left || x == right-1 || y == top || y == bottom-1 ) {
+                    c = 0x202020u;
+                }
+                else if( wy < title_h ) {
+                    bool set = wx >= 6 && glyphPixel( glyphAt( (wx-6)/glyph_w, -1-cx, h ),
+                                                      (wx-6) % glyph_w, wy + 2, p.m_seed );
+                    c = set ? 0xffffffu : accent;
+                }
+                else if( wy >= title_h + 8 && wy < title_h + 32 && wx >= 8 && ((wx-8) % 88) < 80 ) {
+                    // Row of buttons.
+                    int bx = (wx-8) % 88;
+                    int by = wy - title_h - 8;
+                    c = (bx == 0 || bx == 79 || by == 0 || by == 23) ? 0x8a8a8au : 0xe1e1e1u;
+                }
+                else if( wy >= title_h + 40 && wx >= 8 ) {
+                    int ty = wy - title_h - 40;
+                    bool set = glyphPixel( glyphAt( (wx-8)/glyph_w, ty/glyph_h + 64*cy, h ),
+                                           (wx-8) % glyph_w, ty % glyph_h, p.m_seed );
+                    c = set ? 0x101010u : 0xfafafau;
+                }
+                else {
+                    c = 0xf0f0f0u;
+                }
+            }
+            putPixel( row, x, c );
+        }
+    }
+}
+
+// --- photo-like noise --------------------------------------------------------
+
+/** Adds bilinearly interpolated value noise of the given period and amplitude to acc. */
+void
+addValueNoise( std::vector<int>& acc,
+               const int y,
+               const int period,
+               const int amplitude,
+               const unsigned int seed )
+{
+    int Y = y / period;
+    int fy = ((y % period) << 8) / period;
+    int columns = (int)acc.size() / period + 2;
+
+    // Interpolate the lattice vertically once per row, then horizontally per pixel.
+    std::vector<int> lattice( columns );
+    for( int X=0; X<columns; X++ ) {
+        int a = hash3( X, Y, seed ) & 0xff;
+        int b = hash3( X, Y+1, seed ) & 0xff;
+        lattice[X] = (a << 8) + (b - a)*fy;
+    }
+    for( int x=0; x<(int)acc.size(); x++ ) {
+        int X = x / period;
+        int fx = ((x % period) << 8) / period;
+        int v = (lattice[X] << 8) + (lattice[X+1] - lattice[X])*fx;
+        acc[x] += (((v >> 16) - 128)*amplitude) >> 7;
+    }
+}
+
+void
+photoRow( unsigned char* row, const int y, const SyntheticParams& p )
+{
+    std::vector<int> luma( p.m_w, 128 );
+    addValueNoise( luma, y, 256, 110, p.m_seed );
+    addValueNoise( luma, y, 61, 48, p.m_seed + 1 );
+    addValueNoise( luma, y, 13, 16, p.m_seed + 2 );
+
+    std::vector<int> chroma_r( p.m_w, 0 );
+    std::vector<int> chroma_b( p.m_w, 0 );
+    addValueNoise( chroma_r, y, 197, 40, p.m_seed + 3 );
+    addValueNoise( chroma_b, y, 173, 40, p.m_seed + 4 );
+
+    for( int x=0; x<p.m_w; x++ ) {
+        unsigned int grain = hash3( x, y, p.m_seed + 5 );
+        int l = luma[x] + (int)(grain & 7) - 4;
+        row[3*x+0] = clampByte( l + chroma_r[x] + (int)((grain>>8) & 3) - 2 );
+        row[3*x+1] = clampByte( l - ((chroma_r[x] + chroma_b[x]) >> 1) );
+        row[3*x+2] = clampByte( l + chroma_b[x] + (int)((grain>>16) & 3) - 2 );
+    }
+}
+
+// --- repeated tiles ----------------------------------------------------------
+
+void
+tilesRow( unsigned char* row, const int y, const SyntheticParams& p )
+{
+    // Tile sizes are deliberately not multiples of 16.
+    int tile = 24 + hash3( 2, 0, p.m_seed ) % 41;
+    int ty = y % tile;
+    for( int x=0; x<p.m_w; x++ ) {
+        putPixel( row, x, hash3( x % tile, ty, p.m_seed ) );
+    }
+}
+
+// --- compressible over incompressible ----------------------------------------
+
+void
+mixedRow( unsigned char* row, const int y, const SyntheticParams& p )
+{
+    if( y < p.m_h/4 ) {
+        uiRow( row, y, p );
+        return;
+    }
+    for( int x=0; x<p.m_w; x++ ) {
+        putPixel( row, x, hash3( x, y, p.m_seed + 6 ) );
+    }
+}
+
+// --- depth buffer ------------------------------------------------------------
+
+/** Stores a linear eye distance z as a float in [0,1] the way a perspective
+ * projection with near plane 0.1 and far plane 1000 does.
+ */
+inline
+void
+putDepth( unsigned char* row, const int x, float z )
+{
+    const float n = 0.1f;
+    const float f = 1000.f;
+    float d = (f/(f-n))*(1.f - n/std::min( f, z ));
+    memcpy( row + 4*x, &d, 4 );
+}
+
+void
+depthRow( unsigned char* row, const int y, const SyntheticParams& p )
+{
+    // Camera 2 units above a ground plane, horizon a third down the image.
+    const float focal = 0.8f*p.m_w;
+    const float horizon = p.m_h/3.f;
+    const float cx = 0.5f*p.m_w;
+    float dy = (y + 0.5f - horizon)/focal;
+    for( int x=0; x<p.m_w; x++ ) {
+        putDepth( row, x, dy > 0.f ? 2.f/dy : 1000.f );
+    }
+
+    // Boxes standing on the ground and floating spheres, nearest drawn last.
+    const int objects = 24;
+    for( int i=0; i<objects; i++ ) {
+        unsigned int r = hash3( i, 3, p.m_seed );
+        float z = 200.f - (190.f*i)/objects - (r & 0xff)/64.f;
+        float wx = ((float)((r>>8) & 0xfff)/4096.f - 0.5f)*1.2f*z;
+        float size = 1.f + ((r>>20) & 0xf)/4.f;
+        float left = cx + focal*(wx - size)/z;
+        float right = cx + focal*(wx + size)/z;
+        int x0 = std::max( 0, (int)left );
+        int x1 = std::min( p.m_w, (int)right + 1 );
+        if( r & 0x80000000u ) {
+            // Box from the ground up to height 2*size, front face at distance z.
+            float top = horizon + focal*(2.f - 2.f*size)/z;
+            float bottom = horizon + focal*2.f/z;
+            if( y < top || y >= bottom ) {
+                continue;
+            }
+            for( int x=x0; x<x1; x++ ) {
+                putDepth( row, x, z );
+            }
+        }
+        else {
+            // Sphere of radius size centred 3 units above the ground.
+            float sy = horizon + focal*(2.f - 3.f)/z;
+            float radius = focal*size/z;
+            float ry = (y + 0.5f - sy)/radius;
+            if( ry <= -1.f || ry >= 1.f ) {
+                continue;
+            }
+            for( int x=x0; x<x1; x++ ) {
+                float rx = (x + 0.5f - 0.5f*(left + right))/radius;
+                float q = 1.f - rx*rx - ry*ry;
+                if( q > 0.f ) {
+                    putDepth( row, x, z - size*std::sqrt( q ) );
+                }
+            }
+        }
+    }
+}
+
+RowFunc
+rowFunc( SyntheticKind kind )
+{
+    switch( kind ) {
+    case SYNTHETIC_FLAT:        return flatRow;
+    case SYNTHETIC_GRADIENT:    return gradientRow;
+    case SYNTHETIC_UI:          return uiRow;
+    case SYNTHETIC_TEXT:        return textRow;
+    case SYNTHETIC_PHOTO:       return photoRow;
+    case SYNTHETIC_TILES:       return tilesRow;
+    case SYNTHETIC_MIXED:       return mixedRow;
+    case SYNTHETIC_DEPTH:       return depthRow;
+    default:                    return flatRow;
+    }
+}
+
+class SyntheticJob : public JobInterface
+{
+public:
+    SyntheticJob( unsigned char* rgb,
+                  size_t row_bytes,
+                  RowFunc func,
+                  const SyntheticParams& params,
+                  int begin,
+                  int end )
+        : m_rgb( rgb ),
+          m_row_bytes( row_bytes ),
+          m_func( func ),
+          m_params( params ),
+          m_begin( begin ),
+          m_end( end )
+    {}
+
+    void
+    run()
+    {
+        for( int y=m_begin; y<m_end; y++ ) {
+            m_func( m_rgb + m_row_bytes*y, y, m_params );
+        }
+    }
+
+    const char*
+    traceName() const { return "SyntheticJob"; }
+
+    long
+    traceArg() const { return m_begin; }
+
+protected:
+    unsigned char*  m_rgb;
+    size_t          m_row_bytes;
+    RowFunc         m_func;
+    SyntheticParams m_params;
+    int             m_begin;
+    int             m_end;
+};
+
+} // of anonymous namespace
+
+const char*
+syntheticKindName( SyntheticKind kind )
+{
+    switch( kind ) {
+    case SYNTHETIC_FLAT:        return "flat";
+    case SYNTHETIC_GRADIENT:    return "gradient";
+    case SYNTHETIC_UI:          return "ui";
+    case SYNTHETIC_TEXT:        return "text";
+    case SYNTHETIC_PHOTO:       return "photo";
+    case SYNTHETIC_TILES:       return "tiles";
+    case SYNTHETIC_MIXED:       return "mixed";
+    case SYNTHETIC_DEPTH:       return "depth";
+    default:                    return "unknown";
+    }
+}
+
+bool
+parseSyntheticKind( SyntheticKind& kind, const std::string& name )
+{
+    for( int k=0; k<SYNTHETIC_KIND_COUNT; k++ ) {
+        if( name == syntheticKindName( (SyntheticKind)k ) ) {
+            kind = (SyntheticKind)k;
+            return true;
+        }
+    }
+    return false;
+}
+
+PixelFormat
+syntheticKindFormat( SyntheticKind kind )
+{
+    return kind == SYNTHETIC_DEPTH ? PIXEL_DEPTH32F : PIXEL_RGB8;
+}
+
+void
+generateSynthetic( ImageBuffer& rgb,
+                   SyntheticKind kind,
+                   const int w,
+                   const int h,
+                   const unsigned int seed,
+                   ThreadPool* thread_pool )
+{
+    TimeStamp start;
+
+    SyntheticParams params;
+    params.m_w = w;
+    params.m_h = h;
+    params.m_seed = seed;
+    const PixelFormat format = syntheticKindFormat( kind );
+    const size_t row_bytes = pixelBytes( format )*(size_t)w;
+    rgb.resize( row_bytes*h );
+    rgb.setFormat( format );
+    unsigned char* data = (unsigned char*)rgb.writable();
+
+    int stripes = thread_pool != NULL ? 4*(thread_pool->workers()+1) : 1;
+    stripes = std::max( 1, std::min( stripes, h ) );
+    std::vector<SyntheticJob> jobs;
+    jobs.reserve( stripes );
+    for( int i=0; i<stripes; i++ ) {
+        jobs.push_back( SyntheticJob( data, row_bytes, rowFunc( kind ), params,
+                                      (int)(((long long)h*i)/stripes),
+                                      (int)(((long long)h*(i+1))/stripes) ) );
+    }
+    if( thread_pool != NULL ) {
+        CompletionToken token;
+        for( int i=0; i<stripes; i++ ) {
+            thread_pool->addJob( &jobs[i], &token );
+        }
+        thread_pool->wait( &token );
+    }
+    else {
+        for( int i=0; i<stripes; i++ ) {
+            jobs[i].run();
+        }
+    }
+
+    TimeStamp stop;
+    std::cerr << "Generated [" << w << 'x' << h << "] " << syntheticKindName( kind )
+              << " " << pixelFormatName( format ) << " pixels (" << rgb.size() << " bytes), "
+              << TimeStamp::delta( start, stop ) << "\n";
+}
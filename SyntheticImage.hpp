@@ -0,0 +1,45 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "ThreadPool.hpp"
+#include "ImageBuffer.hpp"
+
+/** Content classes of the built-in benchmark corpus. */
+enum SyntheticKind
+{
+    SYNTHETIC_FLAT,         ///< Single colour.
+    SYNTHETIC_GRADIENT,     ///< Smooth ramps in all three channels.
+    SYNTHETIC_UI,           ///< Screenshot-like windows, title bars, buttons and text.
+    SYNTHETIC_TEXT,         ///< Dark glyphs on a light page.
+    SYNTHETIC_PHOTO,        ///< Multi-octave value noise with sensor-like grain.
+    SYNTHETIC_TILES,        ///< Small noisy tile repeated across the image.
+    SYNTHETIC_MIXED,        ///< UI in the top quarter over incompressible random bytes.
+    SYNTHETIC_DEPTH,        ///< Float depth buffer of a ground plane with boxes and spheres.
+    SYNTHETIC_KIND_COUNT
+};
+
+const char*
+syntheticKindName( SyntheticKind kind );
+
+/** Returns false if name is not one of the syntheticKindName() strings. */
+bool
+parseSyntheticKind( SyntheticKind& kind, const std::string& name );
+
+/** Pixel format generated for kind, PIXEL_DEPTH32F for SYNTHETIC_DEPTH and RGB8 otherwise. */
+PixelFormat
+syntheticKindFormat( SyntheticKind kind );
+
+/** Fills rgb with a w x h image of the given kind.
+ *
+ * Each pixel is a pure function of its coordinates, the image size and the
+ * seed, so the output is identical regardless of thread count. Rows are
+ * generated in stripes on the thread pool if one is given. Sizes are only
+ * limited by memory (3*w*h bytes, 4*w*h for depth).
+ */
+void
+generateSynthetic( ImageBuffer& rgb,
+                   SyntheticKind kind,
+                   const int w,
+                   const int h,
+                   const unsigned int seed,
+                   ThreadPool* thread_pool = NULL );
@@ -1,12 +1,26 @@
 #include <iostream>
 #include <cassert>
 #include <unistd.h>
+#include <sstream>
 #include "ThreadPool.hpp"
+#include "Trace.hpp"
 
 JobInterface:: ~JobInterface()
 {
 }
 
+const char*
+JobInterface::traceName() const
+{
+    return "job";
+}
+
+long
+JobInterface::traceArg() const
+{
+    return -1;
+}
+
 CompletionToken::CompletionToken()
     : m_count( 0 )
 {
@@ -25,7 +39,10 @@ ThreadPool::ThreadPool( int threads )
     : m_done( false )
 {
     int cores = (int)sysconf( _SC_NPROCESSORS_ONLN );
-    threads = std::max( 1, cores-1 );
+    if( threads < 0 ) {
+        // Auto: leave one core for the thread that calls wait().
+        threads = std::max( 1, cores-1 );
+    }
     std::cerr << "Detected " << cores << " cores, creating " << threads << " worker threads.\n";
     
     cpu_set_t* cs = CPU_ALLOC( cores );
@@ -55,7 +72,7 @@ ThreadPool::ThreadPool( int threads )
 
 
     CPU_ZERO_S( cs_size, cs );
-    CPU_SET_S( )
+    CPU_SET_S( 0, cs_size, cs );
     
     
     pthread_getaffinity_np( pthread_self(), cs_size, cs );
@@ -65,6 +82,7 @@ ThreadPool::ThreadPool( int threads )
         std::cerr << i << '=' << CPU_ISSET_S( i, cs_size, cs ) << ' ';
     }
     std::cerr << "\n";
+    CPU_FREE( cs );
     assert( pthread_mutex_unlock( &m_mutex ) == 0 );
 
 }
@@ -94,8 +112,9 @@ ThreadPool::addJob( JobInterface* job, CompletionToken* token )
         assert( pthread_mutex_unlock( &token->m_mutex ) == 0 );
     }
 
+    unsigned long long queued = Trace::enabled() ? Trace::now() : 0;
     assert( pthread_mutex_lock( &m_mutex ) == 0 );
-    m_jobs.emplace_back( job, token );
+    m_jobs.emplace_back( job, token, queued );
     pthread_cond_signal( &m_notify );
     assert( pthread_mutex_unlock( &m_mutex ) == 0 );
 }
@@ -106,15 +125,16 @@ ThreadPool::wait( CompletionToken* token )
     if( token == NULL ) {
         return;
     }
-    
+    TraceScope trace( "pool", "wait" );
+
     assert( pthread_mutex_lock( &token->m_mutex ) == 0 );
     while( token->m_count > 0 ) {
 
         // Not finished, see if there is any work left         
-        Job job( NULL, NULL );
+        Job job( NULL, NULL, 0 );
         assert( pthread_mutex_lock( &m_mutex ) == 0 );
         for( auto it=m_jobs.begin(); it!=m_jobs.end(); ++it ) {
-            if( it->second == token ) {
+            if( it->m_token == token ) {
                 job = *it;
                 m_jobs.erase( it );
                 break;
@@ -122,12 +142,10 @@ ThreadPool::wait( CompletionToken* token )
         }
         assert( pthread_mutex_unlock( &m_mutex ) == 0 );
     
-        if( job.second == token ) {
+        if( job.m_token == token ) {
             // yep work, unlock token and do one work item
             assert( pthread_mutex_unlock( &token->m_mutex ) == 0 );
-            if( job.first ) {
-                job.first->run();
-            }
+            runJob( job );
             
             // re-aquire lock and decrease count
             assert( pthread_mutex_lock( &token->m_mutex ) == 0 );
@@ -144,6 +162,29 @@ ThreadPool::wait( CompletionToken* token )
     assert( pthread_mutex_unlock( &token->m_mutex ) == 0 );
 }
 
+bool
+ThreadPool::finished( CompletionToken* token )
+{
+    if( token == NULL ) {
+        return true;
+    }
+    assert( pthread_mutex_lock( &token->m_mutex ) == 0 );
+    bool done = token->m_count < 1;
+    assert( pthread_mutex_unlock( &token->m_mutex ) == 0 );
+    return done;
+}
+
+void
+ThreadPool::runJob( const Job& job )
+{
+    if( job.m_queued ) {
+        Trace::record( "pool", "queued", job.m_queued, Trace::now() );
+    }
+    if( job.m_job ) {
+        TraceScope trace( "job", job.m_job->traceName(), job.m_job->traceArg() );
+        job.m_job->run();
+    }
+}
 
 void*
 ThreadPool::workerMain( void* arg )
@@ -174,8 +215,12 @@ ThreadPool::workerMain( void* arg )
     }
     std::cerr << "\n";
 
-    
-    
+    if( Trace::enabled() ) {
+        std::stringstream name;
+        name << "worker " << id;
+        Trace::setThreadName( name.str() );
+    }
+
     while( !that->m_done ) {
 
         // Check if there is work for me
@@ -187,18 +232,16 @@ ThreadPool::workerMain( void* arg )
             // do work, unlocking thread pool mutex in the mean time
             assert( pthread_mutex_unlock( &that->m_mutex ) == 0 );
 
-            if( job.first ) {
-                job.first->run();
-            }
-            
+            runJob( job );
+
             // notify
-            if( job.second ) {
-                assert( pthread_mutex_lock( &job.second->m_mutex ) == 0 );
-                job.second->m_count--;
-                if( job.second->m_count < 1 ) {
-                    assert( pthread_cond_broadcast( &job.second->m_complete ) == 0 );
+            if( job.m_token ) {
+                assert( pthread_mutex_lock( &job.m_token->m_mutex ) == 0 );
+                job.m_token->m_count--;
+                if( job.m_token->m_count < 1 ) {
+                    assert( pthread_cond_broadcast( &job.m_token->m_complete ) == 0 );
                 }
-                assert( pthread_mutex_unlock( &job.second->m_mutex ) == 0 );
+                assert( pthread_mutex_unlock( &job.m_token->m_mutex ) == 0 );
             }
 
             // re-aquire lock
@@ -14,6 +14,16 @@ public:
     virtual
     void
     run() = 0;
+
+    /** Name of job in timeline traces. */
+    virtual
+    const char*
+    traceName() const;
+
+    /** Integer shown with the job in timeline traces, -1 for none. */
+    virtual
+    long
+    traceArg() const;
 };
 
 class CompletionToken
@@ -34,7 +44,11 @@ class ThreadPool
 {
 public:
 
-    ThreadPool( int threads = 5 );
+    /** Creates a pool with the given number of worker threads, or one less
+     * than the number of cores if negative. Zero workers is allowed, jobs
+     * are then run by the thread calling wait().
+     */
+    ThreadPool( int threads = -1 );
 
     ~ThreadPool();
 
@@ -44,11 +58,26 @@ public:
     void
     wait( CompletionToken* );
 
+    /** True if all jobs added with the token have completed, never blocks. */
+    bool
+    finished( CompletionToken* token );
+
     int
     workers() const { return m_workers.size(); }
 
 protected:
-    typedef std::pair<JobInterface*, CompletionToken*> Job;
+    struct Job
+    {
+        Job( JobInterface* job, CompletionToken* token, unsigned long long queued )
+            : m_job( job ),
+              m_token( token ),
+              m_queued( queued )
+        {}
+
+        JobInterface*       m_job;
+        CompletionToken*    m_token;
+        unsigned long long  m_queued;   ///< Trace timestamp of addJob, 0 if not tracing.
+    };
 
     bool                    m_done;
     pthread_mutex_t         m_mutex;
@@ -60,5 +89,9 @@ protected:
     void*
     workerMain( void* );
 
+    static
+    void
+    runJob( const Job& job );
+
 
 };
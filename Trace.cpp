@@ -0,0 +1,173 @@
+#include <ctime>
+#include <algorithm>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <pthread.h>
+#include "Trace.hpp"
+
+namespace {
+
+struct TraceEvent
+{
+    const char*         m_category;
+    const char*         m_name;
+    unsigned long long  m_begin;
+    unsigned long long  m_end;
+    long                m_arg;
+};
+
+struct TraceBuffer
+{
+    static const size_t capacity = 1u<<16;
+
+    TraceBuffer( int tid )
+        : m_tid( tid ),
+          m_count( 0 ),
+          m_dropped( 0 ),
+          m_events( capacity )
+    {}
+
+    int                     m_tid;
+    std::string             m_name;
+    size_t                  m_count;    ///< Published with release semantics by owner.
+    size_t                  m_dropped;
+    std::vector<TraceEvent> m_events;
+};
+
+pthread_mutex_t             buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+std::vector<TraceBuffer*>   buffers;
+__thread TraceBuffer*       thread_buffer = NULL;
+
+TraceBuffer*
+threadBuffer()
+{
+    if( thread_buffer == NULL ) {
+        pthread_mutex_lock( &buffers_mutex );
+        thread_buffer = new TraceBuffer( buffers.size() );
+        buffers.push_back( thread_buffer );
+        pthread_mutex_unlock( &buffers_mutex );
+    }
+    return thread_buffer;
+}
+
+std::string
+jsonString( const std::string& s )
+{
+    std::string r( "\"" );
+    for( size_t i=0; i<s.size(); i++ ) {
+        if( s[i] == '"' || s[i] == '\\' ) {
+            r.push_back( '\\' );
+        }
+        r.push_back( s[i] );
+    }
+    r.push_back( '"' );
+    return r;
+}
+
+} // of anonymous namespace
+
+bool Trace::m_enabled = false;
+
+void
+Trace::setEnabled( bool enabled )
+{
+    m_enabled = enabled;
+}
+
+unsigned long long
+Trace::now()
+{
+    timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return 1000000000ull*t.tv_sec + t.tv_nsec;
+}
+
+void
+Trace::setThreadName( const std::string& name )
+{
+    if( m_enabled ) {
+        threadBuffer()->m_name = name;
+    }
+}
+
+void
+Trace::record( const char* category,
+               const char* name,
+               unsigned long long begin,
+               unsigned long long end,
+               long arg )
+{
+    if( !m_enabled ) {
+        return;
+    }
+    TraceBuffer* buffer = threadBuffer();
+    size_t n = buffer->m_count;
+    if( n >= TraceBuffer::capacity ) {
+        buffer->m_dropped++;
+        return;
+    }
+    TraceEvent& e = buffer->m_events[n];
+    e.m_category = category;
+    e.m_name = name;
+    e.m_begin = begin;
+    e.m_end = end;
+    e.m_arg = arg;
+    __atomic_store_n( &buffer->m_count, n+1, __ATOMIC_RELEASE );
+}
+
+bool
+Trace::write( const std::string& path )
+{
+    std::ofstream out( path.c_str() );
+    if( !out ) {
+        std::cerr << "Failed to open trace file '" << path << "'\n";
+        return false;
+    }
+
+    pthread_mutex_lock( &buffers_mutex );
+    unsigned long long t0 = ~0ull;
+    for( size_t b=0; b<buffers.size(); b++ ) {
+        size_t n = __atomic_load_n( &buffers[b]->m_count, __ATOMIC_ACQUIRE );
+        for( size_t i=0; i<n; i++ ) {
+            t0 = std::min( t0, buffers[b]->m_events[i].m_begin );
+        }
+    }
+
+    out.setf( std::ios::fixed );
+    out.precision( 3 );
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    for( size_t b=0; b<buffers.size(); b++ ) {
+        const TraceBuffer* buffer = buffers[b];
+        if( !buffer->m_name.empty() ) {
+            out << (first ? "" : ",\n")
+                << "{\"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->m_tid
+                << ", \"name\": \"thread_name\", \"args\": {\"name\": "
+                << jsonString( buffer->m_name ) << "}}";
+            first = false;
+        }
+        if( buffer->m_dropped ) {
+            std::cerr << "Trace buffer of thread " << buffer->m_tid << " overflowed, "
+                      << buffer->m_dropped << " events dropped.\n";
+        }
+        size_t n = __atomic_load_n( &buffer->m_count, __ATOMIC_ACQUIRE );
+        for( size_t i=0; i<n; i++ ) {
+            const TraceEvent& e = buffer->m_events[i];
+            out << (first ? "" : ",\n")
+                << "{\"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->m_tid
+                << ", \"cat\": " << jsonString( e.m_category )
+                << ", \"name\": " << jsonString( e.m_name )
+                << ", \"ts\": " << ((e.m_begin - t0)/1000.0)
+                << ", \"dur\": " << ((e.m_end - e.m_begin)/1000.0);
+            if( e.m_arg >= 0 ) {
+                out << ", \"args\": {\"arg\": " << e.m_arg << "}";
+            }
+            out << "}";
+            first = false;
+        }
+    }
+    out << "\n]}\n";
+    pthread_mutex_unlock( &buffers_mutex );
+    return true;
+}
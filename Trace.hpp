@@ -0,0 +1,70 @@
+#pragma once
+#include <string>
+
+/** Timeline tracing in the Chrome trace event format (opens in Perfetto).
+ *
+ * Each thread appends complete events to its own fixed-size buffer without
+ * locking; buffers are only read by write() once the traced work is done.
+ * When tracing is disabled, recording is a single branch.
+ */
+class Trace
+{
+public:
+    static
+    void
+    setEnabled( bool enabled );
+
+    static
+    bool
+    enabled() { return m_enabled; }
+
+    /** Monotonic clock in nanoseconds. */
+    static
+    unsigned long long
+    now();
+
+    /** Label the calling thread in the timeline. */
+    static
+    void
+    setThreadName( const std::string& name );
+
+    /** Record a complete event, name and category must outlive the trace. */
+    static
+    void
+    record( const char* category,
+            const char* name,
+            unsigned long long begin,
+            unsigned long long end,
+            long arg = -1 );
+
+    static
+    bool
+    write( const std::string& path );
+
+protected:
+    static bool m_enabled;
+};
+
+class TraceScope
+{
+public:
+    TraceScope( const char* category, const char* name, long arg = -1 )
+        : m_category( category ),
+          m_name( name ),
+          m_arg( arg ),
+          m_begin( Trace::enabled() ? Trace::now() : 0 )
+    {}
+
+    ~TraceScope()
+    {
+        if( m_begin ) {
+            Trace::record( m_category, m_name, m_begin, Trace::now(), m_arg );
+        }
+    }
+
+protected:
+    const char*         m_category;
+    const char*         m_name;
+    long                m_arg;
+    unsigned long long  m_begin;
+};
@@ -0,0 +1,381 @@
+#include <zlib.h>
+#include <png.h>
+#include <cstdio>
+#include <csetjmp>
+#include <cstring>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <jpeglib.h>
+#include "timer.hpp"
+#include "DepthCodec.hpp"
+#include "Verify.hpp"
+
+static
+unsigned int
+readU32( const unsigned char* p )
+{
+    return (p[0]<<24u) | (p[1]<<16u) | (p[2]<<8u) | p[3];
+}
+
+static
+unsigned char
+paeth( int a, int b, int c )
+{
+    int p = a + b - c;
+    int pa = std::abs( p - a );
+    int pb = std::abs( p - b );
+    int pc = std::abs( p - c );
+    if( pa <= pb && pa <= pc ) {
+        return a;
+    }
+    else if( pb <= pc ) {
+        return b;
+    }
+    return c;
+}
+
+/** Undo PNG scanline filters, returns false on unknown filter type. */
+static
+bool
+unfilterScanlines( std::vector<unsigned char>& out,
+                   const unsigned char* filtered,
+                   const size_t bpp,
+                   const size_t stride,
+                   const int h )
+{
+    out.resize( stride*h );
+    for( int j=0; j<h; j++ ) {
+        const unsigned char* in = filtered + (stride+1)*j;
+        unsigned char* cur = out.data() + stride*j;
+        const unsigned char* up = j > 0 ? cur - stride : NULL;
+        unsigned int type = *in++;
+        for( size_t i=0; i<stride; i++ ) {
+            int a = i >= bpp ? cur[i-bpp] : 0;
+            int b = up ? up[i] : 0;
+            int c = (up && i >= bpp) ? up[i-bpp] : 0;
+            switch( type ) {
+            case 0: cur[i] = in[i]; break;
+            case 1: cur[i] = in[i] + a; break;
+            case 2: cur[i] = in[i] + b; break;
+            case 3: cur[i] = in[i] + ((a+b)>>1); break;
+            case 4: cur[i] = in[i] + paeth( a, b, c ); break;
+            default: return false;
+            }
+        }
+    }
+    return true;
+}
+
+static
+bool
+comparePixels( std::string& message,
+               const unsigned char* decoded,
+               const ImageBuffer& rgb,
+               const int w,
+               const int h )
+{
+    const size_t bpp = pixelBytes( rgb.format() );
+    const size_t stride = bpp*w;
+    for( int j=0; j<h; j++ ) {
+        const unsigned char* a = decoded + stride*j;
+        const unsigned char* b = (const unsigned char*)rgb.data() + stride*j;
+        if( memcmp( a, b, stride ) != 0 ) {
+            size_t i = 0;
+            while( a[i] == b[i] ) {
+                i++;
+            }
+            std::stringstream o;
+            o << "pixel mismatch at (" << (i/bpp) << ", " << j << ")";
+            message = o.str();
+            return false;
+        }
+    }
+    return true;
+}
+
+struct MemoryReader
+{
+    const unsigned char*    m_data;
+    size_t                  m_size;
+    size_t                  m_offset;
+};
+
+static
+void
+readFromMemory( png_structp png_ptr, png_bytep data, png_size_t length )
+{
+    MemoryReader* reader = (MemoryReader*)png_get_io_ptr( png_ptr );
+    if( reader->m_offset + length > reader->m_size ) {
+        png_error( png_ptr, "read past end of buffer" );
+    }
+    memcpy( data, reader->m_data + reader->m_offset, length );
+    reader->m_offset += length;
+}
+
+static
+bool
+decodeLibPNG( std::string& message,
+              const std::vector<unsigned char>& encoded,
+              const ImageBuffer& rgb,
+              const int w,
+              const int h )
+{
+    png_structp png_ptr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+    if( png_ptr == NULL ) {
+        message = "png_create_read_struct failed";
+        return false;
+    }
+    png_infop info_ptr = png_create_info_struct( png_ptr );
+    if( info_ptr == NULL ) {
+        png_destroy_read_struct( &png_ptr, NULL, NULL );
+        message = "png_create_info_struct failed";
+        return false;
+    }
+    if( setjmp( png_jmpbuf(png_ptr) ) ) {
+        png_destroy_read_struct( &png_ptr, &info_ptr, NULL );
+        message = "libpng decode failed";
+        return false;
+    }
+
+    MemoryReader reader = { encoded.data(), encoded.size(), 0 };
+    png_set_read_fn( png_ptr, &reader, readFromMemory );
+    png_read_png( png_ptr, info_ptr, PNG_TRANSFORM_EXPAND, NULL );
+
+    bool ok = true;
+    if( (int)png_get_image_width( png_ptr, info_ptr ) != w ||
+        (int)png_get_image_height( png_ptr, info_ptr ) != h ||
+        png_get_color_type( png_ptr, info_ptr ) != pngColorType( rgb.format() ) ||
+        png_get_bit_depth( png_ptr, info_ptr ) != pixelBitDepth( rgb.format() ) )
+    {
+        message = "libpng: unexpected image format";
+        ok = false;
+    }
+    else {
+        // 16-bit samples come out big-endian, as stored in the source.
+        png_bytepp rows = png_get_rows( png_ptr, info_ptr );
+        const size_t stride = pixelBytes( rgb.format() )*(size_t)w;
+        std::vector<unsigned char> decoded( stride*h );
+        for( int j=0; j<h; j++ ) {
+            memcpy( decoded.data() + stride*j, rows[j], stride );
+        }
+        ok = comparePixels( message, decoded.data(), rgb, w, h );
+        if( !ok ) {
+            message = "libpng: " + message;
+        }
+    }
+    png_destroy_read_struct( &png_ptr, &info_ptr, NULL );
+    return ok;
+}
+
+static
+void
+verifyPNG( VerifyResult& result,
+           const std::vector<unsigned char>& encoded,
+           const ImageBuffer& rgb,
+           const int w,
+           const int h )
+{
+    // --- walk chunks, check CRCs and gather IDAT payload ---------------------
+    std::vector<unsigned char> idat;
+    size_t o = 8;
+    bool seen_iend = false;
+    while( !seen_iend ) {
+        if( o + 12 > encoded.size() ) {
+            result.m_message = "truncated chunk";
+            return;
+        }
+        size_t length = readU32( encoded.data() + o );
+        if( o + 12 + length > encoded.size() ) {
+            result.m_message = "truncated chunk payload";
+            return;
+        }
+        const unsigned char* type = encoded.data() + o + 4;
+        const unsigned char* data = type + 4;
+        unsigned int crc = crc32( 0, type, length + 4 );
+        if( crc != readU32( data + length ) ) {
+            result.m_message = "bad CRC in " + std::string( (const char*)type, 4 ) + " chunk";
+            return;
+        }
+        if( memcmp( type, "IHDR", 4 ) == 0 ) {
+            if( length != 13 ||
+                (int)readU32( data ) != w || (int)readU32( data + 4 ) != h ||
+                data[8] != pixelBitDepth( rgb.format() ) ||
+                data[9] != pngColorType( rgb.format() ) || data[12] != 0 )
+            {
+                result.m_message = "unexpected IHDR";
+                return;
+            }
+        }
+        else if( memcmp( type, "IDAT", 4 ) == 0 ) {
+            idat.insert( idat.end(), data, data + length );
+        }
+        else if( memcmp( type, "IEND", 4 ) == 0 ) {
+            seen_iend = true;
+        }
+        o += 12 + length;
+    }
+
+    // --- inflate with zlib and unfilter --------------------------------------
+    const size_t bpp = pixelBytes( rgb.format() );
+    const size_t stride = bpp*w;
+    std::vector<unsigned char> filtered( (stride+1)*h );
+    uLongf filtered_size = filtered.size();
+    TimeStamp start;
+    int err = uncompress( filtered.data(), &filtered_size, idat.data(), idat.size() );
+    TimeStamp stop;
+    result.m_zlib_seconds = TimeStamp::delta( start, stop );
+    if( err != Z_OK ) {
+        std::stringstream m;
+        m << "zlib: uncompress=" << err;
+        result.m_message = m.str();
+        return;
+    }
+    if( filtered_size != filtered.size() ) {
+        std::stringstream m;
+        m << "zlib: uncompress_size=" << filtered_size << ", should be=" << filtered.size();
+        result.m_message = m.str();
+        return;
+    }
+    std::vector<unsigned char> pixels;
+    if( !unfilterScanlines( pixels, filtered.data(), bpp, stride, h ) ) {
+        result.m_message = "zlib: illegal scanline filter type";
+        return;
+    }
+    if( !comparePixels( result.m_message, pixels.data(), rgb, w, h ) ) {
+        result.m_message = "zlib: " + result.m_message;
+        return;
+    }
+
+    // --- full decode with libpng ---------------------------------------------
+    start = TimeStamp();
+    bool ok = decodeLibPNG( result.m_message, encoded, rgb, w, h );
+    stop = TimeStamp();
+    result.m_decoder_seconds = TimeStamp::delta( start, stop );
+    result.m_ok = ok;
+}
+
+struct JPEGErrorManager
+{
+    struct jpeg_error_mgr   m_pub;
+    jmp_buf                 m_jmp;
+};
+
+static
+void
+jpegErrorExit( j_common_ptr cinfo )
+{
+    JPEGErrorManager* err = (JPEGErrorManager*)cinfo->err;
+    longjmp( err->m_jmp, 1 );
+}
+
+static
+void
+verifyJPEG( VerifyResult& result,
+            const std::vector<unsigned char>& encoded,
+            const ImageBuffer& rgb,
+            const int w,
+            const int h )
+{
+    result.m_lossless = false;
+    result.m_decoder = "libjpeg";
+
+    struct jpeg_decompress_struct cinfo;
+    JPEGErrorManager jerr;
+    cinfo.err = jpeg_std_error( &jerr.m_pub );
+    jerr.m_pub.error_exit = jpegErrorExit;
+    if( setjmp( jerr.m_jmp ) ) {
+        jpeg_destroy_decompress( &cinfo );
+        result.m_message = "libjpeg decode failed";
+        return;
+    }
+
+    TimeStamp start;
+    jpeg_create_decompress( &cinfo );
+    jpeg_mem_src( &cinfo, (unsigned char*)encoded.data(), encoded.size() );
+    jpeg_read_header( &cinfo, TRUE );
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress( &cinfo );
+    if( (int)cinfo.output_width != w || (int)cinfo.output_height != h || cinfo.output_components != 3 ) {
+        jpeg_destroy_decompress( &cinfo );
+        result.m_message = "libjpeg: unexpected image format";
+        return;
+    }
+    std::vector<unsigned char> decoded( 3*(size_t)w*h );
+    while( cinfo.output_scanline < cinfo.output_height ) {
+        unsigned char* row = decoded.data() + 3*(size_t)w*cinfo.output_scanline;
+        jpeg_read_scanlines( &cinfo, &row, 1 );
+    }
+    jpeg_finish_decompress( &cinfo );
+    jpeg_destroy_decompress( &cinfo );
+    TimeStamp stop;
+    result.m_decoder_seconds = TimeStamp::delta( start, stop );
+
+    double sse = 0.0;
+    for( size_t i=0; i<decoded.size(); i++ ) {
+        double d = (double)decoded[i] - (double)(unsigned char)rgb[i];
+        sse += d*d;
+    }
+    double mse = decoded.empty() ? 0.0 : sse/decoded.size();
+    result.m_psnr = mse > 0.0 ? 10.0*std::log10( 255.0*255.0/mse ) : INFINITY;
+    result.m_ok = true;
+}
+
+static
+void
+verifyDepth( VerifyResult& result,
+             const std::vector<unsigned char>& encoded,
+             const ImageBuffer& depth,
+             const int w,
+             const int h )
+{
+    result.m_decoder = "unshuffle+undelta";
+
+    std::vector<unsigned char> decoded;
+    int dw, dh;
+    bool ok = decodeDepth( decoded, dw, dh, result.m_message, encoded,
+                           &result.m_zlib_seconds, &result.m_decoder_seconds );
+    if( !ok ) {
+        return;
+    }
+    if( dw != w || dh != h ) {
+        std::stringstream m;
+        m << "depth: size " << dw << "x" << dh << ", should be " << w << "x" << h;
+        result.m_message = m.str();
+        return;
+    }
+    const size_t row_bytes = 4*(size_t)w;
+    for( int j=0; j<h; j++ ) {
+        if( memcmp( decoded.data() + row_bytes*j, depth.data() + row_bytes*j, row_bytes ) != 0 ) {
+            std::stringstream m;
+            m << "depth: row " << j << " differs";
+            result.m_message = m.str();
+            return;
+        }
+    }
+    result.m_ok = true;
+}
+
+VerifyResult
+verifyEncoded( const std::vector<unsigned char>& encoded,
+               const ImageBuffer& rgb,
+               const int w,
+               const int h )
+{
+    static const unsigned char png_signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+    VerifyResult result;
+    if( encoded.size() >= 8 && memcmp( encoded.data(), png_signature, 8 ) == 0 ) {
+        verifyPNG( result, encoded, rgb, w, h );
+    }
+    else if( encoded.size() >= 2 && encoded[0] == 0xff && encoded[1] == 0xd8 ) {
+        verifyJPEG( result, encoded, rgb, w, h );
+    }
+    else if( encoded.size() >= 4 && memcmp( encoded.data(), "DPTH", 4 ) == 0 ) {
+        verifyDepth( result, encoded, rgb, w, h );
+    }
+    else {
+        result.m_message = "unrecognized file format";
+    }
+    return result;
+}
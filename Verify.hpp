@@ -0,0 +1,37 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "ImageBuffer.hpp"
+
+struct VerifyResult
+{
+    VerifyResult()
+        : m_ok( false ),
+          m_lossless( true ),
+          m_zlib_seconds( 0.0 ),
+          m_decoder_seconds( 0.0 ),
+          m_psnr( 0.0 ),
+          m_decoder( "libpng" )
+    {}
+
+    bool        m_ok;
+    bool        m_lossless;         ///< False for JPEG, where m_psnr is reported instead.
+    double      m_zlib_seconds;     ///< Inflate of concatenated IDAT payload, or of all depth stripes.
+    double      m_decoder_seconds;  ///< Full decode through libpng or libjpeg, or the depth unfilter alone.
+    double      m_psnr;
+    const char* m_decoder;          ///< Name of the decoder timed in m_decoder_seconds.
+    std::string m_message;          ///< Reason for failure, if any.
+};
+
+/** Decodes an encoded PNG, JPEG or depth image and compares it against the source.
+ *
+ * PNG files are checked twice: the IDAT stream is inflated with zlib and
+ * unfiltered by hand, and the whole file is decoded with libpng. Both must
+ * reproduce the source pixels exactly. Depth streams must reproduce the
+ * source floats bit for bit. Runs outside of any timed region.
+ */
+VerifyResult
+verifyEncoded( const std::vector<unsigned char>& encoded,
+               const ImageBuffer& rgb,
+               const int w,
+               const int h );
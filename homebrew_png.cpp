@@ -1,11 +1,12 @@
-#include <zlib.h>
 #include "timer.hpp"
+#include "PerfCounters.hpp"
 #include <xmmintrin.h>
 #include <emmintrin.h>
 #include <smmintrin.h>
 #include <tmmintrin.h>
 #include <vector>
-#include <fstream>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include "ThreadPool.hpp"
 #include "BitPusher.hpp"
@@ -13,6 +14,9 @@
 #include "LZEncoder.hpp"
 #include "HuffEncode.hpp"
 #include "ScanlineFilter.hpp"
+#include "EncoderRegistry.hpp"
+#include "OutputSink.hpp"
+#include "homebrew_png.hpp"
 
 //#define PARALLEL
 
@@ -37,13 +41,13 @@ createCRCTable( )
 }
 
 void
-writeSignature( std::ofstream& file )
+writeSignature( OutputSink& out )
 {
-    unsigned char signature[8] = 
+    static const unsigned char signature[8] =
     {
         137, 80, 78, 71, 13, 10, 26, 10
     };
-    file.write( reinterpret_cast<char*>( signature ), sizeof(signature ) );    
+    out.write( signature, sizeof(signature) );
 }
 
 
@@ -288,15 +292,65 @@ CRC( const std::vector<unsigned long>& crc_table, const unsigned char* p, size_t
     return ~crc;
 }
 
+unsigned long
+homebrewCRC( const unsigned char* p, size_t length )
+{
+    return CRC( crc_table, p, length ) & 0xffffffffu;
+}
+
 
 
 
+/** Pixels packed into one integer for comparison, wide enough for Layout. */
+template<bool Wide>
+struct PackedPixel
+{
+    typedef unsigned int type;
+};
+
+template<>
+struct PackedPixel<true>
+{
+    typedef unsigned long long type;
+};
+
+static inline
 void
-writeIDAT3( std::ofstream& file, const std::vector<char>& img, const std::vector<unsigned long>& crc_table, int WIDTH, int HEIGHT  )
+pushLiteral( BitPusher& pusher, unsigned int t )
 {
-    
-    
-    std::vector<unsigned char> IDAT(8);
+    if( t < 144 ) {
+        pusher.pushBitsReverse( t + 48, 8 );
+    }
+    else {
+        pusher.pushBitsReverse( t + 256, 9 );
+    }
+}
+
+/** Pushes the bytes of a packed pixel as fixed Huffman literals, first byte first. */
+template<typename Layout, typename Pixel>
+static inline
+void
+pushLiteralPixel( BitPusher& pusher, Pixel pixel )
+{
+    for( int b=Layout::bytes-1; b>=0; b-- ) {
+        pushLiteral( pusher, (pixel >> (8*b)) & 0xffu );
+    }
+}
+
+/** Pixel-level LZ directly to fixed Huffman codes, matching whole pixels in
+ * the current and previous scanline. Specialised per pixel layout.
+ */
+template<typename Layout>
+static
+void
+writeIDAT3( OutputSink& out, std::vector<unsigned char>& IDAT, const ImageBuffer& img, const std::vector<unsigned long>& crc_table, int WIDTH, int HEIGHT  )
+{
+    typedef typename PackedPixel<(Layout::bytes > 4)>::type Pixel;
+    const unsigned int bpp = Layout::bytes;
+    const unsigned int stride = bpp*WIDTH;
+    const int max_match = 258/bpp;                  // deflate matches are 3..258 bytes
+    const bool match_up = 2*stride+1 <= 32768;      // previous row within the window
+    IDAT.assign( 8, 0 );
     // IDAT chunk header
     IDAT[4] = 'I';
     IDAT[5] = 'D';
@@ -310,15 +364,16 @@ writeIDAT3( std::ofstream& file, const std::vector<char>& img, const std::vector
     unsigned int dat_size;
 
     
-    unsigned int s1 = 1;
-    unsigned int s2 = 0;
+    // Reduced once per scanline, 64 bits keep wide scanlines from overflowing.
+    unsigned long long s1 = 1;
+    unsigned long long s2 = 0;
     {
         BitPusher pusher( IDAT );
         pusher.pushBitsReverse( 6, 3 );    // 5 = 101
 
-        std::vector<unsigned int> buffer( WIDTH*5, ~0u );
+        std::vector<Pixel> buffer( WIDTH*5, ~(Pixel)0 );
         
-        unsigned int* zrows[4] = {
+        Pixel* zrows[4] = {
             buffer.data(),
             buffer.data()+WIDTH,
             buffer.data()+2*WIDTH,
@@ -329,7 +384,7 @@ writeIDAT3( std::ofstream& file, const std::vector<char>& img, const std::vector
 
         
         for( int j=0; j<HEIGHT; j++ ) {
-            unsigned int* rows[4] = {
+            Pixel* rows[4] = {
                 zrows[ (j+3)&1 ],
                 zrows[ (j+2)&1 ],
                 zrows[ (j+1)&1 ],
@@ -352,18 +407,16 @@ writeIDAT3( std::ofstream& file, const std::vector<char>& img, const std::vector
             //std::cerr << o << "---\n";
             o++;
 
-            for(int i=0; i<WIDTH; i++ ) {
-                unsigned int R = img[ 3*(WIDTH*j + i ) + 0 ];
-                unsigned int G = img[ 3*(WIDTH*j + i ) + 1 ];
-                unsigned int B = img[ 3*(WIDTH*j + i ) + 2 ];
-                unsigned int RGB = (R<<16) | (G<<8) | B;
+            const bool up = match_up && j > 0;
 
-                s1 = (s1 + R);
-                s2 = (s2 + s1);
-                s1 = (s1 + G);
-                s2 = (s2 + s1);
-                s1 = (s1 + B);
-                s2 = (s2 + s1);
+            for(int i=0; i<WIDTH; i++ ) {
+                Pixel RGB = 0;
+                for( unsigned int b=0; b<bpp; b++ ) {
+                    unsigned int c = (unsigned char)img[ (size_t)stride*j + bpp*i + b ];
+                    RGB = (RGB<<8) | c;
+                    s1 = (s1 + c);
+                    s2 = (s2 + s1);
+                }
                 
                 //std::cerr << o << ":\t" << RGB << "\t";
                 rows[0][i] = RGB;
@@ -383,7 +436,7 @@ writeIDAT3( std::ofstream& file, const std::vector<char>& img, const std::vector
                         match_src_j = 0;
                         for( k=i-1; (k>=0)&&(rows[0][k] != RGB); k--) {}
 
-                        if( k < 0 ) {
+                        if( k < 0 && up ) {
                             match_src_j = 1;
                             for( k=WIDTH-1; (k>=0)&&(rows[1][k] != RGB); k--) {}
                         }
@@ -405,8 +458,8 @@ writeIDAT3( std::ofstream& file, const std::vector<char>& img, const std::vector
                     else {
                         // We are matching
 
-                        if( match_length >= 86 ) {
-                            // Max matchlength is 86*3=258, flush and continue
+                        if( match_length >= max_match ) {
+                            // Max matchlength is 258 bytes, flush and continue
                             emit_match = true;
                             redo = true;
                         }
@@ -425,7 +478,7 @@ writeIDAT3( std::ofstream& file, const std::vector<char>& img, const std::vector
 
                             // try to find new match source
                             int k = match_src_i-1;
-                            for(int m=match_src_j; (emit_match) && (m<2); m++ ) {
+                            for(int m=match_src_j; (emit_match) && (m<(up?2:1)); m++ ) {
                                 for(; (emit_match) && (k>=0); k--) {
                                     bool fail = false;
                                     for(int l=0; l<=match_length; l++) {
@@ -443,26 +496,34 @@ writeIDAT3( std::ofstream& file, const std::vector<char>& img, const std::vector
                                         break;
                                     }
                                 }
-                                k = WIDTH-1;
+                                // Match must end inside the previous scanline.
+                                k = WIDTH-1-match_length;
                             }
 
                         }
                     }
                     
-                    if( ((i == WIDTH-1) && (match_length)) || emit_match ) {
+                    if( (((i == WIDTH-1) && (match_length)) || emit_match) && (bpp*match_length < 3) ) {
+                        // Too short for deflate, send the matched pixels as literals
+                        for(int l=0; l<match_length; l++ ) {
+                            pushLiteralPixel<Layout>( pusher, rows[0][ match_dst_i+l ] );
+                        }
+                        match_length = 0;
+                    }
+                    else if( ((i == WIDTH-1) && (match_length)) || emit_match ) {
                         unsigned int bits = 0;
                         unsigned int bits_n = 0;
                         
-                        unsigned int count = 3*match_length;
+                        unsigned int count = bpp*match_length;
                         encodeCount( bits, bits_n, count );
                         pusher.pushBitsReverse( bits, bits_n );
                         
                         bits = 0;
                         bits_n = 0;
-                        unsigned int distance = 3*(match_dst_i-match_src_i);
+                        unsigned int distance = bpp*(match_dst_i-match_src_i);
                         
                         if( match_src_j > 0 ) {
-                            distance += 3*WIDTH+1;
+                            distance += stride+1;
                         }
                         
                         encodeDistance( bits, bits_n, distance );
@@ -471,15 +532,12 @@ writeIDAT3( std::ofstream& file, const std::vector<char>& img, const std::vector
                     }
                     
                     if( emit_verbatim ) {
-                        unsigned int bits = 0;
-                        unsigned int bits_n = 0;
-                        encodeLiteralTriplet( bits, bits_n, RGB );
-                        pusher.pushBitsReverse( bits, bits_n );
+                        pushLiteralPixel<Layout>( pusher, RGB );
                     }
                 }
                 while( redo );
                     
-                o+=3;
+                o+=bpp;
             }
             s1 = s1 % 65521;
             s2 = s2 % 65521;
@@ -487,7 +545,7 @@ writeIDAT3( std::ofstream& file, const std::vector<char>& img, const std::vector
         }
         pusher.pushBits( 0, 7 );    // EOB 
     }
-    unsigned int adler = (s2<<16) + s1;
+    unsigned int adler = (unsigned int)((s2<<16) + s1);
     
     IDAT.push_back( ((adler)>>24)&0xffu ); // Adler32
     IDAT.push_back( ((adler)>>16)&0xffu );
@@ -514,54 +572,31 @@ writeIDAT3( std::ofstream& file, const std::vector<char>& img, const std::vector
     
     
 
-#if 0
-    if( 1) {
-        std::vector<unsigned char> quux(10*1024*1024);
-
-        z_stream stream;
-        int err;
     
-        stream.next_in = (z_const Bytef *)IDAT.data()+8;
-        stream.avail_in = (uInt)IDAT.size()-8;
-        stream.next_out = quux.data();
-        stream.avail_out = quux.size();
-        stream.zalloc = (alloc_func)0;
-        stream.zfree = (free_func)0;
-
-        err = inflateInit(&stream);
-        if (err != Z_OK) {
-            std::cerr << "inflateInit failed: " << err << "\n";
-            abort();
-        }
-       
-        err = inflate(&stream, Z_FINISH);
-
-        if( stream.msg != NULL ) {
-            std::cerr << stream.msg << "\n";
-        }
-        
-
-        uLongf quux_size = quux.size();
-        err = uncompress( quux.data(), &quux_size, IDAT.data() + 8, IDAT.size() - 8 );
-        if( err != Z_OK ) {
-            std::cerr << "uncompress="
-                      << err
-                      << "\n";
-        }
-        if( quux_size != ((3*WIDTH+1)*HEIGHT) ) {
-            std::cerr << "uncompress_size="  << quux_size
-                      << ", should be=" << ((3*WIDTH+1)*HEIGHT) << "\n";
-        }
-    }
-#endif
-    
-    file.write( reinterpret_cast<char*>( IDAT.data() ), dat_size+12 );
+    out.write( IDAT.data(), dat_size+12 );
 }
+struct IDAT3Visitor
+{
+    OutputSink&                         m_out;
+    std::vector<unsigned char>&         m_IDAT;
+    const ImageBuffer&                  m_img;
+    const std::vector<unsigned long>&   m_crc_table;
+    int                                 m_width;
+    int                                 m_height;
+
+    template<typename Layout>
+    void
+    run()
+    {
+        writeIDAT3<Layout>( m_out, m_IDAT, m_img, m_crc_table, m_width, m_height );
+    }
+};
+
 void
-writeIHDR( std::ofstream& file, const std::vector<unsigned long>& crc_table, int WIDTH, int HEIGHT )
+writeIHDR( OutputSink& out, unsigned char* chunk, const std::vector<unsigned long>& crc_table, int WIDTH, int HEIGHT, PixelFormat format = PIXEL_RGB8 )
 {
     // IHDR chunk, 13 + 12 (length, type, crc) = 25 bytes
-    unsigned char IHDR[ 25 ] = 
+    const unsigned char IHDR[ 25 ] =
     {
         // Chunk length (4 bytes)
         ((13)>>24)&0xffu,((13)>>16)&0xffu, ((13)>>8)&0xffu, ((13)>>0)&0xffu,
@@ -571,28 +606,36 @@ writeIHDR( std::ofstream& file, const std::vector<unsigned long>& crc_table, int
         ((WIDTH)>>24)&0xffu,((WIDTH)>>16)&0xffu, ((WIDTH)>>8)&0xffu, ((WIDTH)>>0)&0xffu,
         // Image height
         ((HEIGHT)>>24)&0xffu,((HEIGHT)>>16)&0xffu, ((HEIGHT)>>8)&0xffu, ((HEIGHT)>>0)&0xffu,
-        // bits per channel, RGB triple, ..., .., image not interlaced (5 bytes)
-        8, 2, 0, 0, 0,
+        // bits per channel, colour type, ..., .., image not interlaced (5 bytes)
+        (unsigned char)pixelBitDepth( format ), (unsigned char)pngColorType( format ), 0, 0, 0,
         // CRC of 13+4 bytes
         0, 0, 0, 0
     };
-    unsigned long crc = CRC( crc_table, IHDR+4, 13+4 );
-    IHDR[21] = ((crc)>>24)&0xffu;    // image width
-    IHDR[22] = ((crc)>>16)&0xffu;
-    IHDR[23] = ((crc)>>8)&0xffu;
-    IHDR[24] = ((crc)>>0)&0xffu;
-    
-    file.write( reinterpret_cast<char*>( IHDR ), sizeof(IHDR) );
+    // Caller keeps the chunk alive until the sink is flushed.
+    memcpy( chunk, IHDR, sizeof(IHDR) );
+    unsigned long crc = CRC( crc_table, chunk+4, 13+4 );
+    chunk[21] = ((crc)>>24)&0xffu;    // image width
+    chunk[22] = ((crc)>>16)&0xffu;
+    chunk[23] = ((crc)>>8)&0xffu;
+    chunk[24] = ((crc)>>0)&0xffu;
+
+    out.write( chunk, sizeof(IHDR) );
 }
 
 
 
+/** Filter type 1 with runs of equal filtered pixels as distance bpp
+ * matches, directly to fixed Huffman codes. Specialised per pixel layout.
+ */
+template<typename Layout>
+static
 void
-writeIDAT2( std::ofstream& file, const std::vector<char>& img, const std::vector<unsigned long>& crc_table, int WIDTH, int HEIGHT  )
+writeIDAT2( OutputSink& out, std::vector<unsigned char>& IDAT, const ImageBuffer& img, const std::vector<unsigned long>& crc_table, int WIDTH, int HEIGHT  )
 {
-    
-    
-    std::vector<unsigned char> IDAT(8);
+    typedef typename PackedPixel<(Layout::bytes > 4)>::type Pixel;
+    const unsigned int bpp = Layout::bytes;
+    const size_t stride = bpp*WIDTH;
+    IDAT.assign( 8, 0 );
     // IDAT chunk header
     IDAT[4] = 'I';
     IDAT[5] = 'D';
@@ -604,8 +647,9 @@ writeIDAT2( std::ofstream& file, const std::vector<char>& img, const std::vector
     IDAT.push_back( 94 /* 28*/ );           // FLG
     
     unsigned int dat_size;
-    unsigned int s1 = 1;
-    unsigned int s2 = 0;
+    // Reduced once per scanline, 64 bits keep wide scanlines from overflowing.
+    unsigned long long s1 = 1;
+    unsigned long long s2 = 0;
     {
         BitPusher pusher( IDAT );
         pusher.pushBitsReverse( 6, 3 );    // 5 = 101
@@ -618,95 +662,63 @@ writeIDAT2( std::ofstream& file, const std::vector<char>& img, const std::vector
             s2 += s1;                          
 
 #if 1
-            unsigned int trgb_p = 0xffffffff;
+            Pixel trgb_p = ~(Pixel)0;
             unsigned int c = 0;
             for(int i=0; i<WIDTH; i++ ) {
                 
-                unsigned int trgb_l = 0;
-                for(int k=0; k<3; k++) {
-                    unsigned int t = (img[ 3*WIDTH*j + 3*i + k ]
-                                   - (i==0?0:img[3*WIDTH*j+3*(i-1)+k ] )) & 0xffu;
+                Pixel trgb_l = 0;
+                for(unsigned int k=0; k<bpp; k++) {
+                    unsigned int t = (img[ stride*j + bpp*i + k ]
+                                   - (i==0?0:img[ stride*j + bpp*(i-1) + k ] )) & 0xffu;
 
                     s1 = (s1 + t);                  // update adler 1 & 2
                     s2 = (s2 + s1);
                     trgb_l = (trgb_l<<8) | t;
                 }
-                if( (i==0) || (i==WIDTH-1) || (trgb_l != trgb_p) || ( c >= 66 ) ) {
+                if( (i==0) || (i==WIDTH-1) || (trgb_l != trgb_p) || ( c+bpp > 66 ) ) {
                     // flush copies
                     if( c == 0 ) {
-                        // no copies, 1 or 2 never occurs.
-                    }
-                    else if( c < 11 ) {
-                        pusher.pushBitsReverse( c-2, 7 );
-                        pusher.pushBitsReverse( 2, 5 );
+                        // no copies
                     }
-                    else if( c < 19 ) {
-                        int t = c - 11;
-                        pusher.pushBitsReverse( (t>>1)+9, 7 );
-                        pusher.pushBitsReverse( (t&1), 1 );
-                        pusher.pushBitsReverse( 2, 5 );
-                    }
-                    else if( c < 35 ) {
-                        int t = c - 19;
-                        pusher.pushBitsReverse( (t>>2)+13, 7 );
-                        pusher.pushBits( (t&3), 2 );
-                        pusher.pushBitsReverse( 2, 5 );
+                    else if( c < 3 ) {
+                        // Too short for deflate, repeat the pixel as literals
+                        for( unsigned int l=0; l<c; l+=bpp ) {
+                            pushLiteralPixel<Layout>( pusher, trgb_p );
+                        }
                     }
-                    else if( c < 67 ) {
-                        int t = c - 35;
-                        pusher.pushBitsReverse( (t>>3)+17, 7 );
-                        pusher.pushBits( (t&7), 3 );
-                        pusher.pushBitsReverse( 2, 5 );
+                    else {
+                        unsigned int bits = 0;
+                        unsigned int bits_n = 0;
+                        encodeCount( bits, bits_n, c );
+                        pusher.pushBitsReverse( bits, bits_n );
+
+                        bits = 0;
+                        bits_n = 0;
+                        encodeDistance( bits, bits_n, bpp );
+                        pusher.pushBitsReverse( bits, bits_n );
                     }
                     c = 0;
                    
                     
                     // need to write literal
-                    int r = (trgb_l >> 16)& 0xffu;
-                    if( r < 144 ) {
-                        pusher.pushBitsReverse( r + 48, 8 );
-                    }
-                    else {
-                        pusher.pushBitsReverse( r + (400-144), 9 ); 
-                    }
-                    int g = (trgb_l >> 8)& 0xffu;
-                    if( g < 144 ) {
-                        pusher.pushBitsReverse( g + 48, 8 );
-                    }
-                    else {
-                        pusher.pushBitsReverse( g + (400-144), 9 ); 
-                    }
-                    int b = (trgb_l >> 0)& 0xffu;
-                    if( b < 144 ) {
-                        pusher.pushBitsReverse( b + 48, 8 );
-                    }
-                    else {
-                        pusher.pushBitsReverse( b + (400-144), 9 ); 
-                    }
+                    pushLiteralPixel<Layout>( pusher, trgb_l );
                     trgb_p = trgb_l;            
                 }
                 else {
-                    c+=3;
+                    c+=bpp;
                 }
             }
 #else            
-            for(int i=0; i<WIDTH; i++) {
-                
-
-
-
-                
-                for(int k=0; k<3; k++ ) {
-                    int q = img[ 3*WIDTH*j + 3*i + k ];
-                    s1 = (s1 + q);                  // update adler 1 & 2
-                    s2 = (s2 + s1);
+            for(size_t i=0; i<stride; i++) {
+                int q = img[ stride*j + i ];
+                s1 = (s1 + q);                  // update adler 1 & 2
+                s2 = (s2 + s1);
 
-                    if( q < 144 ) {
-                        pusher.pushBitsReverse( q + 48, 8 );            // 48 = 00110000
-                    }
-                    else {
-                        pusher.pushBitsReverse( q + (400-144), 9 );     // 400 = 110010000
-                    }
+                if( q < 144 ) {
+                    pusher.pushBitsReverse( q + 48, 8 );            // 48 = 00110000
+                }
+                else {
+                    pusher.pushBitsReverse( q + (400-144), 9 );     // 400 = 110010000
                 }
             }
 #endif
@@ -718,7 +730,7 @@ writeIDAT2( std::ofstream& file, const std::vector<char>& img, const std::vector
         }
         pusher.pushBits( 0, 7 );    // EOB 
     }
-    unsigned int adler = (s2<<16) + s1;
+    unsigned int adler = (unsigned int)((s2<<16) + s1);
     
     IDAT.push_back( ((adler)>>24)&0xffu ); // Adler32
     IDAT.push_back( ((adler)>>16)&0xffu );
@@ -746,50 +758,26 @@ writeIDAT2( std::ofstream& file, const std::vector<char>& img, const std::vector
 
     
     
-#if 0
-    if( 1) {
-        std::vector<unsigned char> quux(10*1024*1024);
-
-        z_stream stream;
-        int err;
     
-        stream.next_in = (z_const Bytef *)IDAT.data()+8;
-        stream.avail_in = (uInt)IDAT.size()-8;
-        stream.next_out = quux.data();
-        stream.avail_out = quux.size();
-        stream.zalloc = (alloc_func)0;
-        stream.zfree = (free_func)0;
-
-        err = inflateInit(&stream);
-        if (err != Z_OK) {
-            std::cerr << "inflateInit failed: " << err << "\n";
-            abort();
-        }
-       
-        err = inflate(&stream, Z_FINISH);
-
-        if( stream.msg != NULL ) {
-            std::cerr << stream.msg << "\n";
-        }
-        
+    out.write( IDAT.data(), dat_size+12 );
+}
 
-        uLongf quux_size = quux.size();
-        err = uncompress( quux.data(), &quux_size, IDAT.data() + 8, IDAT.size() - 8 );
-        if( err != Z_OK ) {
-            std::cerr << "uncompress="
-                      << err
-                      << "\n";
-        }
-        if( quux_size != ((3*WIDTH+1)*HEIGHT) ) {
-            std::cerr << "uncompress_size="  << quux_size
-                      << ", should be=" << ((3*WIDTH+1)*HEIGHT) << "\n";
-        }
-        
+struct IDAT2Visitor
+{
+    OutputSink&                         m_out;
+    std::vector<unsigned char>&         m_IDAT;
+    const ImageBuffer&                  m_img;
+    const std::vector<unsigned long>&   m_crc_table;
+    int                                 m_width;
+    int                                 m_height;
+
+    template<typename Layout>
+    void
+    run()
+    {
+        writeIDAT2<Layout>( m_out, m_IDAT, m_img, m_crc_table, m_width, m_height );
     }
-#endif
-    
-    file.write( reinterpret_cast<char*>( IDAT.data() ), dat_size+12 );
-}
+};
 
 
 struct CacheItem
@@ -805,34 +793,41 @@ hash( unsigned char a, unsigned char b, unsigned char c )
 }
 
 
-int
-lengthOfMatch( const unsigned char* a,
-               const unsigned char* b,
-               const int N )
-{
 
-#if 1
-    for(int i=0; i<N; i+=16 ) {
-        __m128i _a = _mm_lddqu_si128( (__m128i const*)(a+i) );
-        __m128i _b = _mm_lddqu_si128( (__m128i const*)(b+i) );
-        unsigned int q = _mm_movemask_epi8( _mm_cmpeq_epi8( _a, _b ) );
-        if( q != 0xffffu ) {
-            int l = i + __builtin_ctz( ~q );
-            return std::min( N, l );
-        }
-    }
-#else
-    for( int i=0; i<N; i++ ) {
-        if( *a++ != *b++ ) {
-            return i;
-        }
+/** Effort level whose parse seeds the cost model of the optimal parse. */
+static const int optimal_seed_level = 6;
+
+/** LZ encodes data and plans the deflate blocks of the result.
+ *
+ * The optimal parse is priced with dynamic codes built from a lazy parse of
+ * the same data. Pricing it with the fixed codes instead makes literals look
+ * expensive, and the short matches it then prefers keep the dynamic codes
+ * of a second pass skewed.
+ */
+static
+unsigned int
+encodeLZBlocks( unsigned int* code_stream,
+                std::vector<DeflateBlock>& blocks,
+                unsigned char* data,
+                unsigned int N,
+                int level )
+{
+    bool optimal = lzParams( level ).m_parse == LZ_PARSE_OPTIMAL;
+    unsigned int M = encodeLZ( code_stream, data, N, optimal ? optimal_seed_level : level );
+    if( optimal ) {
+        DeflateHistogram histogram;
+        histogram.clear();
+        histogram.add( code_stream, M );
+        DynamicHuffmanCodes huffman;
+        buildDynamicHuffman( huffman, histogram );
+        HuffmanCosts costs;
+        huffmanCosts( costs, huffman.m_litlen_lengths, huffman.m_distance_lengths );
+        M = encodeLZ( code_stream, data, N, level, &costs );
     }
-#endif
-    return N;
+    planDeflateBlocks( blocks, code_stream, M );
+    return M;
 }
 
-
-
 class IDAT4Worker : public JobInterface
 {
 public:
@@ -841,22 +836,47 @@ public:
                  unsigned char* filtered,
                  unsigned char* image,
                  unsigned int width,
-                 unsigned int height )
+                 unsigned int height,
+                 PixelFormat format,
+                 int level,
+                 int stripe,
+                 unsigned int* adler32 = NULL,
+                 std::vector<DeflateBlock>* blocks = NULL )
         : m_code_stream_p( code_stream_p ),
           m_code_stream_n( code_stream_n ),
           m_filtered( filtered ),
           m_image( image ),
           m_width( width ),
-          m_height( height )
+          m_height( height ),
+          m_format( format ),
+          m_level( level ),
+          m_stripe( stripe ),
+          m_adler32( adler32 ),
+          m_blocks( blocks )
     {}
 
     void
     run()
     {
-        filterScanlines( m_filtered, m_image, m_width, m_height );
-        *m_code_stream_n = encodeLZ( m_code_stream_p, m_filtered, (3*m_width+1)*m_height );
+        unsigned int filtered_size = (pixelBytes( m_format )*m_width+1)*m_height;
+        filterScanlines( m_filtered, m_image, m_width, m_height, m_format );
+        if( m_adler32 != NULL ) {
+            *m_adler32 = computeAdler32SSE( m_filtered, filtered_size );
+        }
+        if( m_blocks != NULL ) {
+            *m_code_stream_n = encodeLZBlocks( m_code_stream_p, *m_blocks, m_filtered, filtered_size, m_level );
+        }
+        else {
+            *m_code_stream_n = encodeLZ( m_code_stream_p, m_filtered, filtered_size, m_level );
+        }
     }
 
+    const char*
+    traceName() const { return "IDAT4Worker"; }
+
+    long
+    traceArg() const { return m_stripe; }
+
 protected:
     unsigned int*   m_code_stream_p;
     unsigned int*   m_code_stream_n;
@@ -864,119 +884,255 @@ protected:
     unsigned char*  m_image;
     unsigned int    m_width;
     unsigned int    m_height;
-
+    PixelFormat     m_format;
+    int             m_level;        ///< LZ effort level.
+    int             m_stripe;
+    unsigned int*   m_adler32;      ///< Adler-32 of the filtered stripe, if not NULL.
+    std::vector<DeflateBlock>* m_blocks;    ///< Deflate blocks of the stripe are planned here, if not NULL.
 };
 
-class Adler32Job : public JobInterface
+/** Encodes the deflate blocks of one stripe into a buffer of its own and
+ * records its length in bits. The first stripe starts with the zlib header
+ * and the last one holds the final block.
+ */
+class HuffCodeJob : public JobInterface
 {
 public:
-    Adler32Job( unsigned int* adler32,
-                unsigned char* data,
-                unsigned int N )
-        : m_adler32( adler32 ),
+    HuffCodeJob( std::vector<unsigned char>& output,
+                 size_t* bits,
+                 const unsigned int* code_stream,
+                 const unsigned char* data,
+                 const std::vector<DeflateBlock>& blocks,
+                 bool first,
+                 bool last,
+                 int stripe )
+        : m_output( &output ),
+          m_bits( bits ),
+          m_code_stream( code_stream ),
           m_data( data ),
-          m_N( N )
+          m_blocks( &blocks ),
+          m_first( first ),
+          m_last( last ),
+          m_stripe( stripe )
     {}
 
     void
     run()
     {
-        *m_adler32 = computeAdler32SSE( m_data, m_N );
+        m_output->clear();
+        BitPusher pusher( *m_output );
+        if( m_first ) {
+            beginZlib( pusher );
+        }
+        encodeDeflateBlocks( pusher, *m_blocks, m_code_stream, m_data, m_last );
+        *m_bits = pusher.bits();
+        pusher.flush();
     }
 
+    const char*
+    traceName() const { return "HuffCodeJob"; }
+
+    long
+    traceArg() const { return m_stripe; }
+
 protected:
-    unsigned int*   m_adler32;
-    unsigned char*  m_data;
-    unsigned int    m_N;
+    std::vector<unsigned char>*         m_output;   // pointers to keep the job assignable
+    size_t*                             m_bits;
+    const unsigned int*                 m_code_stream;
+    const unsigned char*                m_data;
+    const std::vector<DeflateBlock>*    m_blocks;
+    bool                                m_first;
+    bool                                m_last;
+    int                                 m_stripe;
 };
 
-class HuffCodeJob : public JobInterface
+
+
+// --- encoder context -------------------------------------------------------
+
+enum ScratchSlot
 {
-public:
-    HuffCodeJob( std::vector<unsigned char>& output,
-                 unsigned int** code_stream_p,
-                 unsigned int*  code_stream_N,
-                 unsigned int   code_streams )
-        : m_output( output ),
-          m_code_stream_p( code_stream_p ),
-          m_code_stream_N( code_stream_N ),
-          m_code_streams( code_streams )
-    {}
+    SCRATCH_FILTERED,
+    SCRATCH_CODESTREAM
+};
 
-    void
-    run()
-    {
-        encodeHuffman( m_output, m_code_stream_p, m_code_stream_N, m_code_streams );
+EncoderContext::EncoderContext( bool huge_pages )
+    : m_scratch( huge_pages )
+{}
+
+EncoderContext::~EncoderContext()
+{
+    for( size_t k=0; k<m_workers.size(); k++ ) {
+        delete m_workers[k];
+    }
+    for( size_t k=0; k<m_huff_jobs.size(); k++ ) {
+        delete m_huff_jobs[k];
     }
+}
 
-protected:
-    std::vector<unsigned char>& m_output;
-    unsigned int** m_code_stream_p;
-    unsigned int*  m_code_stream_N;
-    unsigned int   m_code_streams;
-};
+EncoderContext&
+homebrewContext()
+{
+    static EncoderContext context;
+    return context;
+}
 
+/** Copies job into the object kept in slot, creating it on first use. */
+template<typename Job>
+static
+Job*
+reuseJob( Job*& slot, const Job& job )
+{
+    if( slot == NULL ) {
+        slot = new Job( job );
+    }
+    else {
+        *slot = job;
+    }
+    return slot;
+}
 
+/** Makes room for the largest IDAT chunk fixed Huffman coding can produce,
+ * where a 3 byte match may take up to 31 bits. Dynamic codes are about as
+ * long at worst, plus their headers, which the vector grows to fit.
+ */
+static
+void
+reserveIDAT( std::vector<unsigned char>& IDAT, size_t filtered_size )
+{
+    IDAT.reserve( filtered_size + filtered_size/3 + 64 );
+}
 
 void
-writeIDAT4MC( ThreadPool *thread_pool, std::ofstream& file, const std::vector<char>& img, const std::vector<unsigned long>& crc_table, int WIDTH, int HEIGHT  )
+writeIDAT4MC( ThreadPool *thread_pool, OutputSink& out, EncoderContext& context, const ImageBuffer& img, const std::vector<unsigned long>& crc_table, int WIDTH, int HEIGHT, int level )
 {
     int T = (thread_pool->workers()+1);
 
 
-    TimeStamp T0;
-    unsigned int adler;
-    unsigned int filtered_size = (3*WIDTH+1)*HEIGHT;
-    unsigned char* filtered = (unsigned char*)malloc( sizeof(unsigned char)*filtered_size );
-    unsigned int* codestream = (unsigned int*)malloc(sizeof(unsigned int)*filtered_size );
+    unsigned int adler = 1;
+    unsigned int bpp = pixelBytes( img.format() );
+    unsigned int filtered_size = (bpp*WIDTH+1)*HEIGHT;
+    unsigned char* filtered = (unsigned char*)context.m_scratch.get( SCRATCH_FILTERED, sizeof(unsigned char)*filtered_size );
+    unsigned int* codestream = (unsigned int*)context.m_scratch.get( SCRATCH_CODESTREAM, sizeof(unsigned int)*filtered_size );
+    std::vector<unsigned char>& IDAT = context.m_IDAT;
+    if( (int)context.m_workers.size() < T ) {
+        context.m_workers.resize( T, NULL );
+    }
+    if( (int)context.m_blocks.size() < T ) {
+        context.m_blocks.resize( T );
+    }
+    if( (int)context.m_huff_jobs.size() < T ) {
+        context.m_huff_jobs.resize( T, NULL );
+        context.m_stripe_output.resize( T );
+    }
 
     CompletionToken tokenA, tokenB;
 
     unsigned int* _codestream_p[ T ];
     unsigned int  _codestream_n[ T ];
-    for( int t=0; t<T; t++ ) {
-        int a = (t*HEIGHT)/T;
-        int b = ((t+1)*HEIGHT)/T;
-
-
-        _codestream_p[ t ] = codestream + (3*WIDTH+1)*a;
-        _codestream_n[ t ] = 0;
+    unsigned int  _adler[ T ];
+    size_t        _bits[ T ];
+    {
+        StageCounters stage( "filter+LZenc" );
+        for( int t=0; t<T; t++ ) {
+            int a = (t*HEIGHT)/T;
+            int b = ((t+1)*HEIGHT)/T;
+
+
+            _codestream_p[ t ] = codestream + (bpp*WIDTH+1)*a;
+            _codestream_n[ t ] = 0;
+
+            thread_pool->addJob( reuseJob( context.m_workers[ t ],
+                                           IDAT4Worker( _codestream_p[ t ],
+                                                        _codestream_n + t,
+                                                        filtered + (bpp*WIDTH+1)*a,
+                                                        (unsigned char*)(img.data()) + bpp*WIDTH*a,
+                                                        WIDTH, b-a, img.format(), level, t,
+                                                        _adler + t, &context.m_blocks[ t ] ) ),
+                                 &tokenA );
+        }
+        thread_pool->wait( &tokenA );
+    }
 
-        thread_pool->addJob( new IDAT4Worker( _codestream_p[ t ],
-                                              _codestream_n + t,
-                                              filtered + (3*WIDTH+1)*a,
-                                              (unsigned char*)(img.data()) + 3*WIDTH*a,
-                                              WIDTH, b-a ),
-                             &tokenA );
+    {
+        StageCounters stage( "huffenc" );
+        for( int t=0; t<T; t++ ) {
+            int a = (t*HEIGHT)/T;
+            int b = ((t+1)*HEIGHT)/T;
+            reserveIDAT( context.m_stripe_output[ t ], (bpp*WIDTH+1)*(b-a) );
+            thread_pool->addJob( reuseJob( context.m_huff_jobs[ t ],
+                                           HuffCodeJob( context.m_stripe_output[ t ],
+                                                        _bits + t,
+                                                        _codestream_p[ t ],
+                                                        filtered + (bpp*WIDTH+1)*a,
+                                                        context.m_blocks[ t ],
+                                                        t == 0, t+1 == T, t ) ),
+                                 &tokenB );
+        }
+        thread_pool->wait( &tokenB );
     }
-    thread_pool->wait( &tokenA );
-    TimeStamp T1;
-    thread_pool->addJob( new Adler32Job( &adler, filtered, filtered_size ),
-                         &tokenB );
 
-    std::vector<unsigned char> IDAT(8);
+    // Stripes end at arbitrary bit positions and are shifted into place
+    // behind each other; the last one is zero-padded to a byte. The padding
+    // of stored blocks was laid out as if their stripe started on a byte, so
+    // such a stripe is preceded by an empty stored block that makes it so.
+    reserveIDAT( IDAT, filtered_size );
+    IDAT.assign( 8, 0 );
     IDAT[4] = 'I';
     IDAT[5] = 'D';
     IDAT[6] = 'A';
     IDAT[7] = 'T';
-    thread_pool->addJob( new HuffCodeJob( IDAT, _codestream_p, _codestream_n, T ),
-                         &tokenB );
-
-    thread_pool->wait( &tokenB );
-    TimeStamp T2;
-
+    {
+        StageCounters stage( "stitch" );
+        size_t bits = 8*IDAT.size();
+        for( int t=0; t<T; t++ ) {
+            if( hasStoredBlock( context.m_blocks[ t ] ) ) {
+                bits = alignBitstream( IDAT, bits );
+            }
+            bits = appendBitstream( IDAT, bits, context.m_stripe_output[ t ].data(), _bits[ t ] );
+            int a = (t*HEIGHT)/T;
+            int b = ((t+1)*HEIGHT)/T;
+            adler = combineAdler32( adler, _adler[ t ], (bpp*WIDTH+1)*(b-a) );
+        }
+    }
 
-    TimeStamp T4;
+    {
+        StageCounters stage( "crc32" );
+        IDAT.push_back( ((adler)>>24)&0xffu ); // Adler32
+        IDAT.push_back( ((adler)>>16)&0xffu );
+        IDAT.push_back( ((adler)>> 8)&0xffu );
+        IDAT.push_back( ((adler)>> 0)&0xffu );
+
+        // --- end deflate chunk ----------------------------------------------
+
+        // Update PNG chunk content size for IDAT
+        int dat_size = IDAT.size()-8u;
+        IDAT[0] = ((dat_size)>>24)&0xffu;
+        IDAT[1] = ((dat_size)>>16)&0xffu;
+        IDAT[2] = ((dat_size)>>8)&0xffu;
+        IDAT[3] = ((dat_size)>>0)&0xffu;
+
+        unsigned long crc = CRC( crc_table, IDAT.data()+4, dat_size+4 );
+        IDAT.resize( IDAT.size()+4u );  // make room for CRC
+        IDAT[dat_size+8]  = ((crc)>>24)&0xffu;
+        IDAT[dat_size+9]  = ((crc)>>16)&0xffu;
+        IDAT[dat_size+10] = ((crc)>>8)&0xffu;
+        IDAT[dat_size+11] = ((crc)>>0)&0xffu;
+    }
 
+    out.write( IDAT.data(), IDAT.size() );
+}
 
-    IDAT.push_back( ((adler)>>24)&0xffu ); // Adler32
-    IDAT.push_back( ((adler)>>16)&0xffu );
-    IDAT.push_back( ((adler)>> 8)&0xffu );
-    IDAT.push_back( ((adler)>> 0)&0xffu );
 
-    // --- end deflate chunk --------------------------------------------------
+/** Filtered bytes per stripe of the streaming writer, small enough to get
+ * the first IDAT out early and large enough that restarting the LZ window
+ * at stripe boundaries costs little.
+ */
+static const unsigned int stream_stripe_bytes = 256*1024;
 
-    // Update PNG chunk content size for IDAT
+void
+closeIDAT( std::vector<unsigned char>& IDAT )
+{
     int dat_size = IDAT.size()-8u;
     IDAT[0] = ((dat_size)>>24)&0xffu;
     IDAT[1] = ((dat_size)>>16)&0xffu;
@@ -984,98 +1140,168 @@ writeIDAT4MC( ThreadPool *thread_pool, std::ofstream& file, const std::vector<ch
     IDAT[3] = ((dat_size)>>0)&0xffu;
 
     unsigned long crc = CRC( crc_table, IDAT.data()+4, dat_size+4 );
-    IDAT.resize( IDAT.size()+4u );  // make room for CRC
-    IDAT[dat_size+8]  = ((crc)>>24)&0xffu;
-    IDAT[dat_size+9]  = ((crc)>>16)&0xffu;
-    IDAT[dat_size+10] = ((crc)>>8)&0xffu;
-    IDAT[dat_size+11] = ((crc)>>0)&0xffu;
-
-    TimeStamp T5;
-
-    file.write( reinterpret_cast<char*>( IDAT.data() ), IDAT.size() );
-
-    TimeStamp T6;
-
-#if 1
-    if( 1) {
-        std::vector<unsigned char> quux(10*1024*1024);
-
-        z_stream stream;
-        int err;
-
-        stream.next_in = (z_const Bytef *)IDAT.data()+8;
-        stream.avail_in = (uInt)IDAT.size()-8;
-        stream.next_out = quux.data();
-        stream.avail_out = quux.size();
-        stream.zalloc = (alloc_func)0;
-        stream.zfree = (free_func)0;
-
-        err = inflateInit(&stream);
-        if (err != Z_OK) {
-            std::cerr << "inflateInit failed: " << err << "\n";
-            abort();
-        }
+    IDAT.push_back( ((crc)>>24)&0xffu );
+    IDAT.push_back( ((crc)>>16)&0xffu );
+    IDAT.push_back( ((crc)>>8)&0xffu );
+    IDAT.push_back( ((crc)>>0)&0xffu );
+}
 
-        err = inflate(&stream, Z_FINISH);
+void
+openIDAT( std::vector<unsigned char>& IDAT )
+{
+    IDAT.assign( 8, 0 );
+    IDAT[4] = 'I';
+    IDAT[5] = 'D';
+    IDAT[6] = 'A';
+    IDAT[7] = 'T';
+}
 
-        if( stream.msg != NULL ) {
-            std::cerr << stream.msg << "\n";
+/** Waits for one stripe of writeIDAT4Stream, Huffman codes it onto the
+ * deflate stream in pusher and sends the bytes so far as an IDAT chunk.
+ * The last stripe closes the stream and appends the Adler-32. The code
+ * count and Adler-32 of the stripe are read once its job is done.
+ */
+static
+void
+sendStreamStripe( ThreadPool *thread_pool,
+                  OutputSink& out,
+                  std::vector<unsigned char>& IDAT,
+                  BitPusher& pusher,
+                  CompletionToken& token,
+                  const unsigned int* codestream,
+                  const unsigned int& codestream_n,
+                  const unsigned int& stripe_adler,
+                  unsigned int stripe_bytes,
+                  unsigned int& adler,
+                  bool last )
+{
+    {
+        StageCounters stage( "filter+LZenc" );
+        thread_pool->wait( &token );
+    }
+    {
+        StageCounters stage( "huffenc" );
+        encodeFixedHuffman( pusher, codestream, codestream_n );
+        adler = combineAdler32( adler, stripe_adler, stripe_bytes );
+        if( last ) {
+            endFixedHuffman( pusher );
+            pusher.flush();
+            IDAT.push_back( ((adler)>>24)&0xffu ); // Adler32
+            IDAT.push_back( ((adler)>>16)&0xffu );
+            IDAT.push_back( ((adler)>> 8)&0xffu );
+            IDAT.push_back( ((adler)>> 0)&0xffu );
         }
+    }
+    {
+        StageCounters stage( "crc32" );
+        closeIDAT( IDAT );
+    }
+    {
+        StageCounters stage( "io" );
+        out.write( IDAT.data(), IDAT.size() );
+        out.flush();
+    }
+    openIDAT( IDAT );
+}
 
+/** Like writeIDAT4MC, but emits one IDAT chunk per stripe.
+ *
+ * All stripes are queued at once. The calling thread takes them in order,
+ * Huffman codes each onto a single deflate stream, and sends the whole
+ * bytes produced so far as an IDAT chunk with a flush of the sink while
+ * the pool is still working on later stripes. Bits of a partial byte carry
+ * over to the next chunk, and the per-stripe Adler-32 values are combined
+ * and appended to the last one.
+ */
+void
+writeIDAT4Stream( ThreadPool *thread_pool, OutputSink& out, EncoderContext& context, const ImageBuffer& img, const std::vector<unsigned long>& crc_table, int WIDTH, int HEIGHT  )
+{
+    unsigned int bpp = pixelBytes( img.format() );
+    unsigned int row_size = bpp*WIDTH+1;
+    unsigned int filtered_size = row_size*HEIGHT;
+    int S = std::max( thread_pool->workers()+1,
+                      (int)( (filtered_size + stream_stripe_bytes - 1)/stream_stripe_bytes ) );
+    S = std::max( 1, std::min( S, HEIGHT ) );
+
+    unsigned char* filtered = (unsigned char*)context.m_scratch.get( SCRATCH_FILTERED, sizeof(unsigned char)*filtered_size );
+    unsigned int* codestream = (unsigned int*)context.m_scratch.get( SCRATCH_CODESTREAM, sizeof(unsigned int)*filtered_size );
+    std::vector<unsigned char>& IDAT = context.m_IDAT;
+    if( (int)context.m_workers.size() < S ) {
+        context.m_workers.resize( S, NULL );
+    }
 
-        uLongf quux_size = quux.size();
-        err = uncompress( quux.data(), &quux_size, IDAT.data() + 8, IDAT.size() - 8 );
-        if( err != Z_OK ) {
-            std::cerr << "uncompress="
-                      << err
-                      << "\n";
-        }
-        if( quux_size != ((3*WIDTH+1)*HEIGHT) ) {
-            std::cerr << "uncompress_size="  << quux_size
-                      << ", should be=" << ((3*WIDTH+1)*HEIGHT) << "\n";
-        }
-
+    std::vector<CompletionToken> tokens( S );
+    std::vector<unsigned int> stripe_a( S+1 );
+    std::vector<unsigned int> stripe_n( S );
+    std::vector<unsigned int> stripe_adler( S );
+    for( int s=0; s<=S; s++ ) {
+        stripe_a[s] = ((long long)s*HEIGHT)/S;
+    }
+    for( int s=0; s<S; s++ ) {
+        unsigned int a = stripe_a[s];
+        thread_pool->addJob( reuseJob( context.m_workers[s],
+                                       IDAT4Worker( codestream + row_size*a,
+                                                    &stripe_n[s],
+                                                    filtered + row_size*a,
+                                                    (unsigned char*)(img.data()) + bpp*WIDTH*a,
+                                                    WIDTH, stripe_a[s+1]-a, img.format(), LZ_DEFAULT_LEVEL, s,
+                                                    &stripe_adler[s] ) ),
+                             &tokens[s] );
     }
-#endif
 
-    std::cerr << "filter+LZenc=" << TimeStamp::delta( T0, T1 )
-              << ", adler32+huffenc=" << TimeStamp::delta( T1, T2 )
-              << ", crc32=" << TimeStamp::delta( T4, T5 )
-              << ", io=" << TimeStamp::delta( T5, T6 )
-              << ", total=" << TimeStamp::delta( T0, T6 );
+    unsigned int adler = 1;
+    openIDAT( IDAT );
+    BitPusher pusher( IDAT );
+    beginFixedHuffman( pusher );
+    {
+        StageCounters stage( "first-idat" );
+        sendStreamStripe( thread_pool, out, IDAT, pusher, tokens[0],
+                          codestream, stripe_n[0], stripe_adler[0],
+                          row_size*stripe_a[1], adler, S == 1 );
+    }
+    for( int s=1; s<S; s++ ) {
+        sendStreamStripe( thread_pool, out, IDAT, pusher, tokens[s],
+                          codestream + row_size*stripe_a[s], stripe_n[s], stripe_adler[s],
+                          row_size*(stripe_a[s+1]-stripe_a[s]), adler, s+1 == S );
+    }
+    IDAT.clear();
 }
 
 
-
 void
-writeIDAT4( ThreadPool *thread_pool, std::ofstream& file, const std::vector<char>& img, const std::vector<unsigned long>& crc_table, int WIDTH, int HEIGHT  )
+writeIDAT4( ThreadPool *thread_pool, OutputSink& out, EncoderContext& context, const ImageBuffer& img, const std::vector<unsigned long>& crc_table, int WIDTH, int HEIGHT, int level )
 {
-    int T = (thread_pool->workers()+1);
-
-
-    TimeStamp T0;
     unsigned int adler;
-    unsigned int filtered_size = (3*WIDTH+1)*HEIGHT;
-    unsigned char* filtered = (unsigned char*)malloc( sizeof(unsigned char)*filtered_size );
-    unsigned int* codestream = (unsigned int*)malloc(sizeof(unsigned int)*filtered_size );
-
-    filterScanlines( filtered, (unsigned char*)(img.data()), WIDTH, HEIGHT );
-
+    unsigned int filtered_size = (pixelBytes( img.format() )*WIDTH+1)*HEIGHT;
+    unsigned char* filtered = (unsigned char*)context.m_scratch.get( SCRATCH_FILTERED, sizeof(unsigned char)*filtered_size );
+    unsigned int* codestream = (unsigned int*)context.m_scratch.get( SCRATCH_CODESTREAM, sizeof(unsigned int)*filtered_size );
+    std::vector<unsigned char>& IDAT = context.m_IDAT;
 
-    TimeStamp T1;
-    //adler = computeAdler32( filtered.data(), filtered.size() );
-    //adler = computeAdler32Blocked( filtered.data(), filtered.size() );
-    adler = computeAdler32SSE( filtered, filtered_size );
+    {
+        StageCounters stage( "filter" );
+        filterScanlines( filtered, (unsigned char*)(img.data()), WIDTH, HEIGHT, img.format() );
+    }
 
-    TimeStamp T2;
-    
+    {
+        StageCounters stage( "adler32" );
+        //adler = computeAdler32( filtered.data(), filtered.size() );
+        //adler = computeAdler32Blocked( filtered.data(), filtered.size() );
+        adler = computeAdler32SSE( filtered, filtered_size );
+    }
 
     // --- Find string duplicates and create code stream -----------------------
-    unsigned int M = encodeLZ( codestream, filtered, filtered_size );
-    TimeStamp T3;
+    unsigned int M;
+    if( context.m_blocks.empty() ) {
+        context.m_blocks.resize( 1 );
+    }
+    {
+        StageCounters stage( "LZenc" );
+        M = encodeLZBlocks( codestream, context.m_blocks[0], filtered, filtered_size, level );
+    }
 
-    // --- Encode using fixed Huffman codes ------------------------------------
-    std::vector<unsigned char> IDAT(8);
+    // --- Encode as stored, fixed or dynamic Huffman blocks -------------------
+    reserveIDAT( IDAT, filtered_size );
+    IDAT.assign( 8, 0 );
     // IDAT chunk header
     IDAT[4] = 'I';
     IDAT[5] = 'D';
@@ -1083,173 +1309,237 @@ writeIDAT4( ThreadPool *thread_pool, std::ofstream& file, const std::vector<char
     IDAT[7] = 'T';
 
     // --- create deflate chunk ------------------------------------------------
-
-    unsigned int* code_stream_p[1] = { codestream };
-    unsigned int  code_stream_N[1] = { M /*codestream.size()*/ };
-    encodeHuffman( IDAT, code_stream_p, code_stream_N, 1 );
-
-    TimeStamp T4;
-
-    
-    IDAT.push_back( ((adler)>>24)&0xffu ); // Adler32
-    IDAT.push_back( ((adler)>>16)&0xffu );
-    IDAT.push_back( ((adler)>> 8)&0xffu );
-    IDAT.push_back( ((adler)>> 0)&0xffu );
-
-    // --- end deflate chunk --------------------------------------------------
-
-    // Update PNG chunk content size for IDAT
-    int dat_size = IDAT.size()-8u;
-    IDAT[0] = ((dat_size)>>24)&0xffu;
-    IDAT[1] = ((dat_size)>>16)&0xffu;
-    IDAT[2] = ((dat_size)>>8)&0xffu;
-    IDAT[3] = ((dat_size)>>0)&0xffu;
-
-    unsigned long crc = CRC( crc_table, IDAT.data()+4, dat_size+4 );
-    IDAT.resize( IDAT.size()+4u );  // make room for CRC
-    IDAT[dat_size+8]  = ((crc)>>24)&0xffu;
-    IDAT[dat_size+9]  = ((crc)>>16)&0xffu;
-    IDAT[dat_size+10] = ((crc)>>8)&0xffu;
-    IDAT[dat_size+11] = ((crc)>>0)&0xffu;
-
-    TimeStamp T5;
-
-    file.write( reinterpret_cast<char*>( IDAT.data() ), IDAT.size() );
-
-    TimeStamp T6;
-
-#if 1
-    if( 1) {
-        std::vector<unsigned char> quux(10*1024*1024);
-
-        z_stream stream;
-        int err;
-    
-        stream.next_in = (z_const Bytef *)IDAT.data()+8;
-        stream.avail_in = (uInt)IDAT.size()-8;
-        stream.next_out = quux.data();
-        stream.avail_out = quux.size();
-        stream.zalloc = (alloc_func)0;
-        stream.zfree = (free_func)0;
-
-        err = inflateInit(&stream);
-        if (err != Z_OK) {
-            std::cerr << "inflateInit failed: " << err << "\n";
-            abort();
-        }
-       
-        err = inflate(&stream, Z_FINISH);
-
-        if( stream.msg != NULL ) {
-            std::cerr << stream.msg << "\n";
-        }
-        
-
-        uLongf quux_size = quux.size();
-        err = uncompress( quux.data(), &quux_size, IDAT.data() + 8, IDAT.size() - 8 );
-        if( err != Z_OK ) {
-            std::cerr << "uncompress="
-                      << err
-                      << "\n";
-        }
-        if( quux_size != ((3*WIDTH+1)*HEIGHT) ) {
-            std::cerr << "uncompress_size="  << quux_size
-                      << ", should be=" << ((3*WIDTH+1)*HEIGHT) << "\n";
-        }
-        
+    {
+        StageCounters stage( "huffenc" );
+        unsigned int* code_stream_p[1] = { codestream };
+        unsigned int  code_stream_N[1] = { M /*codestream.size()*/ };
+        const unsigned char* data_p[1] = { filtered };
+        encodeHuffman( IDAT, code_stream_p, code_stream_N, data_p, 1, &context.m_blocks[0] );
     }
-#endif
 
-    std::cerr << "filter=" << TimeStamp::delta( T0, T1 )
-              << ", adler32=" << TimeStamp::delta( T1, T2 )
-              << ", LZenc=" << TimeStamp::delta( T2, T3 )
-              << ", huffenc=" << TimeStamp::delta( T3, T4 )
-              << ", crc32=" << TimeStamp::delta( T4, T5 )
-              << ", io=" << TimeStamp::delta( T5, T6 )
-              << ", total=" << TimeStamp::delta( T0, T6 );
+    {
+        StageCounters stage( "crc32" );
+        IDAT.push_back( ((adler)>>24)&0xffu ); // Adler32
+        IDAT.push_back( ((adler)>>16)&0xffu );
+        IDAT.push_back( ((adler)>> 8)&0xffu );
+        IDAT.push_back( ((adler)>> 0)&0xffu );
+
+        // --- end deflate chunk ----------------------------------------------
+
+        // Update PNG chunk content size for IDAT
+        int dat_size = IDAT.size()-8u;
+        IDAT[0] = ((dat_size)>>24)&0xffu;
+        IDAT[1] = ((dat_size)>>16)&0xffu;
+        IDAT[2] = ((dat_size)>>8)&0xffu;
+        IDAT[3] = ((dat_size)>>0)&0xffu;
+
+        unsigned long crc = CRC( crc_table, IDAT.data()+4, dat_size+4 );
+        IDAT.resize( IDAT.size()+4u );  // make room for CRC
+        IDAT[dat_size+8]  = ((crc)>>24)&0xffu;
+        IDAT[dat_size+9]  = ((crc)>>16)&0xffu;
+        IDAT[dat_size+10] = ((crc)>>8)&0xffu;
+        IDAT[dat_size+11] = ((crc)>>0)&0xffu;
+    }
 
+    out.write( IDAT.data(), IDAT.size() );
 }
 
 
 
 
 void
-writeIEND( std::ofstream& file, const std::vector<unsigned long>& crc_table  )
+writeIEND( OutputSink& out, const std::vector<unsigned long>& crc_table  )
 {
-    unsigned char IEND[12] = {
+    static const unsigned char IEND[12] = {
         0, 0, 0, 0,         // payload size
         'I', 'E', 'N', 'D', // chunk id
         174, 66, 96, 130    // chunk crc
     };
-    file.write( reinterpret_cast<char*>( IEND ), 12 );
+    out.write( IEND, 12 );
  }
 
 
 
 
+void
+writePNGHeader( OutputSink& out, unsigned char* IHDR, int w, int h, PixelFormat format )
+{
+    writeSignature( out );
+    writeIHDR( out, IHDR, crc_table, w, h, format );
+}
+
+void
+writePNGTrailer( OutputSink& out )
+{
+    writeIEND( out, crc_table );
+}
+
 int
-homebrew_png2( const std::vector<char> &rgb,
+homebrew_png2( const ImageBuffer& rgb,
               const int w,
-              const int h )
+              const int h,
+              OutputSink& out )
 {
-    std::ofstream png( "homebrew2.png" );
-    writeSignature( png );
-    writeIHDR( png, crc_table, w, h );
-    writeIDAT2( png, rgb, crc_table, w, h );
-    writeIEND( png, crc_table );
-
-    int bytes = png.tellp();
-    png.close();
-    
-    return bytes;
+    size_t start = out.bytes();
+    unsigned char IHDR[25];
+    std::vector<unsigned char> IDAT;
+    writeSignature( out );
+    writeIHDR( out, IHDR, crc_table, w, h, rgb.format() );
+    IDAT2Visitor visitor = { out, IDAT, rgb, crc_table, w, h };
+    visitPixelFormat( rgb.format(), visitor );
+    writeIEND( out, crc_table );
+    out.flush();
+    return out.bytes() - start;
 }
 
 int
-homebrew_png3( const std::vector<char> &rgb,
+homebrew_png3( const ImageBuffer& rgb,
               const int w,
-              const int h )
+              const int h,
+              OutputSink& out )
 {
-    std::ofstream png( "homebrew3.png" );
-    writeSignature( png );
-    writeIHDR( png, crc_table, w, h );
-    writeIDAT3( png, rgb, crc_table, w, h );
-    writeIEND( png, crc_table );
-
-    int bytes = png.tellp();
-    png.close();
-    
-    return bytes;
+    size_t start = out.bytes();
+    unsigned char IHDR[25];
+    std::vector<unsigned char> IDAT;
+    writeSignature( out );
+    writeIHDR( out, IHDR, crc_table, w, h, rgb.format() );
+    IDAT3Visitor visitor = { out, IDAT, rgb, crc_table, w, h };
+    visitPixelFormat( rgb.format(), visitor );
+    writeIEND( out, crc_table );
+    out.flush();
+    return out.bytes() - start;
 }
 
 int
-homebrew_png4(ThreadPool *thread_pool, const std::vector<char> &rgb,
-              const int w,
-              const int h )
+homebrew_png4( ThreadPool *thread_pool,
+               const ImageBuffer& rgb,
+               const int w,
+               const int h,
+               OutputSink& out,
+               EncoderContext& context,
+               int level )
+{
+    size_t start = out.bytes();
+    unsigned char IHDR[25];
+    writeSignature( out );
+    writeIHDR( out, IHDR, crc_table, w, h, rgb.format() );
+    writeIDAT4( thread_pool, out, context, rgb, crc_table, w, h, level );
+    writeIEND( out, crc_table );
+    {
+        StageCounters stage( "io" );
+        out.flush();
+    }
+    return out.bytes() - start;
+}
+
+int
+homebrew_png4( ThreadPool *thread_pool,
+               const ImageBuffer& rgb,
+               const int w,
+               const int h,
+               OutputSink& out )
+{
+    return homebrew_png4( thread_pool, rgb, w, h, out, homebrewContext() );
+}
+int
+homebrew_png4_mc( ThreadPool *thread_pool,
+                  const ImageBuffer& rgb,
+                  const int w,
+                  const int h,
+                  OutputSink& out,
+                  EncoderContext& context,
+                  int level )
 {
-    std::ofstream png( "homebrew4.png" );
-    writeSignature( png );
-    writeIHDR( png, crc_table, w, h );
-    writeIDAT4( thread_pool, png, rgb, crc_table, w, h );
-    writeIEND( png, crc_table );
+    size_t start = out.bytes();
+    unsigned char IHDR[25];
+    writeSignature( out );
+    writeIHDR( out, IHDR, crc_table, w, h, rgb.format() );
+    writeIDAT4MC( thread_pool, out, context, rgb, crc_table, w, h, level );
+    writeIEND( out, crc_table );
+    {
+        StageCounters stage( "io" );
+        out.flush();
+    }
+    return out.bytes() - start;
+}
+
+int
+homebrew_png4_mc( ThreadPool *thread_pool,
+                  const ImageBuffer& rgb,
+                  const int w,
+                  const int h,
+                  OutputSink& out )
+{
+    return homebrew_png4_mc( thread_pool, rgb, w, h, out, homebrewContext() );
+}
 
-    int bytes = png.tellp();
-    png.close();
+int
+homebrew_png4_stream( ThreadPool *thread_pool,
+                      const ImageBuffer& rgb,
+                      const int w,
+                      const int h,
+                      OutputSink& out )
+{
+    size_t start = out.bytes();
+    unsigned char IHDR[25];
+    writeSignature( out );
+    writeIHDR( out, IHDR, crc_table, w, h, rgb.format() );
+    out.flush();
+    writeIDAT4Stream( thread_pool, out, homebrewContext(), rgb, crc_table, w, h );
+    writeIEND( out, crc_table );
+    {
+        StageCounters stage( "io" );
+        out.flush();
+    }
+    return out.bytes() - start;
+}
 
-    return bytes;
+static
+int
+homebrew_png2_encoder( ThreadPool* thread_pool,
+                       const ImageBuffer& rgb,
+                       const int w,
+                       const int h,
+                       OutputSink& out )
+{
+    return homebrew_png2( rgb, w, h, out );
 }
+
+static
 int
-homebrew_png4_mc(ThreadPool *thread_pool, const std::vector<char> &rgb,
-              const int w,
-              const int h )
+homebrew_png3_encoder( ThreadPool* thread_pool,
+                       const ImageBuffer& rgb,
+                       const int w,
+                       const int h,
+                       OutputSink& out )
 {
-    std::ofstream png( "homebrew4.png" );
-    writeSignature( png );
-    writeIHDR( png, crc_table, w, h );
-    writeIDAT4MC( thread_pool, png, rgb, crc_table, w, h );
-    writeIEND( png, crc_table );
+    return homebrew_png3( rgb, w, h, out );
+}
 
-    int bytes = png.tellp();
-    png.close();
+static EncoderRegistrar homebrew2_registrar( "homebrew2", homebrew_png2_encoder, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar homebrew3_registrar( "homebrew3", homebrew_png3_encoder, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar homebrew4_registrar( "homebrew4", homebrew_png4, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar homebrew4_stream_registrar( "homebrew4_stream", homebrew_png4_stream, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar homebrew4_mc_registrar( "homebrew4_mc", homebrew_png4_mc, ".png", false, PIXEL_FORMATS_PNG );
 
-    return bytes;
+template<int level>
+static
+int
+homebrew_png4_mc_level( ThreadPool* thread_pool,
+                        const ImageBuffer& rgb,
+                        const int w,
+                        const int h,
+                        OutputSink& out )
+{
+    return homebrew_png4_mc( thread_pool, rgb, w, h, out, homebrewContext(), level );
 }
+
+static EncoderRegistrar homebrew4_mc1_registrar( "homebrew4_mc1", homebrew_png4_mc_level<1>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar homebrew4_mc2_registrar( "homebrew4_mc2", homebrew_png4_mc_level<2>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar homebrew4_mc3_registrar( "homebrew4_mc3", homebrew_png4_mc_level<3>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar homebrew4_mc4_registrar( "homebrew4_mc4", homebrew_png4_mc_level<4>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar homebrew4_mc5_registrar( "homebrew4_mc5", homebrew_png4_mc_level<5>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar homebrew4_mc6_registrar( "homebrew4_mc6", homebrew_png4_mc_level<6>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar homebrew4_mc7_registrar( "homebrew4_mc7", homebrew_png4_mc_level<7>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar homebrew4_mc8_registrar( "homebrew4_mc8", homebrew_png4_mc_level<8>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar homebrew4_mc9_registrar( "homebrew4_mc9", homebrew_png4_mc_level<9>, ".png", false, PIXEL_FORMATS_PNG );
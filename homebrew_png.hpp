@@ -1,27 +1,127 @@
 #pragma once
+#include <vector>
 #include "ThreadPool.hpp"
+#include "ImageBuffer.hpp"
+#include "OutputSink.hpp"
+#include "ScratchArena.hpp"
+#include "LZEncoder.hpp"
+
+class IDAT4Worker;
+class HuffCodeJob;
+
+/** Buffers and job objects of the homebrew4 encoders, kept across frames.
+ *
+ * Scratch buffers only grow when the frame size increases and job objects
+ * are reused, so a stream of equally sized frames is encoded without heap
+ * traffic after the first one. One context serves one encode at a time.
+ */
+struct EncoderContext
+{
+    explicit
+    EncoderContext( bool huge_pages = false );
+
+    ~EncoderContext();
+
+    ScratchArena                              m_scratch;       ///< Filtered data and code streams.
+    std::vector<unsigned char>                m_IDAT;
+    std::vector<IDAT4Worker*>                 m_workers;       ///< One per stripe of writeIDAT4MC and writeIDAT4Stream.
+    std::vector<HuffCodeJob*>                 m_huff_jobs;     ///< One per stripe of writeIDAT4MC.
+    std::vector< std::vector<DeflateBlock> >  m_blocks;        ///< Deflate blocks of each stripe.
+    std::vector< std::vector<unsigned char> > m_stripe_output; ///< Huffman coded bytes of each stripe.
+
+private:
+    EncoderContext( const EncoderContext& );
+
+    EncoderContext&
+    operator=( const EncoderContext& );
+};
+
+/** Context used by the registered homebrew4 and homebrew4_mc encoders. */
+EncoderContext&
+homebrewContext();
 
 void
 createCRCTable( );
 
+/** PNG chunk CRC using the table built by createCRCTable(). */
+unsigned long
+homebrewCRC( const unsigned char* p, size_t length );
+
+/** Writes the PNG signature and an IHDR chunk for the given format, built in
+ * the 25 bytes at IHDR, which must stay alive until the sink is flushed.
+ */
+void
+writePNGHeader( OutputSink& out, unsigned char* IHDR, int w, int h, PixelFormat format = PIXEL_RGB8 );
+
+/** Writes the IEND chunk. */
+void
+writePNGTrailer( OutputSink& out );
+
+/** Starts an IDAT chunk with room for the length field. */
+void
+openIDAT( std::vector<unsigned char>& IDAT );
+
+/** Fills in length of an IDAT chunk started with openIDAT and appends its CRC. */
+void
+closeIDAT( std::vector<unsigned char>& IDAT );
+
 int
-homebrew_png2( const std::vector<char> &rgb,
+homebrew_png2( const ImageBuffer& rgb,
               const int w,
-              const int h );
+              const int h,
+              OutputSink& out );
 
 int
-homebrew_png3( const std::vector<char> &rgb,
+homebrew_png3( const ImageBuffer& rgb,
               const int w,
-              const int h );
+              const int h,
+              OutputSink& out );
 
 int
 homebrew_png4( ThreadPool* thread_pool,
-               const std::vector<char> &rgb,
-              const int w,
-              const int h );
+               const ImageBuffer& rgb,
+               const int w,
+               const int h,
+               OutputSink& out );
 
 int
 homebrew_png4_mc( ThreadPool* thread_pool,
-                  const std::vector<char> &rgb,
+                  const ImageBuffer& rgb,
                   const int w,
-                  const int h );
+                  const int h,
+                  OutputSink& out );
+
+/** homebrew_png4 with buffers taken from the given context and the given
+ * LZ effort level, see lzParams().
+ */
+int
+homebrew_png4( ThreadPool* thread_pool,
+               const ImageBuffer& rgb,
+               const int w,
+               const int h,
+               OutputSink& out,
+               EncoderContext& context,
+               int level = LZ_DEFAULT_LEVEL );
+
+/** homebrew_png4_mc with buffers and jobs taken from the given context and
+ * the given LZ effort level. The encoders homebrew4_mc1 to homebrew4_mc9 are
+ * registered for levels 1 to 9.
+ */
+int
+homebrew_png4_mc( ThreadPool* thread_pool,
+                  const ImageBuffer& rgb,
+                  const int w,
+                  const int h,
+                  OutputSink& out,
+                  EncoderContext& context,
+                  int level = LZ_DEFAULT_LEVEL );
+
+/** homebrew4_mc variant that sends each stripe as its own IDAT chunk as soon
+ * as it is compressed, see writeIDAT4Stream.
+ */
+int
+homebrew_png4_stream( ThreadPool* thread_pool,
+                      const ImageBuffer& rgb,
+                      const int w,
+                      const int h,
+                      OutputSink& out );
@@ -0,0 +1,426 @@
+#include <zlib.h>
+#include <x86intrin.h>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include "timer.hpp"
+#include "Adler32.hpp"
+#include "ScanlineFilter.hpp"
+#include "LZEncoder.hpp"
+#include "BitPusher.hpp"
+#include "tinia_png.hpp"
+#include "homebrew_png.hpp"
+
+// Microbenchmarks of the individual kernels of the encoders. Every variant is
+// checked against a scalar reference on the same input before it is timed.
+
+namespace {
+
+const size_t padding = 64;  // SIMD kernels may read up to 15 bytes past the end.
+
+struct Workspace
+{
+    unsigned char*              m_in;
+    size_t                      m_n;
+    unsigned char*              m_out;
+    size_t                      m_out_n;
+    unsigned long long          m_result;
+    std::vector<unsigned char>  m_bits;
+};
+
+typedef void (*KernelFunc)( Workspace& ws );
+
+struct Variant
+{
+    const char* m_name;
+    KernelFunc  m_func;
+};
+
+struct KernelGroup
+{
+    const char*             m_name;
+    KernelFunc              m_reference;
+    std::vector<Variant>    m_variants;
+};
+
+// --- Adler32 -----------------------------------------------------------------
+
+void adlerScalar( Workspace& ws )   { ws.m_result = computeAdler32( ws.m_in, ws.m_n ); }
+void adlerBlocked( Workspace& ws )  { ws.m_result = computeAdler32Blocked( ws.m_in, ws.m_n ); }
+void adlerSSE( Workspace& ws )      { ws.m_result = computeAdler32SSE( ws.m_in, ws.m_n ); }
+void adlerZlib( Workspace& ws )     { ws.m_result = adler32( 1, ws.m_in, ws.m_n ); }
+
+// --- Scanline filters --------------------------------------------------------
+
+void
+filterGeometry( unsigned int& width, unsigned int& height, size_t n )
+{
+    // 1000 pixel wide scanlines keep the SSE filter's partial-block tail busy.
+    width = std::max<size_t>( 1, std::min<size_t>( 1000, n/3 ) );
+    height = std::max<size_t>( 1, n/(3*width) );
+}
+
+void
+filterSubReference( Workspace& ws )
+{
+    unsigned int W, H;
+    filterGeometry( W, H, ws.m_n );
+    for( unsigned int j=0; j<H; j++ ) {
+        const unsigned char* in = ws.m_in + 3*W*j;
+        unsigned char* out = ws.m_out + (3*W+1)*j;
+        out[0] = 1;
+        for( unsigned int i=0; i<3*W; i++ ) {
+            out[i+1] = in[i] - (i >= 3 ? in[i-3] : 0);
+        }
+    }
+    ws.m_out_n = (3*W+1)*H;
+}
+
+void
+filterSub( Workspace& ws )
+{
+    unsigned int W, H;
+    filterGeometry( W, H, ws.m_n );
+    filterScanlines( ws.m_out, ws.m_in, W, H );
+    ws.m_out_n = (3*W+1)*H;
+}
+
+void
+filterUpReference( Workspace& ws )
+{
+    unsigned int W, H;
+    filterGeometry( W, H, ws.m_n );
+    for( unsigned int j=0; j<H; j++ ) {
+        const unsigned char* in = ws.m_in + 3*W*j;
+        const unsigned char* up = in - 3*W;
+        unsigned char* out = ws.m_out + (3*W+1)*j;
+        out[0] = j == 0 ? 0 : 2;
+        for( unsigned int i=0; i<3*W; i++ ) {
+            out[i+1] = in[i] - (j > 0 ? up[i] : 0);
+        }
+    }
+    ws.m_out_n = (3*W+1)*H;
+}
+
+void
+filterUpSSE( Workspace& ws )
+{
+    unsigned int W, H;
+    filterGeometry( W, H, ws.m_n );
+    filterScanlinesSSE( ws.m_out, ws.m_in, W, H );
+    ws.m_out_n = (3*W+1)*H;
+}
+
+// --- lengthOfMatch -----------------------------------------------------------
+
+template<int (*match)( const unsigned char*, const unsigned char*, const int )>
+void
+matchLengths( Workspace& ws )
+{
+    // Probe every position against a couple of fixed distances.
+    const int distances[4] = { 1, 3, 97, 3001 };
+    unsigned long long sum = 0;
+    for( size_t i=0; i<ws.m_n; i++ ) {
+        int d = distances[ i&3 ];
+        if( (size_t)d <= i ) {
+            int N = std::min<size_t>( 258, ws.m_n - i );
+            sum += match( ws.m_in + i - d, ws.m_in + i, N );
+        }
+    }
+    ws.m_result = sum;
+}
+
+// --- CRC ---------------------------------------------------------------------
+
+void crcZlib( Workspace& ws )       { ws.m_result = crc32( 0, ws.m_in, ws.m_n ); }
+void crcTinia( Workspace& ws )      { ws.m_result = trell_png_crc( ws.m_in, ws.m_n ); }
+void crcHomebrew( Workspace& ws )   { ws.m_result = homebrewCRC( ws.m_in, ws.m_n ); }
+
+// --- BitPusher ---------------------------------------------------------------
+
+void
+bitCode( unsigned long long& bits, unsigned int& count, const unsigned char* p )
+{
+    count = 1 + (p[0]&0xfu);
+    bits = ((p[0]<<8u) | p[1]) & ((1u<<count)-1u);
+}
+
+void
+pushReference( Workspace& ws, bool reverse )
+{
+    ws.m_bits.clear();
+    unsigned int pending = 0;
+    unsigned int pending_n = 0;
+    for( size_t i=0; i+1<ws.m_n; i+=2 ) {
+        unsigned long long bits;
+        unsigned int count;
+        bitCode( bits, count, ws.m_in + i );
+        for( unsigned int k=0; k<count; k++ ) {
+            unsigned int bit = reverse ? (bits>>(count-1-k))&1u : (bits>>k)&1u;
+            pending |= bit << pending_n;
+            if( ++pending_n == 8 ) {
+                ws.m_bits.push_back( pending );
+                pending = 0;
+                pending_n = 0;
+            }
+        }
+    }
+    if( pending_n ) {
+        ws.m_bits.push_back( pending );
+    }
+}
+
+void pushBitsReference( Workspace& ws )         { pushReference( ws, false ); }
+void pushBitsReverseReference( Workspace& ws )  { pushReference( ws, true ); }
+
+void
+pushBits( Workspace& ws )
+{
+    ws.m_bits.clear();
+    BitPusher pusher( ws.m_bits );
+    for( size_t i=0; i+1<ws.m_n; i+=2 ) {
+        unsigned long long bits;
+        unsigned int count;
+        bitCode( bits, count, ws.m_in + i );
+        pusher.pushBits( bits, count );
+    }
+}
+
+void
+pushBitsReverse( Workspace& ws )
+{
+    ws.m_bits.clear();
+    BitPusher pusher( ws.m_bits );
+    for( size_t i=0; i+1<ws.m_n; i+=2 ) {
+        unsigned long long bits;
+        unsigned int count;
+        bitCode( bits, count, ws.m_in + i );
+        pusher.pushBitsReverse( bits, count );
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+std::vector<KernelGroup>
+kernelGroups()
+{
+    std::vector<KernelGroup> groups;
+    KernelGroup g;
+
+    g.m_name = "adler32";
+    g.m_reference = adlerScalar;
+    g.m_variants.clear();
+    g.m_variants.push_back( Variant{ "computeAdler32", adlerScalar } );
+    g.m_variants.push_back( Variant{ "computeAdler32Blocked", adlerBlocked } );
+    g.m_variants.push_back( Variant{ "computeAdler32SSE", adlerSSE } );
+    g.m_variants.push_back( Variant{ "zlib adler32", adlerZlib } );
+    groups.push_back( g );
+
+    g.m_name = "filter_sub";
+    g.m_reference = filterSubReference;
+    g.m_variants.clear();
+    g.m_variants.push_back( Variant{ "filterScanlines", filterSub } );
+    groups.push_back( g );
+
+    g.m_name = "filter_up";
+    g.m_reference = filterUpReference;
+    g.m_variants.clear();
+    g.m_variants.push_back( Variant{ "filterScanlinesSSE", filterUpSSE } );
+    groups.push_back( g );
+
+    g.m_name = "match";
+    g.m_reference = matchLengths<lengthOfMatchScalar>;
+    g.m_variants.clear();
+    g.m_variants.push_back( Variant{ "lengthOfMatchScalar", matchLengths<lengthOfMatchScalar> } );
+    g.m_variants.push_back( Variant{ "lengthOfMatch", matchLengths<lengthOfMatch> } );
+    groups.push_back( g );
+
+    g.m_name = "crc";
+    g.m_reference = crcZlib;
+    g.m_variants.clear();
+    g.m_variants.push_back( Variant{ "zlib crc32", crcZlib } );
+    g.m_variants.push_back( Variant{ "trell_png_crc", crcTinia } );
+    g.m_variants.push_back( Variant{ "homebrewCRC", crcHomebrew } );
+    groups.push_back( g );
+
+    g.m_name = "bitpusher";
+    g.m_reference = pushBitsReference;
+    g.m_variants.clear();
+    g.m_variants.push_back( Variant{ "pushBits", pushBits } );
+    groups.push_back( g );
+
+    g.m_name = "bitpusher_reverse";
+    g.m_reference = pushBitsReverseReference;
+    g.m_variants.clear();
+    g.m_variants.push_back( Variant{ "pushBitsReverse", pushBitsReverse } );
+    groups.push_back( g );
+
+    return groups;
+}
+
+bool
+sameOutput( const Workspace& a, const Workspace& b )
+{
+    return a.m_result == b.m_result &&
+           a.m_out_n == b.m_out_n &&
+           memcmp( a.m_out, b.m_out, a.m_out_n ) == 0 &&
+           a.m_bits == b.m_bits;
+}
+
+/** Best time per call in seconds and TSC cycles, over batches of at least 1 ms. */
+void
+timeKernel( double& seconds, double& cycles, KernelFunc func, Workspace& ws )
+{
+    int iterations = 1;
+    for(;;) {
+        TimeStamp start;
+        for( int i=0; i<iterations; i++ ) {
+            func( ws );
+        }
+        TimeStamp stop;
+        if( TimeStamp::delta( start, stop ) > 1e-3 || iterations >= (1<<20) ) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    seconds = 1e30;
+    cycles = 1e30;
+    for( int r=0; r<5; r++ ) {
+        unsigned long long c0 = __rdtsc();
+        TimeStamp start;
+        for( int i=0; i<iterations; i++ ) {
+            func( ws );
+        }
+        TimeStamp stop;
+        unsigned long long c1 = __rdtsc();
+        seconds = std::min( seconds, TimeStamp::delta( start, stop )/iterations );
+        cycles = std::min( cycles, (double)(c1-c0)/iterations );
+    }
+}
+
+std::vector<size_t>
+parseSizes( const std::string& list )
+{
+    std::vector<size_t> values;
+    size_t a = 0;
+    while( a < list.size() ) {
+        size_t b = list.find( ',', a );
+        if( b == std::string::npos ) {
+            b = list.size();
+        }
+        values.push_back( strtoull( list.substr( a, b-a ).c_str(), NULL, 0 ) );
+        a = b + 1;
+    }
+    return values;
+}
+
+} // of anonymous namespace
+
+int
+main( int argc, char** argv )
+{
+    std::vector<size_t> sizes;
+    for( size_t n=256; n<=(16u<<20); n*=4 ) {
+        sizes.push_back( n );
+    }
+    std::vector<size_t> alignments = parseSizes( "0,1,8" );
+    std::string only;
+
+    for( int i=1; i<argc; i++ ) {
+        std::string arg( argv[i] );
+        size_t eq = arg.find( '=' );
+        std::string key = arg.substr( 0, eq );
+        std::string value = eq == std::string::npos ? "" : arg.substr( eq+1 );
+        if( key == "--sizes" ) {
+            sizes = parseSizes( value );
+        }
+        else if( key == "--alignments" ) {
+            alignments = parseSizes( value );
+        }
+        else if( key == "--kernels" ) {
+            only = "," + value + ",";
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--sizes=n,...] [--alignments=a,...] "
+                      << "[--kernels=adler32,filter_sub,filter_up,match,crc,bitpusher,bitpusher_reverse]\n";
+            return -1;
+        }
+    }
+
+    create_crc_table();
+    createCRCTable();
+
+    size_t max_size = *std::max_element( sizes.begin(), sizes.end() );
+    size_t max_align = *std::max_element( alignments.begin(), alignments.end() );
+    size_t in_bytes = max_size + max_align + 2*padding;
+    size_t out_bytes = 2*max_size + 1024 + padding;     // room for filter bytes of tiny rows
+
+    // Mildly compressible pseudo-random data: runs, repeats and noise.
+    std::vector<unsigned char> in_storage( in_bytes + 64 );
+    unsigned int state = 12345u;
+    for( size_t i=0; i<in_storage.size(); i++ ) {
+        state = 1103515245u*state + 12345u;
+        unsigned int r = state >> 16;
+        if( (r & 7) == 0 || i < 3 ) {
+            in_storage[i] = r >> 3;
+        }
+        else {
+            in_storage[i] = in_storage[ i - 1 - ((r>>3)&1)*2 ];
+        }
+    }
+    std::vector<unsigned char> out_storage_a( out_bytes + 64 );
+    std::vector<unsigned char> out_storage_b( out_bytes + 64 );
+    unsigned char* in_base = (unsigned char*)(((size_t)in_storage.data() + 63) & ~(size_t)63);
+
+    std::cout << "kernel\tvariant\tbytes\talign\tGB/s\tcycles/byte\tcheck\n";
+    int failures = 0;
+    std::vector<KernelGroup> groups = kernelGroups();
+    for( size_t g=0; g<groups.size(); g++ ) {
+        const KernelGroup& group = groups[g];
+        if( !only.empty() && only.find( "," + std::string( group.m_name ) + "," ) == std::string::npos ) {
+            continue;
+        }
+        for( size_t s=0; s<sizes.size(); s++ ) {
+            for( size_t a=0; a<alignments.size(); a++ ) {
+                Workspace ref;
+                ref.m_in = in_base + alignments[a];
+                ref.m_n = sizes[s];
+                ref.m_out = out_storage_a.data();
+                ref.m_out_n = 0;
+                ref.m_result = 0;
+                group.m_reference( ref );
+
+                for( size_t v=0; v<group.m_variants.size(); v++ ) {
+                    Workspace ws = ref;
+                    ws.m_out = out_storage_b.data();
+                    ws.m_out_n = 0;
+                    ws.m_result = 0;
+                    ws.m_bits.clear();
+                    group.m_variants[v].m_func( ws );
+                    bool ok = sameOutput( ref, ws );
+
+                    std::cout << group.m_name << '\t'
+                              << group.m_variants[v].m_name << '\t'
+                              << sizes[s] << '\t'
+                              << alignments[a] << '\t';
+                    if( !ok ) {
+                        // Don't time wrong answers.
+                        std::cout << "-\t-\tMISMATCH\n";
+                        failures++;
+                        continue;
+                    }
+                    double seconds, cycles;
+                    timeKernel( seconds, cycles, group.m_variants[v].m_func, ws );
+                    std::cout << (sizes[s]/seconds)*1e-9 << '\t'
+                              << (cycles/sizes[s]) << '\t'
+                              << "ok\n";
+                }
+            }
+        }
+    }
+    return failures == 0 ? 0 : -1;
+}
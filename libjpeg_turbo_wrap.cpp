@@ -1,12 +1,15 @@
 #include <iostream>
 #include <jpeglib.h>
 #include <cstdio>
+#include <cstdlib>
 #include "libjpeg_turbo_wrap.hpp"
+#include "EncoderRegistry.hpp"
 
 int
-libjpeg_turbo_wrap( const std::vector<char>& rgb,
+libjpeg_turbo_wrap( const ImageBuffer& rgb,
                     const int w,
-                    const int h )
+                    const int h,
+                    OutputSink& out )
 {
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
@@ -14,12 +17,10 @@ libjpeg_turbo_wrap( const std::vector<char>& rgb,
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
     
-    FILE* of = fopen( "output.jpg", "wb" );
-    if( of == NULL ) {
-        std::cerr << "Cannot open 'output.jpg'\n";
-        return 0;
-    }
-    jpeg_stdio_dest( &cinfo, of );
+    // libjpeg grows this buffer with malloc as needed.
+    unsigned char* buffer = NULL;
+    unsigned long size = 0;
+    jpeg_mem_dest( &cinfo, &buffer, &size );
 
     cinfo.image_width = w;
     cinfo.image_height = h;
@@ -37,9 +38,23 @@ libjpeg_turbo_wrap( const std::vector<char>& rgb,
     jpeg_write_scanlines( &cinfo, rows.data(), h );
     jpeg_finish_compress(&cinfo);
     
-    int bytes = ftell( of );
-    
-    fclose(of);
     jpeg_destroy_compress(&cinfo);
-    return bytes;
+
+    out.write( buffer, size );
+    out.flush();
+    free( buffer );
+    return size;
+}
+
+static
+int
+libjpeg_turbo_encoder( ThreadPool* thread_pool,
+                       const ImageBuffer& rgb,
+                       const int w,
+                       const int h,
+                       OutputSink& out )
+{
+    return libjpeg_turbo_wrap( rgb, w, h, out );
 }
+
+static EncoderRegistrar libjpeg_turbo_registrar( "libjpeg_turbo_wrap", libjpeg_turbo_encoder, ".jpg", true );
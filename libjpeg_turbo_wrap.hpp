@@ -1,7 +1,10 @@
 #pragma once
 
 #include <vector>
+#include "ImageBuffer.hpp"
+#include "OutputSink.hpp"
 
-int libjpeg_turbo_wrap(const std::vector<char> &rgb,
+int libjpeg_turbo_wrap(const ImageBuffer& rgb,
                     const int w,
-                    const int h );
\ No newline at end of file
+                    const int h,
+                    OutputSink& out );
\ No newline at end of file
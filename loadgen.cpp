@@ -0,0 +1,270 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cassert>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <pthread.h>
+#include "timer.hpp"
+#include "ImageLoader.hpp"
+#include "SyntheticImage.hpp"
+#include "EncodeServer.hpp"
+
+// Load generator for the encode server (main --serve). Concurrent clients
+// each send a stream of requests over their own connection and record the
+// end-to-end latency of every request.
+
+namespace {
+
+struct ClientState
+{
+    ClientState()
+        : m_image( NULL ),
+          m_width( 0 ),
+          m_height( 0 ),
+          m_warmup( 0 ),
+          m_requests( 0 ),
+          m_output_bytes( 0 ),
+          m_failed( 0 )
+    {}
+
+    std::string                 m_socket;
+    std::string                 m_encoder;
+    const ImageBuffer*          m_image;
+    int                         m_width;
+    int                         m_height;
+    int                         m_warmup;
+    int                         m_requests;
+    std::vector<double>         m_latency;          ///< Seconds per timed request.
+    std::vector<double>         m_server;           ///< Encode time reported by the server.
+    size_t                      m_output_bytes;
+    int                         m_failed;
+    std::string                 m_message;          ///< First failure, if any.
+    std::vector<unsigned char>  m_encoded;          ///< Output of the last request.
+};
+
+void*
+clientMain( void* arg )
+{
+    ClientState* state = (ClientState*)arg;
+    EncodeClient client;
+    if( !client.connect( state->m_socket ) ) {
+        state->m_failed = state->m_requests;
+        state->m_message = "connect failed";
+        return NULL;
+    }
+    for( int r=0; r<state->m_warmup + state->m_requests; r++ ) {
+        std::string message;
+        double server_seconds = 0.0;
+        TimeStamp start;
+        bool ok = client.encode( state->m_encoded, server_seconds, message, state->m_encoder,
+                                 *state->m_image, state->m_width, state->m_height );
+        TimeStamp stop;
+        if( r < state->m_warmup ) {
+            continue;
+        }
+        if( !ok ) {
+            if( state->m_failed++ == 0 ) {
+                state->m_message = message;
+            }
+            continue;
+        }
+        state->m_latency.push_back( TimeStamp::delta( start, stop ) );
+        state->m_server.push_back( server_seconds );
+        state->m_output_bytes += state->m_encoded.size();
+    }
+    return NULL;
+}
+
+double
+percentile( const std::vector<double>& sorted, double p )
+{
+    if( sorted.empty() ) {
+        return 0.0;
+    }
+    // nearest-rank percentile
+    size_t rank = (size_t)std::ceil( p*sorted.size() );
+    if( rank < 1 ) {
+        rank = 1;
+    }
+    return sorted[ std::min( rank, sorted.size() ) - 1 ];
+}
+
+void
+usage( const char* argv0 )
+{
+    std::cerr << "Usage: " << argv0 << " --socket=path [options] [image]\n"
+              << "  --socket=path       Unix socket of a running 'main --serve=path'.\n"
+              << "  --encoder=name      Encoder to request (default homebrew4_mc).\n"
+              << "  --clients=N         Concurrent connections (default 4).\n"
+              << "  --requests=N        Timed requests per client (default 100).\n"
+              << "  --warmup=N          Untimed requests per client (default 2).\n"
+              << "  --synthetic=WxH     Send a generated image instead of a file (default 1920x1080).\n"
+              << "  --kind=name         Content of the generated image (default photo).\n"
+              << "  --raw=WxH           Size of an input file that is raw RGB.\n"
+              << "  --output=file       Save the last encoded image.\n"
+              << "  --shutdown          Stop the server when done.\n";
+}
+
+} // of anonymous namespace
+
+int
+main( int argc, char** argv )
+{
+    std::string socket_path;
+    std::string encoder = "homebrew4_mc";
+    int clients = 4;
+    int requests = 100;
+    int warmup = 2;
+    int sw = 1920;
+    int sh = 1080;
+    SyntheticKind kind = SYNTHETIC_PHOTO;
+    int raw_w = 0;
+    int raw_h = 0;
+    std::string input;
+    std::string output;
+    bool shutdown = false;
+
+    for( int i=1; i<argc; i++ ) {
+        std::string arg( argv[i] );
+        size_t eq = arg.find( '=' );
+        std::string key = arg.substr( 0, eq );
+        std::string value = eq == std::string::npos ? "" : arg.substr( eq+1 );
+        if( key == "--socket" ) {
+            socket_path = value;
+        }
+        else if( key == "--encoder" ) {
+            encoder = value;
+        }
+        else if( key == "--clients" ) {
+            clients = std::max( 1, atoi( value.c_str() ) );
+        }
+        else if( key == "--requests" ) {
+            requests = std::max( 1, atoi( value.c_str() ) );
+        }
+        else if( key == "--warmup" ) {
+            warmup = std::max( 0, atoi( value.c_str() ) );
+        }
+        else if( key == "--synthetic" ) {
+            if( sscanf( value.c_str(), "%dx%d", &sw, &sh ) != 2 || sw <= 0 || sh <= 0 ) {
+                std::cerr << "Malformed synthetic image size '" << value << "', expected WxH.\n";
+                return -1;
+            }
+        }
+        else if( key == "--kind" ) {
+            if( !parseSyntheticKind( kind, value ) ) {
+                std::cerr << "Unknown image kind '" << value << "'.\n";
+                return -1;
+            }
+        }
+        else if( key == "--raw" ) {
+            if( sscanf( value.c_str(), "%dx%d", &raw_w, &raw_h ) != 2 || raw_w <= 0 || raw_h <= 0 ) {
+                std::cerr << "Malformed raw image size '" << value << "', expected WxH.\n";
+                return -1;
+            }
+        }
+        else if( key == "--output" ) {
+            output = value;
+        }
+        else if( key == "--shutdown" ) {
+            shutdown = true;
+        }
+        else if( arg.substr( 0, 2 ) != "--" && input.empty() ) {
+            input = arg;
+        }
+        else {
+            usage( argv[0] );
+            return -1;
+        }
+    }
+    if( socket_path.empty() ) {
+        usage( argv[0] );
+        return -1;
+    }
+
+    ImageBuffer image;
+    int w = sw;
+    int h = sh;
+    if( !input.empty() ) {
+        if( !loadImageFile( image, w, h, input, raw_w, raw_h ) ) {
+            return -1;
+        }
+    }
+    else {
+        generateSynthetic( image, kind, w, h, 1 );
+    }
+
+    std::vector<ClientState> states( clients );
+    std::vector<pthread_t> threads( clients );
+    for( int c=0; c<clients; c++ ) {
+        states[c].m_socket = socket_path;
+        states[c].m_encoder = encoder;
+        states[c].m_image = &image;
+        states[c].m_width = w;
+        states[c].m_height = h;
+        states[c].m_warmup = warmup;
+        states[c].m_requests = requests;
+    }
+    TimeStamp start;
+    for( int c=0; c<clients; c++ ) {
+        assert( pthread_create( &threads[c], NULL, clientMain, &states[c] ) == 0 );
+    }
+    for( int c=0; c<clients; c++ ) {
+        void* foo;
+        assert( pthread_join( threads[c], &foo ) == 0 );
+    }
+    TimeStamp stop;
+    double seconds = TimeStamp::delta( start, stop );
+
+    std::vector<double> latency;
+    std::vector<double> server;
+    size_t output_bytes = 0;
+    int failed = 0;
+    for( int c=0; c<clients; c++ ) {
+        latency.insert( latency.end(), states[c].m_latency.begin(), states[c].m_latency.end() );
+        server.insert( server.end(), states[c].m_server.begin(), states[c].m_server.end() );
+        output_bytes += states[c].m_output_bytes;
+        if( states[c].m_failed > 0 && failed == 0 ) {
+            std::cerr << "Request failed: " << states[c].m_message << "\n";
+        }
+        failed += states[c].m_failed;
+    }
+    std::sort( latency.begin(), latency.end() );
+    std::sort( server.begin(), server.end() );
+
+    // Warm-up requests overlap with the timed ones of other clients, so the
+    // throughput is only approximate when warmup is non-zero.
+    size_t ok = latency.size();
+    double mean = 0.0;
+    for( size_t i=0; i<ok; i++ ) {
+        mean += latency[i]/ok;
+    }
+    std::cout << encoder << ": " << clients << " clients, " << ok << " requests ok, "
+              << failed << " failed in " << seconds << "s\n"
+              << "    throughput:\t" << ok/seconds << " requests/s, "
+              << (ok*(double)image.size()/seconds)*1e-6 << " MB/s in, "
+              << (output_bytes/seconds)*1e-6 << " MB/s out\n"
+              << "    latency ms:\tmean=" << 1e3*mean
+              << ", p50=" << 1e3*percentile( latency, 0.50 )
+              << ", p90=" << 1e3*percentile( latency, 0.90 )
+              << ", p99=" << 1e3*percentile( latency, 0.99 )
+              << ", p99.9=" << 1e3*percentile( latency, 0.999 )
+              << ", max=" << 1e3*(latency.empty() ? 0.0 : latency.back()) << "\n"
+              << "    server encode ms:\tp50=" << 1e3*percentile( server, 0.50 )
+              << ", p99=" << 1e3*percentile( server, 0.99 ) << "\n";
+
+    if( !output.empty() && !states[0].m_encoded.empty() && failed == 0 ) {
+        std::ofstream file( output.c_str(), std::ios::binary );
+        file.write( (const char*)states[0].m_encoded.data(), states[0].m_encoded.size() );
+    }
+    if( shutdown ) {
+        EncodeClient client;
+        if( !client.connect( socket_path ) || !client.shutdownServer() ) {
+            return -1;
+        }
+    }
+    return failed == 0 && ok > 0 ? 0 : -1;
+}
@@ -1,4 +1,3 @@
-#include <png.h>
 #include <string>
 #include <cstdio>
 #include <iostream>
@@ -6,11 +5,26 @@
 #include <vector>
 #include <unistd.h>
 #include <cstring>
+#include <cstdlib>
+#include <fstream>
+#include <algorithm>
 #include "timer.hpp"
 #include "tinia_png.hpp"
 #include "libjpeg_turbo_wrap.hpp"
 #include "homebrew_png.hpp"
 #include "ThreadPool.hpp"
+#include "EncoderRegistry.hpp"
+#include "Benchmark.hpp"
+#include "Verify.hpp"
+#include "Trace.hpp"
+#include "SyntheticImage.hpp"
+#include "Pareto.hpp"
+#include "Baseline.hpp"
+#include "ImageLoader.hpp"
+#include "Batch.hpp"
+#include "StreamEncoder.hpp"
+#include "MemoryStats.hpp"
+#include "EncodeServer.hpp"
 
 
 class DummyJob
@@ -35,175 +49,469 @@ protected:
 };
 
 
+/** Image to benchmark, either a file or a generated image. */
+struct ImageSource
+{
+    std::string     m_name;
+    std::string     m_path;         ///< Empty for synthetic images.
+    SyntheticKind   m_kind;
+    int             m_width;        ///< Also size of raw RGB files.
+    int             m_height;
+    unsigned int    m_seed;
+};
+
+static
+bool
+loadImage( ImageBuffer& image, int& w, int& h, const ImageSource& source, ThreadPool* thread_pool )
+{
+    if( !source.m_path.empty() ) {
+        return loadImageFile( image, w, h, source.m_path, source.m_width, source.m_height );
+    }
+    w = source.m_width;
+    h = source.m_height;
+    generateSynthetic( image, source.m_kind, w, h, source.m_seed, thread_pool );
+    return true;
+}
+
+static
+std::vector<std::string>
+splitList( const std::string& list )
+{
+    std::vector<std::string> items;
+    size_t a = 0;
+    while( a <= list.size() ) {
+        size_t b = list.find( ',', a );
+        if( b == std::string::npos ) {
+            b = list.size();
+        }
+        if( b > a ) {
+            items.push_back( list.substr( a, b-a ) );
+        }
+        a = b + 1;
+    }
+    return items;
+}
+
+static
+void
+usage( const char* argv0 )
+{
+    std::cerr << "Usage: " << argv0 << " [options] [image.png|image.ppm|image.rgb ...]\n"
+              << "  --list              List registered encoders.\n"
+              << "  --encoders=a,b,...  Only run the named encoders.\n"
+              << "  --warmup=N          Untimed runs per encoder (default 1).\n"
+              << "  --reps=N            Timed runs per encoder (default 10).\n"
+              << "  --csv=file          Write results as CSV.\n"
+              << "  --json=file         Write results as JSON.\n"
+              << "  --trace=file        Write a Chrome trace (Perfetto) timeline of jobs and stages.\n"
+              << "  --counters          Sample hardware counters per encoder stage.\n"
+              << "  --threads=N         Worker threads in pool (default: cores-1).\n"
+              << "  --scaling[=N]       Sweep 1, 2, 4, ... N threads (default: cores).\n"
+              << "  --verify            Decode each encoder's output and compare with source.\n"
+              << "  --output-dir=DIR    Also write each encoded image to DIR/<image>_<encoder>.<ext>.\n"
+              << "  --batch=DIR         Re-encode all files in DIR with one encoder into --output-dir.\n"
+              << "  --stream-out=file   Encode the single PPM or raw input out-of-core, row by row.\n"
+              << "  --stripe-bytes=N    Filtered bytes per stripe of the out-of-core encoder (default 1M).\n"
+              << "  --serve=socket      Serve encode requests on a Unix socket, or stdin/stdout if '-'.\n"
+              << "  --huge-pages        Back homebrew4 scratch buffers with transparent huge pages.\n"
+              << "  --readers=N         Batch threads loading inputs (default 2).\n"
+              << "  --writers=N         Batch threads writing outputs (default 1).\n"
+              << "  --read-queue=N      Batch images decoded ahead of the encoder (default 4).\n"
+              << "  --write-queue=N     Batch images encoded ahead of the writers (default 4).\n"
+              << "  --synthetic=WxH,... Benchmark the generated corpus at the given sizes.\n"
+              << "  --kinds=a,b,...     Corpus content (default flat,gradient,ui,text,photo,tiles,mixed; also depth).\n"
+              << "  --seed=N            Seed of generated corpus (default 1).\n"
+              << "  --raw=WxH           Size of input files that are raw RGB.\n"
+              << "  --pareto            Print size-versus-time Pareto report per image and corpus.\n"
+              << "  --bandwidth=Mbit/s  Link speed for transfer times in Pareto report (default 1000).\n"
+              << "  --save-baseline=file  Save timings and sizes for later comparison.\n"
+              << "  --baseline=file     Compare with saved baseline, fail on regressions.\n"
+              << "  --alpha=P           Significance level of baseline comparison (default 0.01).\n"
+              << "  --threshold=PCT     Ignore slowdowns below PCT percent (default 5).\n";
+}
+
 int
 main(int argc, char **argv)
 {
-    ThreadPool thread_pool(7);
+    const EncoderRegistry& registry = EncoderRegistry::instance();
+    BenchmarkOptions options;
+    std::vector<const EncoderRegistry::Entry*> encoders;
+    std::vector<std::string> files;
+    std::vector<std::string> synthetic_sizes;
+    std::vector<SyntheticKind> kinds;
+    unsigned int seed = 1;
+    int raw_w = 0;
+    int raw_h = 0;
+    std::string csv_file;
+    std::string json_file;
+    std::string trace_file;
+    bool verify = false;
+    std::string output_dir;
+    std::string batch_dir;
+    BatchOptions batch_options;
+    std::string stream_file;
+    std::string serve_socket;
+    StreamEncoderOptions stream_options;
+    bool pareto = false;
+    double bandwidth = 1000.0;
+    std::string save_baseline_file;
+    std::string baseline_file;
+    BaselineOptions baseline_options;
+    int threads = -1;
+    int scaling = 0;
+    int verify_failures = 0;
 
-    
     for(int i=1; i<argc; i++) {
         std::string arg( argv[i] );
         if( arg.substr(0,2) == "--" ) {
             // option
-        }
-        else {
-            int w = 0;
-            int h = 0;
-            std::vector<char> image;
-            
-            {
-                TimeStamp start;
-                
-                FILE* fp = fopen( arg.c_str(), "rb" );
-                if( fp == NULL ) {
-                    std::cerr << "Failed to open '" << arg << "'\n";
-                    return -1;
+            size_t eq = arg.find( '=' );
+            std::string key = arg.substr( 0, eq );
+            std::string value = eq == std::string::npos ? "" : arg.substr( eq+1 );
+            if( key == "--list" ) {
+                for( size_t k=0; k<registry.encoders().size(); k++ ) {
+                    std::cout << registry.encoders()[k].m_name << "\n";
                 }
-                
-                std::vector<unsigned char> header(8);
-                if( fread( header.data(), 1, header.size(), fp ) != header.size() ) {
-                    std::cerr << "Error loading file header of '" << arg << "'\n";
-                    return -1;
+                return 0;
+            }
+            else if( key == "--encoders" ) {
+                std::vector<std::string> names = splitList( value );
+                for( size_t k=0; k<names.size(); k++ ) {
+                    const EncoderRegistry::Entry* entry = registry.find( names[k] );
+                    if( entry == NULL ) {
+                        std::cerr << "Unknown encoder '" << names[k] << "', see --list.\n";
+                        return -1;
+                    }
+                    encoders.push_back( entry );
                 }
-                
-                if( png_sig_cmp( header.data(), 0, header.size() ) != 0 ) {
-                    std::cerr << "File '" << arg << "' is not a valid PNG file.\n";
+            }
+            else if( key == "--warmup" ) {
+                options.m_warmup = std::max( 0, atoi( value.c_str() ) );
+            }
+            else if( key == "--reps" ) {
+                options.m_repetitions = std::max( 1, atoi( value.c_str() ) );
+            }
+            else if( key == "--csv" ) {
+                csv_file = value;
+            }
+            else if( key == "--json" ) {
+                json_file = value;
+            }
+            else if( key == "--trace" ) {
+                trace_file = value;
+            }
+            else if( key == "--counters" ) {
+                PerfCounters::setEnabled( true );
+            }
+            else if( key == "--threads" ) {
+                threads = std::max( 0, atoi( value.c_str() ) );
+            }
+            else if( key == "--scaling" ) {
+                scaling = value.empty() ? (int)sysconf( _SC_NPROCESSORS_ONLN ) : atoi( value.c_str() );
+                scaling = std::max( 1, scaling );
+            }
+            else if( key == "--verify" ) {
+                verify = true;
+            }
+            else if( key == "--output-dir" ) {
+                output_dir = value;
+            }
+            else if( key == "--batch" ) {
+                batch_dir = value;
+            }
+            else if( key == "--stream-out" ) {
+                stream_file = value;
+            }
+            else if( key == "--stripe-bytes" ) {
+                stream_options.m_stripe_bytes = std::max( 1ll, atoll( value.c_str() ) );
+            }
+            else if( key == "--serve" ) {
+                serve_socket = value;
+            }
+            else if( key == "--huge-pages" ) {
+                homebrewContext().m_scratch.setHugePages( true );
+            }
+            else if( key == "--readers" ) {
+                batch_options.m_readers = std::max( 1, atoi( value.c_str() ) );
+            }
+            else if( key == "--writers" ) {
+                batch_options.m_writers = std::max( 1, atoi( value.c_str() ) );
+            }
+            else if( key == "--read-queue" ) {
+                batch_options.m_read_queue = std::max( 1, atoi( value.c_str() ) );
+            }
+            else if( key == "--write-queue" ) {
+                batch_options.m_write_queue = std::max( 1, atoi( value.c_str() ) );
+            }
+            else if( key == "--pareto" ) {
+                pareto = true;
+            }
+            else if( key == "--bandwidth" ) {
+                bandwidth = atof( value.c_str() );
+                if( !(bandwidth > 0.0) ) {
+                    std::cerr << "Bandwidth must be positive.\n";
                     return -1;
                 }
-                
-                png_structp png_ptr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
-                if( png_ptr == NULL ) {
-                    std::cerr << "Failed to create png_struct.\n";
-                    return -1;
+            }
+            else if( key == "--save-baseline" ) {
+                save_baseline_file = value;
+            }
+            else if( key == "--baseline" ) {
+                baseline_file = value;
+            }
+            else if( key == "--alpha" ) {
+                baseline_options.m_alpha = atof( value.c_str() );
+            }
+            else if( key == "--threshold" ) {
+                baseline_options.m_threshold = 0.01*atof( value.c_str() );
+            }
+            else if( key == "--synthetic" ) {
+                synthetic_sizes = splitList( value );
+            }
+            else if( key == "--kinds" ) {
+                std::vector<std::string> names = splitList( value );
+                for( size_t k=0; k<names.size(); k++ ) {
+                    SyntheticKind kind;
+                    if( !parseSyntheticKind( kind, names[k] ) ) {
+                        std::cerr << "Unknown image kind '" << names[k] << "'.\n";
+                        return -1;
+                    }
+                    kinds.push_back( kind );
                 }
-                
-                png_infop info_ptr = png_create_info_struct( png_ptr );
-                if( info_ptr == NULL ) {
-                    std::cerr << "Failed to create info struct.\n";
+            }
+            else if( key == "--raw" ) {
+                if( sscanf( value.c_str(), "%dx%d", &raw_w, &raw_h ) != 2 || raw_w <= 0 || raw_h <= 0 ) {
+                    std::cerr << "Malformed raw image size '" << value << "', expected WxH.\n";
                     return -1;
                 }
-                
-                png_infop end_info = png_create_info_struct( png_ptr );
-                if( end_info == NULL ) {
-                    std::cerr << "Failed to create end info.\n";
-                    return -1;
+            }
+            else if( key == "--seed" ) {
+                seed = strtoul( value.c_str(), NULL, 0 );
+            }
+            else {
+                std::cerr << "Unknown option '" << arg << "'.\n";
+                usage( argv[0] );
+                return -1;
+            }
+        }
+        else {
+            files.push_back( arg );
+        }
+    }
+    if( encoders.empty() && (scaling > 0 || !batch_dir.empty()) ) {
+        encoders.push_back( registry.find( "homebrew4_mc" ) );
+    }
+    if( encoders.empty() ) {
+        for( size_t k=0; k<registry.encoders().size(); k++ ) {
+            encoders.push_back( &registry.encoders()[k] );
+        }
+    }
+    if( kinds.empty() ) {
+        for( int k=0; k<SYNTHETIC_DEPTH; k++ ) {
+            kinds.push_back( (SyntheticKind)k );
+        }
+    }
+
+    std::vector<ImageSource> sources;
+    for( size_t f=0; f<files.size(); f++ ) {
+        ImageSource source;
+        source.m_name = files[f];
+        source.m_path = files[f];
+        source.m_width = raw_w;
+        source.m_height = raw_h;
+        sources.push_back( source );
+    }
+    for( size_t s=0; s<synthetic_sizes.size(); s++ ) {
+        int sw = 0;
+        int sh = 0;
+        if( sscanf( synthetic_sizes[s].c_str(), "%dx%d", &sw, &sh ) != 2 || sw <= 0 || sh <= 0 ) {
+            std::cerr << "Malformed synthetic image size '" << synthetic_sizes[s] << "', expected WxH.\n";
+            return -1;
+        }
+        for( size_t k=0; k<kinds.size(); k++ ) {
+            ImageSource source;
+            source.m_name = std::string( syntheticKindName( kinds[k] ) ) + "_" + synthetic_sizes[s]
+                          + "_s" + std::to_string( seed );
+            source.m_kind = kinds[k];
+            source.m_width = sw;
+            source.m_height = sh;
+            source.m_seed = seed;
+            sources.push_back( source );
+        }
+    }
+    if( sources.empty() && batch_dir.empty() && stream_file.empty() && serve_socket.empty() ) {
+        usage( argv[0] );
+        return -1;
+    }
+
+    std::vector<BaselineEntry> baseline;
+    if( !baseline_file.empty() && !readBaseline( baseline, baseline_file ) ) {
+        return -1;
+    }
+
+    if( !trace_file.empty() ) {
+        Trace::setEnabled( true );
+        Trace::setThreadName( "main" );
+    }
+
+    ThreadPool thread_pool( threads );
+    create_crc_table();
+    createCRCTable();
+
+    if( !serve_socket.empty() ) {
+        EncodeServerStats stats;
+        TimeStamp start;
+        bool ok = runEncodeServer( stats, serve_socket, &thread_pool );
+        TimeStamp stop;
+        std::cerr << "serve:\t" << stats.m_connections << " connections, "
+                  << stats.m_requests << " requests (" << stats.m_failed << " failed), "
+                  << stats.m_input_bytes << " -> " << stats.m_output_bytes << " bytes, "
+                  << stats.m_encode_seconds << "s encoding in " << TimeStamp::delta( start, stop ) << "s\n";
+        if( !trace_file.empty() ) {
+            Trace::write( trace_file );
+        }
+        return ok ? 0 : -1;
+    }
+
+    if( !stream_file.empty() ) {
+        if( files.size() != 1 ) {
+            std::cerr << "Out-of-core encoding takes exactly one input file.\n";
+            return -1;
+        }
+        FileRowSource source( files[0], raw_w, raw_h );
+        FdSink out( stream_file );
+        if( !source.ok() || !out.ok() ) {
+            return -1;
+        }
+        MemoryScope memory;
+        TimeStamp start;
+        size_t bytes = encodeStreamingPNG( out, source, &thread_pool, stream_options );
+        TimeStamp stop;
+        double seconds = TimeStamp::delta( start, stop );
+        MemoryUsage usage = memory.usage();
+        std::cerr << "stream:\t" << source.width() << 'x' << source.height() << " -> "
+                  << bytes << " bytes in " << seconds << "s, "
+                  << (3.0*source.width()*source.height()/seconds)*1e-6 << " MB/s in, "
+                  << "peak heap=" << usage.m_peak_heap_bytes
+                  << ", peak RSS=+" << usage.m_peak_rss_bytes << "\n";
+        return bytes > 0 ? 0 : -1;
+    }
+
+    if( !batch_dir.empty() ) {
+        if( encoders.size() != 1 ) {
+            std::cerr << "Batch mode encodes with exactly one encoder, see --encoders.\n";
+            return -1;
+        }
+        std::vector<std::string> batch_files;
+        if( !listBatchInputs( batch_files, batch_dir ) ) {
+            return -1;
+        }
+        batch_options.m_output_dir = output_dir;
+        batch_options.m_raw_w = raw_w;
+        batch_options.m_raw_h = raw_h;
+        BatchResult batch = runBatch( *encoders[0], &thread_pool, batch_files, batch_options );
+        printBatchResult( std::cerr, batch );
+        if( !trace_file.empty() ) {
+            Trace::write( trace_file );
+        }
+        return batch.m_failed == 0 ? 0 : -1;
+    }
+
+    std::vector<BenchmarkResult> results;
+    MemorySink encoded;
+    for( size_t f=0; f<sources.size(); f++ ) {
+        int w = 0;
+        int h = 0;
+        ImageBuffer image;
+        if( !loadImage( image, w, h, sources[f], &thread_pool ) ) {
+            return -1;
+        }
+
+        if( scaling > 0 ) {
+            for( size_t k=0; k<encoders.size(); k++ ) {
+                if( !encoders[k]->supports( image.format() ) ||
+                    !encoders[k]->accepts( image.format(), w, h ) )
+                {
+                    continue;
                 }
-                
-                if( setjmp( png_jmpbuf(png_ptr) ) ) {
-                    std::cerr << "setjmp failed.\n";
+                runScalingSweep( results, std::cerr, *encoders[k], sources[f].m_name,
+                                 image, w, h, options, scaling );
+            }
+            continue;
+        }
+
+        for( size_t k=0; k<encoders.size(); k++ ) {
+            if( !encoders[k]->supports( image.format() ) ) {
+                std::cerr << encoders[k]->m_name << ":\tskipped, does not take "
+                          << pixelFormatName( image.format() ) << " pixels\n";
+                continue;
+            }
+            if( !encoders[k]->accepts( image.format(), w, h ) ) {
+                std::cerr << encoders[k]->m_name << ":\tskipped, " << w << "x" << h
+                          << " is too large\n";
+                continue;
+            }
+            BenchmarkResult result = runBenchmark( *encoders[k],
+                                                   &thread_pool,
+                                                   sources[f].m_name,
+                                                   image, w, h,
+                                                   options,
+                                                   &encoded );
+            printResult( std::cerr, result );
+            results.push_back( result );
+
+            if( !output_dir.empty() ) {
+                // Extra untimed run straight to the file, exercising the writev path.
+                const std::string& name = sources[f].m_name;
+                std::string path = output_dir + "/" + name.substr( name.find_last_of( '/' ) + 1 ) + "_"
+                                 + encoders[k]->m_name + encoders[k]->m_extension;
+                FdSink file( path );
+                if( !file.ok() ) {
                     return -1;
                 }
-                
-                png_init_io( png_ptr, fp );
-                png_set_sig_bytes( png_ptr, header.size() );
-                png_read_png( png_ptr, info_ptr, PNG_TRANSFORM_EXPAND, NULL );
-                
-                if( png_get_color_type( png_ptr, info_ptr ) != PNG_COLOR_TYPE_RGB ) {
-                    std::cerr << "Source image is not RGB.\n";
-                    return -1;
+                encoders[k]->m_func( &thread_pool, image, w, h, file );
+            }
+
+            if( verify ) {
+                VerifyResult v = verifyEncoded( encoded.data(), image, w, h );
+                std::cerr << encoders[k]->m_name << " verify:\t";
+                if( !v.m_ok ) {
+                    std::cerr << "FAILED, " << v.m_message << "\n";
+                    verify_failures++;
                 }
-                if( png_get_bit_depth( png_ptr, info_ptr ) != 8 ) {
-                    std::cerr << "Bit depth is not 8 bits\n.";
-                    return -1;
+                else if( v.m_lossless ) {
+                    std::cerr << "ok, zlib inflate=" << v.m_zlib_seconds
+                              << ", " << v.m_decoder << " decode=" << v.m_decoder_seconds << "\n";
                 }
-                
-                
-                w = png_get_image_width( png_ptr, info_ptr );
-                h = png_get_image_height( png_ptr, info_ptr );
-                png_bytepp rows = png_get_rows( png_ptr, info_ptr );
-                image.resize( 3*w*h );
-                
-                for( int j=0; j<h; j++ ) {
-                    for( int i=0; i<w; i++ ) {
-                        memcpy( image.data() + 3*w*j, rows[j], 3*i );
-                    }
+                else {
+                    std::cerr << "ok, libjpeg decode=" << v.m_decoder_seconds
+                              << ", PSNR=" << v.m_psnr << "dB\n";
                 }
-                TimeStamp stop;
-                
-                std::cerr << "Read [" << w<< 'x' << h << "] RGB pixels ("<< (3*w*h) << " bytes), " << TimeStamp::delta( start, stop ) << "\n";
-            }
-             
-            create_crc_table();
-            {
-                double seconds_in_zlib;
-                TimeStamp start;
-                int bytes = tinia_png( seconds_in_zlib, image, w, h, -1 );
-                TimeStamp stop;
-                std::cerr << "tinia_png:\t" << TimeStamp::delta( start, stop ) << " (" << seconds_in_zlib << "s in zlib)"  << " ("<< bytes << " bytes)\n";
-            }
-            {
-                double seconds_in_zlib;
-                TimeStamp start;
-                int bytes = tinia_png( seconds_in_zlib, image, w, h, 0 );
-                TimeStamp stop;
-                std::cerr << "tinia_png 0:\t" << TimeStamp::delta( start, stop ) << " (" << seconds_in_zlib << "s in zlib)"  << " ("<< bytes << " bytes)\n";
-            }
-            {
-                double seconds_in_zlib;
-                TimeStamp start;
-                int bytes = tinia_png( seconds_in_zlib, image, w, h, 1 );
-                TimeStamp stop;
-                std::cerr << "tinia_png 1:\t" << TimeStamp::delta( start, stop ) << " (" << seconds_in_zlib << "s in zlib)"  << " ("<< bytes << " bytes)\n";
-            }
-            {
-                double seconds_in_zlib;
-                TimeStamp start;
-                int bytes = tinia_png( seconds_in_zlib, image, w, h, 2 );
-                TimeStamp stop;
-                std::cerr << "tinia_png 2:\t" << TimeStamp::delta( start, stop ) << " (" << seconds_in_zlib << "s in zlib)"  << " ("<< bytes << " bytes)\n";
-            }
-            {
-                double seconds_in_zlib;
-                TimeStamp start;
-                int bytes = tinia_png( seconds_in_zlib, image, w, h, 3 );
-                TimeStamp stop;
-                std::cerr << "tinia_png 3:\t" << TimeStamp::delta( start, stop ) << " (" << seconds_in_zlib << "s in zlib)"  << " ("<< bytes << " bytes)\n";
-            }
-            {
-                double seconds_in_zlib;
-                TimeStamp start;
-                int bytes = tinia_png( seconds_in_zlib, image, w, h, 4 );
-                TimeStamp stop;
-                std::cerr << "tinia_png 4:\t" << TimeStamp::delta( start, stop ) << " (" << seconds_in_zlib << "s in zlib)" <<" ("<< bytes << " bytes)\n";
-            }
-
-            createCRCTable();
-            {
-                TimeStamp start;
-                int bytes = homebrew_png2( image, w, h );
-                TimeStamp stop;
-                std::cerr << "homebrew2:\t" << TimeStamp::delta( start, stop ) << " ("<< bytes << " bytes)\n";
-            }
-            {
-                TimeStamp start;
-                int bytes = homebrew_png3( image, w, h );
-                TimeStamp stop;
-                std::cerr << "homebrew3:\t" << TimeStamp::delta( start, stop ) << " ("<< bytes << " bytes)\n";
-            }
-            {
-                std::cerr << "homebrew4:\t";
-                int bytes = homebrew_png4( &thread_pool, image, w, h );
-                std::cerr << " ("<< bytes << " bytes)\n";
-            }
-            {
-                std::cerr << "homebrew4_mc:\t";
-                int bytes = homebrew_png4_mc( &thread_pool, image, w, h );
-                std::cerr << " ("<< bytes << " bytes)\n";
-            }
-
-            {
-                TimeStamp start;
-                int bytes = libjpeg_turbo_wrap( image, w, h );
-                TimeStamp stop;
-                std::cerr << "libjpeg_turbo_wrap:\t" << TimeStamp::delta( start, stop ) << " ("<< bytes << " bytes)\n";
-            }
-            
-        }
-        
+            }
+        }
     }
-    
-    
-    
-    
-    return 0;
+
+    if( pareto ) {
+        printParetoReport( std::cout, results, bandwidth );
+    }
+    if( !csv_file.empty() ) {
+        std::ofstream csv( csv_file.c_str() );
+        writeResultsCSV( csv, results );
+    }
+    if( !json_file.empty() ) {
+        std::ofstream json( json_file.c_str() );
+        writeResultsJSON( json, results );
+    }
+    if( !trace_file.empty() ) {
+        Trace::write( trace_file );
+    }
+    if( !save_baseline_file.empty() && !writeBaseline( save_baseline_file, results ) ) {
+        return -1;
+    }
+    int regressions = 0;
+    if( !baseline_file.empty() ) {
+        regressions = compareWithBaseline( std::cout, baseline, results, baseline_options );
+    }
+
+    return verify_failures == 0 && regressions == 0 ? 0 : -1;
 }
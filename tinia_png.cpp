@@ -18,8 +18,11 @@
 
 #include <zlib.h>
 #include <iostream>
+#include <cstring>
 #include "timer.hpp"
+#include "PerfCounters.hpp"
 #include "tinia_png.hpp"
+#include "EncoderRegistry.hpp"
 
 static unsigned int crc_table[256];
 
@@ -40,7 +43,6 @@ create_crc_table()
     }
 }
     
-static
 unsigned int
 trell_png_crc( unsigned char* p, size_t length )
 {
@@ -56,23 +58,21 @@ trell_png_crc( unsigned char* p, size_t length )
 
 int
 tinia_png( double& seconds_in_zlib,
-           const std::vector<char> &rgb,
+           const ImageBuffer& rgb,
               const int w,
-              const int h, int compression )
+              const int h, int compression,
+              OutputSink& out )
 {
-    std::vector<unsigned char> filtered( 3*(w+1)*h );
+    const size_t stride = pixelBytes( rgb.format() )*(size_t)w;
+    std::vector<unsigned char> filtered( (stride+1)*h );
 
     for( int j=0; j<h; j++ ) {
-        filtered[ 3*(w+1)*j + 0 ] = 0;
-        for( int i=0; i<w; i++ ) {
-            filtered[ (3*w+1)*j + 1 + 3*i + 0 ] = rgb[ 3*w*(j) + 3*i + 0 ];
-            filtered[ (3*w+1)*j + 1 + 3*i + 1 ] = rgb[ 3*w*(j) + 3*i + 1 ];
-            filtered[ (3*w+1)*j + 1 + 3*i + 2 ] = rgb[ 3*w*(j) + 3*i + 2 ];
-        }
+        filtered[ (stride+1)*j + 0 ] = 0;
+        memcpy( filtered.data() + (stride+1)*j + 1, rgb.data() + stride*j, stride );
     }
 
     
-    uLong bound = compressBound( (3*w+1)*h );
+    uLong bound = compressBound( (stride+1)*h );
 
     std::vector<unsigned char> png( bound + 8 + 25 + 12 + 12 + 12 );
     unsigned char* p = png.data();
@@ -97,8 +97,8 @@ tinia_png( double& seconds_in_zlib,
     *p++ = ((h)>>16)&0xffu;
     *p++ = ((h)>>8)&0xffu;
     *p++ = ((h)>>0)&0xffu;
-    *p++ = 8;                  // 8 bits per channel
-    *p++ = 2;                  // RGB triple
+    *p++ = pixelBitDepth( rgb.format() );  // bits per channel
+    *p++ = pngColorType( rgb.format() );   // colour type
     *p++ = 0;
     *p++ = 0;
     *p++ = 0;                  // image not interlaced
@@ -113,12 +113,13 @@ tinia_png( double& seconds_in_zlib,
 
     int c;
     {
+        StageCounters stage( "zlib" );
         TimeStamp start;
         if( compression < 0 ) {
-            c = compress( (Bytef*)(p+8), &bound, (Bytef*)filtered.data(), (3*w+1)*h );
+            c = compress( (Bytef*)(p+8), &bound, (Bytef*)filtered.data(), (stride+1)*h );
         }
         else {
-            c = compress2( (Bytef*)(p+8), &bound, (Bytef*)filtered.data(), (3*w+1)*h, compression );
+            c = compress2( (Bytef*)(p+8), &bound, (Bytef*)filtered.data(), (stride+1)*h, compression );
         }
         TimeStamp stop;
         seconds_in_zlib = TimeStamp::delta( start, stop );
@@ -163,13 +164,37 @@ tinia_png( double& seconds_in_zlib,
     *p++ = 96;
     *p++ = 130;
     
-    FILE* of = fopen( "tinia.png", "wb" );
-    fwrite( png.data(), 1, p-png.data(), of );
-    fclose( of);
+    out.write( png.data(), p-png.data() );
+    out.flush();
 
     return p-png.data();
 }
 
+template<int level>
+static
+int
+tinia_png_level( ThreadPool* thread_pool,
+                 const ImageBuffer& rgb,
+                 const int w,
+                 const int h,
+                 OutputSink& out )
+{
+    double seconds_in_zlib;
+    return tinia_png( seconds_in_zlib, rgb, w, h, level, out );
+}
+
+static EncoderRegistrar tinia_png_default( "tinia_png", tinia_png_level<-1>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar tinia_png_0( "tinia_png0", tinia_png_level<0>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar tinia_png_1( "tinia_png1", tinia_png_level<1>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar tinia_png_2( "tinia_png2", tinia_png_level<2>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar tinia_png_3( "tinia_png3", tinia_png_level<3>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar tinia_png_4( "tinia_png4", tinia_png_level<4>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar tinia_png_5( "tinia_png5", tinia_png_level<5>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar tinia_png_6( "tinia_png6", tinia_png_level<6>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar tinia_png_7( "tinia_png7", tinia_png_level<7>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar tinia_png_8( "tinia_png8", tinia_png_level<8>, ".png", false, PIXEL_FORMATS_PNG );
+static EncoderRegistrar tinia_png_9( "tinia_png9", tinia_png_level<9>, ".png", false, PIXEL_FORMATS_PNG );
+
 
 #if 0
 
@@ -1,11 +1,17 @@
 #pragma once
 #include <vector>
+#include "ImageBuffer.hpp"
+#include "OutputSink.hpp"
 
 void
 create_crc_table();
 
+unsigned int
+trell_png_crc( unsigned char* p, size_t length );
+
 int
 tinia_png( double& seconds_in_zlib,
-           const std::vector<char> &rgb,
+           const ImageBuffer& rgb,
               const int w,
-              const int h , int compression);
+              const int h , int compression,
+              OutputSink& out );